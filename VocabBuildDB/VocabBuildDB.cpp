@@ -44,39 +44,46 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "defines.h"
 #include "keys2.h"
 #include "VocabTree.h"
+#include "VocabWordCache.h"
+
+/* Number of images handed to each worker thread per block */
+#define IMAGES_PER_THREAD 16
+
+/* An image read and quantized by a worker, waiting to be added */
+typedef struct {
+    int num_keys;                     /* Number of features kept */
+    std::vector<unsigned long> words; /* Word id of each feature */
+} db_image_t;
 
 unsigned char *ReadAndFilterKeys(const char *keyfile, int dim, 
                                  double min_feature_scale, 
                                  int max_keys, int &num_keys_out)
 {
-    short int *keys;
+    unsigned char *keys;
     keypt_t *info = NULL;
     int num_keys = ReadKeyFile(keyfile, &keys, &info);
     
     if (num_keys == 0) {
+        delete [] keys;
+        delete [] info;
         num_keys_out = 0;
         return NULL;
     }
     
-    /* Filter keys */
-    unsigned char *keys_char = new unsigned char[num_keys * dim];
-        
+    /* Filter keys, compacting them in place */
     int num_keys_filtered = 0;
     if (min_feature_scale == 0.0 && max_keys == 0) {
-        for (int j = 0; j < num_keys * dim; j++) {
-            keys_char[j] = (unsigned char) keys[j];
-        }
         num_keys_filtered = num_keys;
     } else {
         for (int j = 0; j < num_keys; j++) {
             if (info[j].scale < min_feature_scale)
                 continue;
             
-            for (int k = 0; k < dim; k++) {
-                keys_char[num_keys_filtered * dim + k] = 
-                    (unsigned char) keys[j * dim + k];
+            if (num_keys_filtered != j) {
+                memcpy(keys + num_keys_filtered * dim, keys + j * dim, dim);
             }
             
             num_keys_filtered++;
@@ -86,22 +93,85 @@ unsigned char *ReadAndFilterKeys(const char *keyfile, int dim,
         }
     }
 
-    delete [] keys;
-
     if (info != NULL) 
         delete [] info;
 
     num_keys_out = num_keys_filtered;
 
-    return keys_char;
+    return keys;
+}
+
+/* Read the keys of a database image and map them to words.  If
+ * use_cache is set, the words are taken from the word cache of the key
+ * file when it is valid for the tree (with the given checksum), and
+ * the cache is written otherwise.  Only image is modified, so this
+ * can be called from several threads at once */
+void QuantizeImage(const VocabTree &tree, const char *keyfile, int dim,
+                   double min_feature_scale, bool use_cache, 
+                   unsigned int cache_checksum, db_image_t &image)
+{
+    if (use_cache) {
+        ImageWords cached;
+        cached.ReadOrQuantize(tree, cache_checksum, keyfile);
+        image.num_keys = cached.Select(min_feature_scale, 0, image.words);
+        return;
+    }
+
+    int num_keys = 0;
+    unsigned char *keys = ReadAndFilterKeys(keyfile, dim, min_feature_scale,
+                                            0, num_keys);
+
+    image.num_keys = num_keys;
+    image.words.resize(num_keys);
+
+    if (num_keys > 0) {
+        tree.QuantizeBatch(num_keys, keys, &(image.words[0]));
+        delete [] keys;
+    }
+}
+
+/* Take the --bow-cache and --incremental flags out of argv, leaving
+ * the positional arguments */
+static void parse_options(int &argc, char **argv, bool &use_cache,
+                          bool &incremental)
+{
+    int argc_out = 1;
+
+    use_cache = incremental = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bow-cache") == 0)
+            use_cache = true;
+        else if (strcmp(argv[i], "--incremental") == 0)
+            incremental = true;
+        else
+            argv[argc_out++] = argv[i];
+    }
+
+    argc = argc_out;
 }
 
 int main(int argc, char **argv) 
 {
-    if (argc < 4 || argc > 8) {
+    bool use_cache, incremental;
+    parse_options(argc, argv, use_cache, incremental);
+
+    if (argc < 4 || argc > 10) {
         printf("Usage: %s <list.in> <tree.in> <db.out> [use_tfidf:1] "
-               "[normalize:1] [start_id:0] [distance_type:1]\n",
+               "[normalize:1] [start_id:0] [distance_type:1] "
+               "[mapped:0] [num_threads:1] [--bow-cache] "
+               "[--incremental]\n",
                argv[0]);
+        printf("  --bow-cache: take the words of each key file from its "
+               "word cache\n"
+               "               (<file>.<checksum>.bow) if one was written "
+               "for this tree,\n"
+               "               and write it otherwise\n");
+        printf("  --incremental: write an incremental database, holding "
+               "raw counts, that\n"
+               "               VocabUpdateDB can add images to and remove "
+               "images from\n"
+               "               (if mapped, a raw database, which can't "
+               "be updated)\n");
 
         return 1;
     }
@@ -115,6 +185,8 @@ int main(int argc, char **argv)
     char *db_out = argv[3];
     DistanceType distance_type = DistanceMin;
     int start_id = 0;
+    bool mapped = false;
+    int num_threads = 1;
 
     if (argc >= 5)
         use_tfidf = atoi(argv[4]);
@@ -128,6 +200,15 @@ int main(int argc, char **argv)
     if (argc >= 8)
         distance_type = (DistanceType) atoi(argv[7]);
 
+    if (argc >= 9)
+        mapped = (atoi(argv[8]) != 0);
+
+    if (argc >= 10)
+        num_threads = atoi(argv[9]);
+
+    if (num_threads < 1)
+        num_threads = 1;
+
     switch (distance_type) {
     case DistanceDot:
         printf("[VocabMatch] Using distance Dot\n");
@@ -179,31 +260,86 @@ int main(int argc, char **argv)
 
     tree.ClearDatabase();
 
-    for (int i = 0; i < num_db_images; i++) {
-        int num_keys = 0;
-        unsigned char *keys = ReadAndFilterKeys(key_files[i].c_str(), 
-                                                dim, min_feature_scale,
-                                                0, num_keys);
+    if (incremental)
+        tree.StartIncrementalDatabase(use_tfidf, normalize);
+
+    /* The checksum of the flattened tree keys the word caches */
+    unsigned int cache_checksum = 0;
+    if (use_cache) {
+        cache_checksum = tree.Checksum();
+        printf("[VocabBuildDB] Using word caches for tree checksum "
+               "%08x\n", cache_checksum);
+    }
+
+    printf("[VocabBuildDB] Adding %d images with %d thread(s)...\n",
+           num_db_images, num_threads);
+    fflush(stdout);
 
-        printf("[VocabBuildDB] Adding vector %d (%d keys)\n", 
-               start_id + i, num_keys);
-        tree.AddImageToDatabase(start_id + i, num_keys, keys);
+    /* The images are read and quantized a block at a time, in
+     * parallel.  While the workers fill in one block, one thread
+     * adds the previous block to the database, in image order, so
+     * the database does not depend on the number of threads. */
+    int block_size = num_threads * IMAGES_PER_THREAD;
+    std::vector<db_image_t> blocks[2];
+    blocks[0].resize(block_size);
+    blocks[1].resize(block_size);
+
+    for (int b = 0; b < num_db_images + block_size; b += block_size) {
+        int block_end = MIN(b + block_size, num_db_images);
+        std::vector<db_image_t> &curr = blocks[(b / block_size) % 2];
+        std::vector<db_image_t> &prev = blocks[(b / block_size + 1) % 2];
+
+#pragma omp parallel num_threads(num_threads)
+        {
+#pragma omp single nowait
+            {
+                int prev_end = MIN(b, num_db_images);
+                for (int i = MAX(b - block_size, 0); i < prev_end; i++) {
+                    db_image_t &image = prev[i % block_size];
+
+                    printf("[VocabBuildDB] Adding vector %d (%d keys)\n", 
+                           start_id + i, image.num_keys);
+
+                    tree.AddWordsToDatabase(start_id + i, image.num_keys,
+                                            image.num_keys > 0 ? 
+                                            &(image.words[0]) : NULL);
+                    count += image.num_keys;
+
+                    std::vector<unsigned long>().swap(image.words);
+                }
+            }
 
-        if (num_keys > 0) 
-            delete [] keys;
+#pragma omp for schedule(dynamic)
+            for (int i = b; i < block_end; i++) {
+                QuantizeImage(tree, key_files[i].c_str(), dim, 
+                              min_feature_scale, use_cache, 
+                              cache_checksum, curr[i - b]);
+            }
+        }
     }
 
     printf("[VocabBuildDB] Pushed %lu features\n", count);
     fflush(stdout);
 
-    if (use_tfidf)
-        tree.ComputeTFIDFWeights(num_db_images);
+    if (incremental) {
+        tree.UpdateWeights();
+    } else {
+        if (use_tfidf)
+            tree.ComputeTFIDFWeights(num_db_images);
 
-    if (normalize) 
-        tree.NormalizeDatabase(start_id, num_db_images);
+        if (normalize) 
+            tree.NormalizeDatabase(start_id, num_db_images);
+    }
 
     printf("[VocabBuildDB] Writing database ...\n");
-    tree.Write(db_out);
+    if (mapped) {
+        /* Write the packed, mapped format (with raw counts, for an
+         * incremental database) */
+        tree.FreezeDatabase(incremental);
+        tree.WriteMapped(db_out);
+    } else {
+        tree.Write(db_out);
+    }
 
     // char filename[256];
     // sprintf(filename, "vectors_%03d.txt", start_id);
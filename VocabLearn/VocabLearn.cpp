@@ -42,17 +42,117 @@
 #include <string.h>
 #include <time.h>
 
+#include <sys/stat.h>
+#include <zlib.h>
+
 #include "VocabTree.h"
 #include "keys2.h"
 #include "defines.h"
 
-#define MAX_ARRAY_SIZE 8388608 // 2 ** 23
+/* Take the k-means options (--name value) out of argv, leaving the
+ * positional arguments.  Returns -1 on an unknown or incomplete
+ * option. */
+static int parse_kmeans_options(int &argc, char **argv, 
+                                KMeansOptions &options,
+                                const char *&telemetry_out)
+{
+    int argc_out = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            argv[argc_out++] = argv[i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--quiet") == 0) {
+            options.verbose = 0;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            printf("Option %s needs a value\n", argv[i]);
+            return -1;
+        }
+
+        const char *value = argv[++i];
+
+        if (strcmp(argv[i - 1], "--max-rounds") == 0) {
+            options.max_rounds = atoi(value);
+        } else if (strcmp(argv[i - 1], "--changed-tol") == 0) {
+            options.changed_tolerance = atof(value);
+        } else if (strcmp(argv[i - 1], "--error-tol") == 0) {
+            options.error_tolerance = atof(value);
+        } else if (strcmp(argv[i - 1], "--time-budget") == 0) {
+            options.time_budget = atof(value);
+        } else if (strcmp(argv[i - 1], "--telemetry") == 0) {
+            telemetry_out = value;
+        } else {
+            printf("Unknown option %s\n", argv[i - 1]);
+            return -1;
+        }
+    }
+
+    argc = argc_out;
+    return 0;
+}
+
+/* Checksum of the key files a descriptor store is filled from: their
+ * names, sizes and modification times, in list order */
+static unsigned int key_list_checksum(const std::vector<std::string> &files)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    for (int i = 0; i < (int) files.size(); i++) {
+        const char *name = files[i].c_str();
+        crc = crc32(crc, (const Bytef *) name, strlen(name) + 1);
+
+        struct stat st;
+        std::string gz = files[i] + ".gz";
+        unsigned long long stamp[2] = { 0, 0 };
+
+        if (stat(name, &st) == 0 || stat(gz.c_str(), &st) == 0) {
+            stamp[0] = (unsigned long long) st.st_size;
+            stamp[1] = (unsigned long long) st.st_mtime;
+        }
+
+        crc = crc32(crc, (const Bytef *) stamp, sizeof(stamp));
+    }
+
+    return (unsigned int) crc;
+}
 
 int main(int argc, char **argv) 
 {
-    if (argc != 6) {
+    KMeansOptions options;
+    const char *telemetry_out = NULL;
+
+    if (parse_kmeans_options(argc, argv, options, telemetry_out) != 0 ||
+        argc < 6 || argc > 10) {
         printf("Usage: %s <list.in> <depth> <branching_factor> "
-               "<restarts> <tree.out>\n", argv[0]);
+               "<restarts> <tree.out> [seed:1] [init:0] [store.in] "
+               "[assign:0]\n", 
+               argv[0]);
+        printf("  init: 0 = random, 1 = k-means++, 2 = k-means||\n");
+        printf("  store: descriptor store file; if given, features are "
+               "kept in this\n"
+               "         memory-mapped file rather than in memory, and "
+               "a store left by\n"
+               "         an earlier run on the same list is reused "
+               "(- for none)\n");
+        printf("  assign: 0 = approximate kd-tree search, "
+               "1 = exact, with Hamerly's bounds\n");
+        printf("Options, for each k-means run (one per tree node):\n");
+        printf("  --max-rounds <n>     stop after n rounds\n");
+        printf("  --changed-tol <f>    stop once at most this fraction "
+               "of the features\n"
+               "                       change cluster (default 0.05)\n");
+        printf("  --error-tol <f>      stop once a round improves the "
+               "error by at most\n"
+               "                       this fraction\n");
+        printf("  --time-budget <s>    stop after s seconds\n");
+        printf("  --telemetry <file>   write a JSON record per round "
+               "to file\n");
+        printf("  --quiet              don't print each round\n");
         return 1;
     }
 
@@ -61,9 +161,30 @@ int main(int argc, char **argv)
     int bf = atoi(argv[3]);
     int restarts = atoi(argv[4]);
     const char *tree_out = argv[5];
+    unsigned int seed = 1;
+    KMeansInit init = KMeansInitRandom;
+    const char *store_in = NULL;
+    KMeansAssign assign = KMeansAssignKdTree;
+
+    if (argc >= 7)
+        seed = (unsigned int) atoi(argv[6]);
+
+    if (argc >= 8)
+        init = (KMeansInit) atoi(argv[7]);
+
+    if (argc >= 9 && strcmp(argv[8], "-") != 0)
+        store_in = argv[8];
+
+    if (argc >= 10)
+        assign = (KMeansAssign) atoi(argv[9]);
+
+    /* All randomness in k-means derives from this seed, so a given
+     * seed gives the same tree for any number of threads */
+    srand(seed);
 
     printf("Building tree with depth: %d, branching factor: %d, "
-           "and restarts: %d\n", depth, bf, restarts);
+           "restarts: %d, seed: %u, init: %d, and assign: %d\n", 
+           depth, bf, restarts, seed, (int) init, (int) assign);
 
     FILE *f = fopen(list_in, "r");
     if (f == NULL) {
@@ -102,71 +223,88 @@ int main(int argc, char **argv)
     fflush(stdout);
 
     int dim = 128;
-    unsigned long long len = (unsigned long long) total_keys * dim;
+    DescriptorSet descs;
 
-    int num_arrays = 
-        len / MAX_ARRAY_SIZE + ((len % MAX_ARRAY_SIZE) == 0 ? 0 : 1);
-
-    unsigned char **vs = new unsigned char *[num_arrays];
+    bool store_exists = false;
+    if (store_in != NULL) {
+        FILE *f_store = fopen(store_in, "rb");
+        if (f_store != NULL) {
+            store_exists = true;
+            fclose(f_store);
+        }
+    }
 
-    printf("Allocating %llu bytes in total, in %d arrays\n", len, num_arrays);
+    /* Reuse a store only if it was filled, completely, from the same
+     * key files */
+    unsigned int list_checksum = key_list_checksum(key_files);
 
-    unsigned long long total = 0;
-    for (int i = 0; i < num_arrays; i++) {
-        unsigned long long remainder = len - total;
-        unsigned long len_curr = MIN(remainder, MAX_ARRAY_SIZE);
+    if (store_exists && descs.Open(store_in) == 0 && descs.m_complete &&
+        descs.m_source_checksum == list_checksum &&
+        descs.m_num_descriptors == total_keys && descs.m_dim == dim) {
+        printf("Reusing descriptor store %s\n", store_in);
+        fflush(stdout);
+    } else {
+        int ret;
+        if (store_in != NULL) {
+            printf("Creating descriptor store %s (%llu bytes)\n", store_in,
+                   (unsigned long long) total_keys * dim);
+            ret = descs.Create(store_in, total_keys, dim, list_checksum);
+        } else {
+            printf("Allocating %llu bytes\n", 
+                   (unsigned long long) total_keys * dim);
+            ret = descs.Allocate(total_keys, dim);
+        }
 
-        printf("Allocating array of size %lu\n", len_curr);
         fflush(stdout);
-        vs[i] = new unsigned char[len_curr];
 
-        remainder -= len_curr;
-    }
+        if (ret != 0)
+            return 1;
 
-    /* Create the array of pointers */
-    printf("Allocating pointer array of size %lu\n", 4 * total_keys);
-    fflush(stdout);
+        unsigned long curr_key = 0;
+        for (int i = 0; i < num_files; i++) {
+            printf("  Reading keyfile %s\n", key_files[i].c_str());
+            fflush(stdout);
 
-    unsigned char **vp = new unsigned char *[total_keys];
-    
-    unsigned long off = 0;
-    unsigned long curr_key = 0;
-    int curr_array = 0;
-    for (int i = 0; i < num_files; i++) {
-        printf("  Reading keyfile %s\n", key_files[i].c_str());
-        fflush(stdout);
+            unsigned char *keys;
+            int num_keys = 0;
+
+            num_keys = ReadKeyFile(key_files[i].c_str(), &keys);
+
+            if (num_keys > 0) {
+                /* Guard against files that changed since they were
+                 * counted */
+                if (curr_key + num_keys > total_keys)
+                    num_keys = total_keys - curr_key;
 
-        short int *keys;
-        int num_keys = 0;
-
-        keypt_t *info = NULL;
-        num_keys = ReadKeyFile(key_files[i].c_str(), &keys);
-
-        if (num_keys > 0) {
-            for (int j = 0; j < num_keys; j++) {
-                for (int k = 0; k < dim; k++) {
-                    vs[curr_array][off + k] = keys[j * dim + k];
-                }
-                
-                vp[curr_key] = vs[curr_array] + off;
-                curr_key++;
-                off += dim;
-                if (off == MAX_ARRAY_SIZE) {
-                    off = 0;
-                    curr_array++;
-                }
+                memcpy(descs.GetDescriptor(curr_key), keys, 
+                       (size_t) num_keys * dim);
+                curr_key += num_keys;
             }
 
             delete [] keys;
+        }
+
+        if (descs.MarkComplete() != 0)
+            return 1;
+    }
 
-            if (info != NULL)
-                delete [] info;
+    if (telemetry_out != NULL) {
+        options.telemetry = fopen(telemetry_out, "w");
+        if (options.telemetry == NULL) {
+            printf("Could not open file: %s\n", telemetry_out);
+            return 1;
         }
     }
 
     VocabTree tree;
-    tree.Build(total_keys, dim, depth, bf, restarts, vp);
+    if (tree.Build(descs, depth, bf, restarts, init, assign, 
+                   &options) != 0)
+        return 1;
+
     tree.Write(tree_out);
 
+    if (options.telemetry != NULL)
+        fclose(options.telemetry);
+
     return 0;
 }
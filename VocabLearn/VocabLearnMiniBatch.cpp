@@ -0,0 +1,73 @@
+/* VocabLearnMiniBatch.cpp */
+/* Driver for learning a vocabulary tree with mini-batch kmeans, for
+ * training sets too large to load into memory */
+
+#include <string>
+#include <vector>
+#include <string.h>
+
+#include "VocabTree.h"
+
+int main(int argc, char **argv)
+{
+    if (argc < 7 || argc > 9) {
+        printf("Usage: %s <list.in> <depth> <branching_factor> "
+               "<batch_size> <batches_per_level> <tree.out> "
+               "[seed:1] [init:1]\n", argv[0]);
+        printf("  init: 0 = random, 1 = k-means++, 2 = k-means||\n");
+        return 1;
+    }
+
+    const char *list_in = argv[1];
+    int depth = atoi(argv[2]);
+    int bf = atoi(argv[3]);
+    int batch_size = atoi(argv[4]);
+    int num_batches = atoi(argv[5]);
+    const char *tree_out = argv[6];
+    unsigned int seed = 1;
+    KMeansInit init = KMeansInitPlusPlus;
+
+    if (argc >= 8)
+        seed = (unsigned int) atoi(argv[7]);
+
+    if (argc >= 9)
+        init = (KMeansInit) atoi(argv[8]);
+
+    if (bf < 2 || batch_size < 1 || num_batches < 1) {
+        printf("Error: branching_factor must be at least 2, and "
+               "batch_size and batches_per_level at least 1\n");
+        return 1;
+    }
+
+    srand(seed);
+
+    FILE *f = fopen(list_in, "r");
+    if (f == NULL) {
+        printf("Could not open file: %s\n", list_in);
+        return 1;
+    }
+
+    std::vector<std::string> key_files;
+    char buf[256];
+    while (fgets(buf, 256, f)) {
+        /* Remove trailing newline */
+        if (buf[strlen(buf) - 1] == '\n')
+            buf[strlen(buf) - 1] = 0;
+
+        key_files.push_back(std::string(buf));
+    }
+
+    fclose(f);
+
+    printf("Sampling features from %d key files\n", (int) key_files.size());
+    fflush(stdout);
+
+    VocabTree tree;
+    if (tree.BuildMiniBatch(key_files, 128, depth, bf,
+                            batch_size, num_batches, init) != 0)
+        return 1;
+
+    tree.Write(tree_out);
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+/* DescriptorSet.cpp */
+/* A contiguous set of byte descriptors, in memory or in a mapped file */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "DescriptorSet.h"
+
+int DescriptorSet::Allocate(unsigned int n, int dim)
+{
+    Clear();
+
+    m_data = new (std::nothrow) unsigned char[(size_t) n * dim];
+
+    if (m_data == NULL) {
+        printf("[DescriptorSet::Allocate] Error allocating %u "
+               "descriptors\n", n);
+        return -1;
+    }
+
+    m_num_descriptors = n;
+    m_dim = dim;
+
+    return 0;
+}
+
+int DescriptorSet::Create(const char *filename, unsigned int n, int dim,
+                          unsigned int source_checksum)
+{
+    Clear();
+
+#ifndef WIN32
+    descriptor_set_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DESCRIPTOR_SET_MAGIC, 4);
+    h.version = DESCRIPTOR_SET_VERSION;
+    h.dim = dim;
+    h.num_descriptors = n;
+    h.data_offset = sizeof(h);
+    h.source_checksum = source_checksum;
+
+    size_t size = sizeof(h) + (size_t) n * dim;
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("[DescriptorSet::Create] Error opening file %s for "
+               "writing\n", filename);
+        return -1;
+    }
+
+    if (ftruncate(fd, size) != 0) {
+        printf("[DescriptorSet::Create] Error resizing %s to %lu bytes\n",
+               filename, (unsigned long) size);
+        close(fd);
+        return -1;
+    }
+
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        printf("[DescriptorSet::Create] Error mapping file %s\n", filename);
+        return -1;
+    }
+
+    m_map = (char *) addr;
+    m_map_size = size;
+    memcpy(m_map, &h, sizeof(h));
+
+    m_data = (unsigned char *) (m_map + h.data_offset);
+    m_num_descriptors = n;
+    m_dim = dim;
+    m_source_checksum = source_checksum;
+
+    return 0;
+#else
+    printf("[DescriptorSet::Create] Error: descriptor store files are "
+           "not supported on this platform\n");
+    return -1;
+#endif
+}
+
+int DescriptorSet::MarkComplete()
+{
+    if (m_map == NULL)
+        return 0;
+
+#ifndef WIN32
+    /* Write the descriptors out before the flag, so the flag is never
+     * on disk ahead of them */
+    if (msync(m_map, m_map_size, MS_SYNC) != 0) {
+        printf("[DescriptorSet::MarkComplete] Error writing the "
+               "descriptors\n");
+        return -1;
+    }
+
+    descriptor_set_header_t *h = (descriptor_set_header_t *) m_map;
+    h->flags |= DESCRIPTOR_SET_COMPLETE;
+    msync(m_map, sizeof(descriptor_set_header_t), MS_SYNC);
+#endif
+
+    m_complete = true;
+
+    return 0;
+}
+
+int DescriptorSet::Open(const char *filename)
+{
+    Clear();
+
+#ifndef WIN32
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("[DescriptorSet::Open] Error opening file %s for reading\n",
+               filename);
+        return -1;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    size_t size = (size_t) st.st_size;
+
+    char *map = NULL;
+    if (size >= sizeof(descriptor_set_header_t)) {
+        void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED)
+            map = (char *) addr;
+    }
+
+    close(fd);
+
+    if (map == NULL) {
+        printf("[DescriptorSet::Open] Error mapping file %s\n", filename);
+        return -1;
+    }
+
+    m_map = map;
+    m_map_size = size;
+
+    const descriptor_set_header_t *h = (const descriptor_set_header_t *) map;
+    if (memcmp(h->magic, DESCRIPTOR_SET_MAGIC, 4) != 0 ||
+        h->version != DESCRIPTOR_SET_VERSION ||
+        h->data_offset + h->num_descriptors * h->dim > size) {
+        printf("[DescriptorSet::Open] Error: %s is not a version %d "
+               "descriptor store, or is truncated\n",
+               filename, DESCRIPTOR_SET_VERSION);
+        Clear();
+        return -1;
+    }
+
+    /* The builder mostly visits the descriptors in a data-dependent
+     * order; don't let the kernel read far ahead */
+    madvise(m_map, m_map_size, MADV_RANDOM);
+
+    m_data = (unsigned char *) (map + h->data_offset);
+    m_num_descriptors = (unsigned int) h->num_descriptors;
+    m_dim = h->dim;
+    m_source_checksum = h->source_checksum;
+    m_complete = (h->flags & DESCRIPTOR_SET_COMPLETE) != 0;
+
+    return 0;
+#else
+    printf("[DescriptorSet::Open] Error: descriptor store files are "
+           "not supported on this platform\n");
+    return -1;
+#endif
+}
+
+void DescriptorSet::Clear()
+{
+    if (m_map != NULL) {
+#ifndef WIN32
+        munmap(m_map, m_map_size);
+#endif
+    } else if (m_data != NULL) {
+        delete [] m_data;
+    }
+
+    m_map = NULL;
+    m_map_size = 0;
+    m_data = NULL;
+    m_num_descriptors = 0;
+    m_dim = 0;
+    m_source_checksum = 0;
+    m_complete = false;
+}
@@ -0,0 +1,80 @@
+/* DescriptorSet.h */
+/* A contiguous set of byte descriptors, in memory or in a mapped file */
+
+#ifndef __DESCRIPTOR_SET_H__
+#define __DESCRIPTOR_SET_H__
+
+#include <stddef.h>
+
+/* Layout of a descriptor store file: this header, followed by
+ * num_descriptors * dim bytes starting at data_offset.  Version 2 adds
+ * the checksum of the source the store is filled from, and a flag set
+ * once it has been filled. */
+#define DESCRIPTOR_SET_MAGIC "VTDS"
+#define DESCRIPTOR_SET_VERSION 2
+
+#define DESCRIPTOR_SET_COMPLETE 0x1  /* All descriptors were written */
+
+typedef struct {
+    char magic[4];                  /* DESCRIPTOR_SET_MAGIC */
+    unsigned int version;           /* DESCRIPTOR_SET_VERSION */
+    unsigned int dim;               /* Bytes per descriptor */
+    unsigned int flags;             /* DESCRIPTOR_SET_COMPLETE */
+    unsigned long long num_descriptors;
+    unsigned long long data_offset; /* Offset of the descriptors */
+    unsigned int source_checksum;   /* Checksum of the source (e.g., the
+                                     * key files) given to Create */
+    char pad[28];
+} descriptor_set_header_t;
+
+class DescriptorSet {
+public:
+    DescriptorSet() : m_num_descriptors(0), m_dim(0), m_data(NULL),
+                      m_source_checksum(0), m_complete(false),
+                      m_map(NULL), m_map_size(0) { }
+    ~DescriptorSet() { Clear(); }
+
+    /* Allocate room for n descriptors in memory */
+    int Allocate(unsigned int n, int dim);
+
+    /* Create a store file with room for n descriptors, and map it
+     * for writing.  The descriptors are written back to the file as
+     * the pages are evicted, so the set can be larger than memory.
+     * The checksum of the source of the descriptors is recorded so
+     * that a later run can tell whether the store is its own. */
+    int Create(const char *filename, unsigned int n, int dim,
+               unsigned int source_checksum);
+
+    /* Mark a created store as filled.  A store whose filling was
+     * interrupted is never marked, and shouldn't be reused. */
+    int MarkComplete();
+
+    /* Map an existing store file, read-only */
+    int Open(const char *filename);
+
+    /* Release the descriptors (unmapping the file, if any) */
+    void Clear();
+
+    bool IsMapped() const { return m_map != NULL; }
+
+    unsigned char *GetDescriptor(unsigned int i)
+        { return m_data + (size_t) i * m_dim; }
+    const unsigned char *GetDescriptor(unsigned int i) const
+        { return m_data + (size_t) i * m_dim; }
+
+    unsigned int m_num_descriptors; /* Number of descriptors */
+    int m_dim;                      /* Bytes per descriptor */
+    unsigned char *m_data;          /* The descriptors, back to back */
+    unsigned int m_source_checksum; /* Checksum given to Create */
+    bool m_complete;                /* Has the store been filled? */
+
+private:
+    /* Copying would alias the mapping */
+    DescriptorSet(const DescriptorSet &);
+    DescriptorSet &operator=(const DescriptorSet &);
+
+    char *m_map;                    /* File mapping, if any */
+    size_t m_map_size;
+};
+
+#endif /* __DESCRIPTOR_SET_H__ */
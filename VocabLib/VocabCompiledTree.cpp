@@ -0,0 +1,168 @@
+/* VocabCompiledTree.cpp */
+/* Pointer-free, breadth-first layout of a vocabulary tree */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "VocabTree.h"
+
+using namespace ann_1_1_char;
+
+int CompiledVocabTree::Compile(const VocabTreeNode *root, int bf, int dim,
+                               std::vector<unsigned long> &node_ids)
+{
+    Clear();
+
+    /* Number the nodes in breadth-first order; the children of each
+     * node are appended to the queue together, so they end up next
+     * to each other */
+    std::vector<const VocabTreeNode *> queue;
+    std::vector<unsigned int> first_child, num_children;
+    queue.push_back(root);
+
+    for (unsigned long i = 0; i < queue.size(); i++) {
+        const VocabTreeInteriorNode *interior = 
+            dynamic_cast<const VocabTreeInteriorNode *>(queue[i]);
+
+        first_child.push_back((unsigned int) queue.size());
+
+        int count = 0;
+        if (interior != NULL) {
+            for (int j = 0; j < bf; j++) {
+                if (interior->m_children[j] != NULL) {
+                    queue.push_back(interior->m_children[j]);
+                    count++;
+                }
+            }
+        }
+
+        num_children.push_back(count);
+    }
+
+    m_num_nodes = queue.size();
+    m_dim = dim;
+    m_desc = new unsigned char[m_num_nodes * dim];
+    m_first_child = new unsigned int[m_num_nodes];
+    m_num_children = new unsigned int[m_num_nodes];
+    m_owned = true;
+
+    m_node_ids.resize(m_num_nodes);
+    for (unsigned long i = 0; i < m_num_nodes; i++) {
+        memcpy(m_desc + i * dim, queue[i]->m_desc, dim);
+        m_first_child[i] = first_child[i];
+        m_num_children[i] = num_children[i];
+        m_node_ids[i] = queue[i]->m_id;
+    }
+
+    node_ids = m_node_ids;
+
+    return 0;
+}
+
+void CompiledVocabTree::Alias(unsigned long num_nodes, int dim, 
+                              unsigned char *desc, 
+                              unsigned int *first_child, 
+                              unsigned int *num_children)
+{
+    Clear();
+
+    m_num_nodes = num_nodes;
+    m_dim = dim;
+    m_desc = desc;
+    m_first_child = first_child;
+    m_num_children = num_children;
+    m_owned = false;
+}
+
+void CompiledVocabTree::Clear()
+{
+    if (m_leaf_tree != NULL)
+        delete m_leaf_tree;
+    if (m_leaf_pts != NULL)
+        delete [] m_leaf_pts;
+
+    if (m_owned) {
+        if (m_desc != NULL)
+            delete [] m_desc;
+        if (m_first_child != NULL)
+            delete [] m_first_child;
+        if (m_num_children != NULL)
+            delete [] m_num_children;
+    }
+
+    m_num_nodes = 0;
+    m_desc = NULL;
+    m_first_child = m_num_children = NULL;
+    m_owned = false;
+    m_node_ids.clear();
+    m_leaf_nodes.clear();
+    m_leaf_pts = NULL;
+    m_leaf_tree = NULL;
+}
+
+int CompiledVocabTree::BuildLeafSearchTree()
+{
+    if (m_leaf_tree != NULL)
+        return 0;
+
+    for (unsigned long i = 0; i < m_num_nodes; i++) {
+        if (m_num_children[i] == 0)
+            m_leaf_nodes.push_back((unsigned int) i);
+    }
+
+    int num_leaves = (int) m_leaf_nodes.size();
+    if (num_leaves == 0)
+        return -1;
+
+    /* The points are the centroids themselves, in place */
+    m_leaf_pts = new ANNpoint[num_leaves];
+    for (int i = 0; i < num_leaves; i++)
+        m_leaf_pts[i] = m_desc + (unsigned long) m_leaf_nodes[i] * m_dim;
+
+    m_leaf_tree = new ANNkd_tree(m_leaf_pts, num_leaves, m_dim, 16);
+
+    annMaxPtsVisit(256);
+
+    return 0;
+}
+
+unsigned long CompiledVocabTree::QuantizeFeature(const unsigned char *v,
+                                                 unsigned long *dist) 
+    const
+{
+    if (m_leaf_tree != NULL) {
+        int nn_idx;
+        ANNdist distsq;
+
+        m_leaf_tree->annkPriSearch((ANNpoint) v, 1, &nn_idx, &distsq, 0.0);
+
+        if (dist != NULL)
+            *dist = (unsigned long) distsq;
+
+        return WordId(m_leaf_nodes[nn_idx]);
+    }
+
+    /* Descend the tree, moving to the closest child at each level;
+     * the centroids of the children are contiguous, so they are
+     * scanned with one call to the distance kernel */
+    unsigned long node = 0;
+    ANNdist min_dist = 0;
+    while (m_num_children[node] > 0) {
+        unsigned long first = m_first_child[node];
+
+        node = first + annNearestPt(m_dim, v, m_desc + first * m_dim, 
+                                    m_num_children[node], min_dist);
+    }
+
+    if (dist != NULL) {
+        /* min_dist is the distance to the leaf, unless the root is the
+         * only node */
+        if (node == 0)
+            annNearestPt(m_dim, v, m_desc, 1, min_dist);
+
+        *dist = (unsigned long) min_dist;
+    }
+
+    return WordId(node);
+}
@@ -112,6 +112,20 @@ unsigned long VocabTreeFlatNode::
     return r;
 }
 
+unsigned long VocabTreeFlatNode::QuantizeFeature(const unsigned char *v, 
+                                                 int bf, int dim, 
+                                                 unsigned long *dist) const
+{
+    int nn_idx[NUM_NNS];
+    ANNdist distsq[NUM_NNS];
+
+    /* The search visit limit is set once in BuildANNTree, so that
+     * this routine does not touch any shared state */
+    m_tree->annkPriSearch((ANNpoint) v, NUM_NNS, nn_idx, distsq, 0.0);
+
+    return m_children[nn_idx[0]]->QuantizeFeature(v, bf, dim, dist);
+}
+
 /* Create a search tree for the given set of keypoints */
 void VocabTreeFlatNode::BuildANNTree(int num_leaves, int dim)
 {
@@ -126,4 +140,6 @@ void VocabTreeFlatNode::BuildANNTree(int num_leaves, int dim)
 
     /* Create a search tree for k2 */
     m_tree = new ANNkd_tree(pts, num_leaves, dim, 16);
+
+    annMaxPtsVisit(256);
 }
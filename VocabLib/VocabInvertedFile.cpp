@@ -0,0 +1,214 @@
+/* VocabInvertedFile.cpp */
+/* Compact (CSR) inverted file used for scoring queries */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#include "VocabTree.h"
+#include "defines.h"
+
+int InvertedFile::Allocate(unsigned long num_words,
+                           const unsigned long *counts,
+                           bool raw, unsigned long num_images)
+{
+    Clear();
+
+    m_num_words = num_words;
+    m_word_start = new (std::nothrow) unsigned long[num_words + 1];
+    m_weight = new (std::nothrow) float[num_words];
+    m_owned = true;
+
+    if (m_word_start == NULL || m_weight == NULL) {
+        printf("[InvertedFile::Allocate] Error allocating %lu words\n",
+               num_words);
+        Clear();
+        return -1;
+    }
+
+    unsigned long total = 0;
+    for (unsigned long i = 0; i < num_words; i++) {
+        m_word_start[i] = total;
+        m_weight[i] = 0.0;
+        total += counts[i];
+    }
+
+    m_word_start[num_words] = total;
+    m_num_entries = total;
+
+    m_index = new (std::nothrow) unsigned int[total];
+    if (raw) {
+        m_raw_count = new (std::nothrow) unsigned short[total];
+        m_num_images = num_images;
+        m_image_norm_table.assign(num_images, 0.0);
+        m_image_norm = num_images > 0 ? &(m_image_norm_table[0]) : NULL;
+    } else {
+        m_count = new (std::nothrow) float[total];
+    }
+
+    if (m_index == NULL || (m_count == NULL && m_raw_count == NULL)) {
+        printf("[InvertedFile::Allocate] Error allocating %lu postings\n",
+               total);
+        Clear();
+        return -1;
+    }
+
+    return 0;
+}
+
+void InvertedFile::Alias(unsigned long num_words, unsigned long num_entries,
+                         unsigned long *word_start, unsigned int *index, 
+                         float *count, float *weight,
+                         unsigned short *raw_count, 
+                         unsigned long num_images, float *image_norm)
+{
+    Clear();
+
+    m_num_words = num_words;
+    m_num_entries = num_entries;
+    m_word_start = word_start;
+    m_index = index;
+    m_count = count;
+    m_weight = weight;
+    m_raw_count = raw_count;
+    m_num_images = num_images;
+    m_image_norm = image_norm;
+    m_owned = false;
+}
+
+void InvertedFile::Clear()
+{
+    if (m_owned) {
+        if (m_word_start != NULL)
+            delete [] m_word_start;
+        if (m_index != NULL)
+            delete [] m_index;
+        if (m_count != NULL)
+            delete [] m_count;
+        if (m_weight != NULL)
+            delete [] m_weight;
+        if (m_raw_count != NULL)
+            delete [] m_raw_count;
+    }
+
+    m_word_start = NULL;
+    m_index = NULL;
+    m_count = NULL;
+    m_weight = NULL;
+    m_raw_count = NULL;
+    m_image_norm = NULL;
+    m_image_norm_table.clear();
+    m_num_words = m_num_entries = m_num_images = 0;
+    m_owned = false;
+}
+
+int InvertedFile::ComputeImageNorms(DistanceType dtype, bool normalize)
+{
+    if (!IsRaw()) {
+        printf("[InvertedFile::ComputeImageNorms] Error: the postings "
+               "are already weighted\n");
+        return -1;
+    }
+
+    /* Computed here even if the magnitudes were aliased, as the
+     * aliased arrays may be read-only */
+    m_image_norm_table.assign(m_num_images, normalize ? 0.0 : 1.0);
+    m_image_norm = m_num_images > 0 ? &(m_image_norm_table[0]) : NULL;
+
+    if (!normalize)
+        return 0;
+
+    /* Sum word by word, as VocabTree::UpdateWeights does */
+    for (unsigned long w = 0; w < m_num_words; w++) {
+        for (unsigned long i = m_word_start[w]; i < m_word_start[w+1]; i++) {
+            float count = m_raw_count[i] * m_weight[w];
+            m_image_norm_table[m_index[i]] += ComputeMagnitude(dtype, count);
+        }
+    }
+
+    return 0;
+}
+
+/* Score a query against a raw inverted file, weighting and normalizing
+ * each posting as VocabTree::ApplyWeights would */
+static void score_query_raw(const InvertedFile &inv, const sp_list &q, 
+                            DistanceType dtype, float *scores, 
+                            std::vector<unsigned int> *touched)
+{
+    int n = (int) q.size();
+
+    for (int j = 0; j < n; j++) {
+        unsigned long w = q[j].first;
+        float qw = q[j].second;
+        float weight = inv.m_weight[w];
+
+        unsigned long start = inv.m_word_start[w];
+        unsigned long end = inv.m_word_start[w+1];
+
+        for (unsigned long i = start; i < end; i++) {
+            unsigned int img = inv.m_index[i];
+            float mag = inv.m_image_norm[img];
+            if (mag == 0.0)
+                continue;
+
+            float count = inv.m_raw_count[i] * weight / mag;
+            float prev = scores[img];
+
+            switch (dtype) {
+            case DistanceDot:
+                scores[img] += qw * count;
+                break;
+            case DistanceMin:
+                scores[img] += MIN(qw, count);
+                break;
+            }
+
+            if (touched != NULL && prev == 0.0 && scores[img] != 0.0)
+                touched->push_back(img);
+        }
+    }
+}
+
+int InvertedFile::ScoreQuery(const sp_list &q, DistanceType dtype,
+                             float *scores, 
+                             std::vector<unsigned int> *touched) const
+{
+    if (IsRaw()) {
+        score_query_raw(*this, q, dtype, scores, touched);
+        return 0;
+    }
+
+    int n = (int) q.size();
+
+    for (int j = 0; j < n; j++) {
+        unsigned long w = q[j].first;
+        float qw = q[j].second;
+
+        unsigned long start = m_word_start[w];
+        unsigned long end = m_word_start[w+1];
+
+        for (unsigned long i = start; i < end; i++) {
+            unsigned int img = m_index[i];
+            float prev = scores[img];
+
+            switch (dtype) {
+            case DistanceDot:
+                scores[img] += qw * m_count[i];
+                break;
+            case DistanceMin:
+                scores[img] += MIN(qw, m_count[i]);
+                break;
+            }
+
+            /* Record images the first time their score becomes
+             * non-zero */
+            if (touched != NULL && prev == 0.0 && scores[img] != 0.0)
+                touched->push_back(img);
+        }
+    }
+
+    return 0;
+}
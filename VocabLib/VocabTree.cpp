@@ -45,26 +45,23 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+
+#include <zlib.h>
+
 #include "VocabTree.h"
+#include "topk.h"
 #include "defines.h"
 #include "qsort.h"
 #include "util.h"
 
 /* Useful utility function for computing the squared distance between
- * two vectors a and b of length dim */
-static unsigned long vec_diff_normsq(int dim, 
-                                     unsigned char *a, 
-                                     unsigned char *b)
+ * two vectors a and b of length dim.  Uses the SIMD kernel selected
+ * for this CPU by the ANN library. */
+unsigned long vec_diff_normsq(int dim, 
+                              const unsigned char *a, const unsigned char *b)
 {
-    int i;
-    unsigned long normsq = 0;
-
-    for (i = 0; i < dim; i++) {
-        int d = (int) a[i] - (int) b[i];
-        normsq += d * d;
-    }
-
-    return normsq;
+    return (unsigned long) ann_1_1_char::annDistSq(dim, a, b);
 }
 
 void VocabTreeInteriorNode::Clear(int bf) 
@@ -132,6 +129,38 @@ unsigned long VocabTreeInteriorNode::
     return r;
 }
 
+unsigned long VocabTreeInteriorNode::
+    QuantizeFeature(const unsigned char *v, int bf, int dim, 
+                    unsigned long *dist) const
+{
+    unsigned long min_dist = ULONG_MAX;
+    int best_idx = 0;
+
+    for (int i = 0; i < bf; i++) {
+        if (m_children[i] != NULL) {
+            unsigned long dist = 
+                vec_diff_normsq(dim, m_children[i]->m_desc, v);
+
+            if (dist < min_dist) {
+                min_dist = dist;
+                best_idx = i;
+            }
+        }
+    }    
+
+    return m_children[best_idx]->QuantizeFeature(v, bf, dim, dist);
+}
+
+unsigned long VocabTreeLeaf::QuantizeFeature(const unsigned char *v, 
+                                             int bf, int dim, 
+                                             unsigned long *dist) const
+{
+    if (dist != NULL)
+        *dist = vec_diff_normsq(dim, m_desc, v);
+
+    return m_id;
+}
+
 unsigned long VocabTreeLeaf::PushAndScoreFeature(unsigned char *v, 
                                                  unsigned int index, 
                                                  int bf, int dim, 
@@ -390,6 +419,66 @@ int VocabTreeLeaf::GetMaxDatabaseImageIndex(int bf) const
     return max_idx;
 }
 
+int VocabTreeInteriorNode::CountPostings(int bf, unsigned long *counts) const
+{
+    for (int i = 0; i < bf; i++) {
+        if (m_children[i] != NULL) {
+            m_children[i]->CountPostings(bf, counts);
+        }
+    }
+
+    return 0;
+}
+
+int VocabTreeLeaf::CountPostings(int bf, unsigned long *counts) const
+{
+    counts[m_id] = m_image_list.size();
+    return 0;
+}
+
+int VocabTreeInteriorNode::PackPostings(int bf, InvertedFile &inv)
+{
+    for (int i = 0; i < bf; i++) {
+        if (m_children[i] != NULL) {
+            m_children[i]->PackPostings(bf, inv);
+        }
+    }
+
+    return 0;
+}
+
+int VocabTreeLeaf::PackPostings(int bf, InvertedFile &inv)
+{
+    unsigned long start = inv.m_word_start[m_id];
+    int len = (int) m_image_list.size();
+
+    assert(start + len == inv.m_word_start[m_id+1]);
+
+    for (int i = 0; i < len; i++) {
+        inv.m_index[start + i] = m_image_list[i].m_index;
+
+        if (inv.IsRaw()) {
+            float count = MIN(m_image_list[i].m_count, (float) USHRT_MAX);
+            inv.m_raw_count[start + i] = (unsigned short) count;
+        } else {
+            inv.m_count[start + i] = m_image_list[i].m_count;
+        }
+    }
+
+    inv.m_weight[m_id] = m_weight;
+
+    /* Release the memory held by the image list */
+    std::vector<ImageCount>().swap(m_image_list);
+
+    return 0;
+}
+
+/* QuantizeBatch splits batches of at least this many features across
+ * threads */
+#define QUANTIZE_PARALLEL_MIN 1024
+
+/* Next slot to fill in PopulateLeaves */
+unsigned long g_leaf_counter = 0;
 
 /* Implementations of driver functions */
 int VocabTree::PushAndScoreFeature(unsigned char *v, 
@@ -431,27 +520,34 @@ int VocabTree::NormalizeDatabase(int start_index, int num_db_images)
 double VocabTree::AddImageToDatabase(int index, int n, unsigned char *v,
                                      unsigned long *ids)
 {
-    m_root->ClearScores(m_branch_factor);
-    unsigned long off = 0;
+    /* The words are leaf ids, so number the nodes first if need be */
+    if (m_root != NULL && !IsFrozen())
+        MapWordLeaves();
 
-    // printf("[AddImageToDatabase] Adding image with %d features...\n", n);
-    // fflush(stdout);
+    std::vector<unsigned long> words(n);
+    if (n > 0)
+        QuantizeBatch(n, v, &(words[0]));
 
-    for (int i = 0; i < n; i++) {
-        unsigned long id = 
-            m_root->PushAndScoreFeature(v+off, index, m_branch_factor, m_dim);
+    if (ids != NULL)
+        std::copy(words.begin(), words.end(), ids);
 
-        if (ids != NULL)
-            ids[i] = id;
+    if (AddWordsToDatabase(index, words) != 0)
+        return 0.0;
 
-        off += m_dim;
-        fflush(stdout);
-    }
+    /* Compute the magnitude of the image vector, summing the weight of
+     * each word once per feature, in order of word id */
+    std::sort(words.begin(), words.end());
 
-    double mag = m_root->ComputeDatabaseVectorMagnitude(m_branch_factor,
-                                                        m_distance_type);
+    double mag = 0.0;
+    for (int i = 0; i < n; ) {
+        unsigned long w = words[i];
+        float score = 0.0;
 
-    m_database_images++;
+        for (; i < n && words[i] == w; i++)
+            score += m_word_leaves[w]->m_weight;
+
+        mag += ComputeMagnitude(m_distance_type, score);
+    }
 
     switch (m_distance_type) {
     case DistanceDot:
@@ -464,12 +560,82 @@ double VocabTree::AddImageToDatabase(int index, int n, unsigned char *v,
     }
 }
 
+void VocabTree::MapWordLeaves()
+{
+    if (!m_word_leaves.empty())
+        return;
+
+    if (m_num_nodes == 0) {
+        /* The tree was built in memory, so the ids haven't been set */
+        m_root->ComputeIDs(m_branch_factor, 0);
+        m_num_nodes = CountNodes();
+    }
+
+    int num_leaves = CountLeaves();
+    std::vector<VocabTreeNode *> leaves(num_leaves);
+
+    g_leaf_counter = 0;
+    m_root->PopulateLeaves(m_branch_factor, m_dim, &(leaves[0]));
+
+    unsigned long num_words = 0;
+    for (int i = 0; i < num_leaves; i++) {
+        if (leaves[i]->m_id >= num_words)
+            num_words = leaves[i]->m_id + 1;
+    }
+
+    /* PopulateLeaves only visits leaves */
+    m_word_leaves.assign(num_words, NULL);
+    for (int i = 0; i < num_leaves; i++)
+        m_word_leaves[leaves[i]->m_id] = (VocabTreeLeaf *) leaves[i];
+}
+
+int VocabTree::AddWordsToDatabase(int index, int n, 
+                                  const unsigned long *words)
+{
+    if (IsFrozen() || m_root == NULL) {
+        printf("[VocabTree::AddWordsToDatabase] Error: the database "
+               "is frozen\n");
+        return -1;
+    }
+
+    MapWordLeaves();
+
+    for (int i = 0; i < n; i++) {
+        if (words[i] >= m_word_leaves.size() || 
+            m_word_leaves[words[i]] == NULL) {
+            printf("[VocabTree::AddWordsToDatabase] Error: word %lu is "
+                   "not a leaf\n", words[i]);
+            return -1;
+        }
+    }
+
+    if (m_incremental)
+        return AddIncrementalImage(index, n, words);
+
+    for (int i = 0; i < n; i++) {
+        m_word_leaves[words[i]]->
+            AddFeatureToInvertedFile(index, m_branch_factor, m_dim);
+    }
+
+    m_database_images++;
+
+    return 0;
+}
+
 /* Returns the weighted magnitude of the query vector */
 double VocabTree::ScoreQueryKeys(int n, bool normalize, unsigned char *v, 
                                  float *scores)
 {
     qsort_descending();
 
+    if (IsIncremental())
+        UpdateWeights();
+
+    if (IsFrozen() || IsIncremental()) {
+        VocabQueryContext ctx;
+        return ScoreQueryKeysSparse(n, normalize, v, ctx, scores, NULL);
+    }
+
     /* Compute the query vector */
     m_root->ClearScores(m_branch_factor);
     unsigned long off = 0;
@@ -502,7 +668,315 @@ double VocabTree::ScoreQueryKeys(int n, bool normalize, unsigned char *v,
     return mag;
 }
 
-unsigned long g_leaf_counter = 0;
+double VocabTree::ScoreQueryKeys(int n, bool normalize, 
+                                 const unsigned char *v, 
+                                 VocabQueryContext &ctx) const
+{
+    if (!IsFrozen() && !IsIncremental()) {
+        printf("[VocabTree::ScoreQueryKeys] Error: the database must be "
+               "frozen (or incremental) for reentrant scoring\n");
+        return -1.0;
+    }
+
+    /* Reset only the scores touched by the previous query */
+    int num_touched = (int) ctx.m_touched.size();
+    for (int j = 0; j < num_touched; j++)
+        ctx.m_scores[ctx.m_touched[j]] = 0.0;
+
+    ctx.m_touched.clear();
+
+    int num_db_images = ctx.GetNumDatabaseImages();
+    float *scores = num_db_images > 0 ? &(ctx.m_scores[0]) : NULL;
+    return ScoreQueryKeysSparse(n, normalize, v, ctx, scores, 
+                                &(ctx.m_touched));
+}
+
+double VocabTree::ScoreQueryWords(int n, bool normalize, 
+                                  const unsigned long *words,
+                                  VocabQueryContext &ctx) const
+{
+    if (!IsFrozen() && !IsIncremental()) {
+        printf("[VocabTree::ScoreQueryWords] Error: the database must be "
+               "frozen (or incremental) for reentrant scoring\n");
+        return -1.0;
+    }
+
+    /* Reset only the scores touched by the previous query */
+    int num_touched = (int) ctx.m_touched.size();
+    for (int j = 0; j < num_touched; j++)
+        ctx.m_scores[ctx.m_touched[j]] = 0.0;
+
+    ctx.m_touched.clear();
+
+    /* The words index the weights directly, so reject any that are not
+     * leaves of this tree (e.g., read from a corrupt .bow file),
+     * leaving the scores zero */
+    bool frozen = IsFrozen();
+    for (int i = 0; i < n; i++) {
+        unsigned long w = words[i];
+        bool ok = frozen ? w < m_inverted_file.m_num_words :
+            (w < m_word_leaves.size() && m_word_leaves[w] != NULL);
+
+        if (!ok) {
+            printf("[VocabTree::ScoreQueryWords] Error: word %lu is "
+                   "not a leaf\n", w);
+            return -1.0;
+        }
+    }
+
+    ctx.m_words.assign(words, words + n);
+
+    int num_db_images = ctx.GetNumDatabaseImages();
+    float *scores = num_db_images > 0 ? &(ctx.m_scores[0]) : NULL;
+    return ScoreQueryWordsSparse(normalize, ctx, scores, &(ctx.m_touched));
+}
+
+int VocabQueryContext::SelectTopK(int k)
+{
+    int num_db_images = GetNumDatabaseImages();
+    if (num_db_images == 0)
+        return 0;
+
+    int num_touched = (int) m_touched.size();
+    const unsigned int *touched = num_touched > 0 ? &(m_touched[0]) : NULL;
+
+    return select_top_k(num_db_images, &(m_scores[0]), k, 
+                        &(m_perm[0]), &(m_scores_d[0]), 
+                        num_touched, touched);
+}
+
+int VocabTree::QuantizeBatch(int n, const unsigned char *v, 
+                             unsigned long *words, 
+                             unsigned long *dists) const
+{
+    if (!m_compiled.IsEmpty()) {
+#pragma omp parallel for if (n >= QUANTIZE_PARALLEL_MIN)
+        for (int i = 0; i < n; i++) {
+            words[i] = m_compiled.QuantizeFeature(v + (size_t) i * m_dim, 
+                                                  dists ? dists + i : NULL);
+        }
+
+        return 0;
+    }
+
+#pragma omp parallel for if (n >= QUANTIZE_PARALLEL_MIN)
+    for (int i = 0; i < n; i++) {
+        words[i] = m_root->QuantizeFeature(v + (size_t) i * m_dim, 
+                                           m_branch_factor, m_dim,
+                                           dists ? dists + i : NULL);
+    }
+
+    return 0;
+}
+
+/* Score a query against the frozen database, using a sparse BoW
+ * vector holding only the words hit by the query features */
+double VocabTree::ScoreQueryKeysSparse(int n, bool normalize, 
+                                       const unsigned char *v, 
+                                       VocabQueryContext &ctx,
+                                       float *scores, 
+                                       std::vector<unsigned int> *touched)
+    const
+{
+    /* Find the word each feature maps to */
+    std::vector<unsigned long> &words = ctx.m_words;
+    words.resize(n);
+    if (n > 0)
+        QuantizeBatch(n, v, &(words[0]));
+
+    return ScoreQueryWordsSparse(normalize, ctx, scores, touched);
+}
+
+double VocabTree::ScoreQueryWordsSparse(bool normalize, 
+                                        VocabQueryContext &ctx,
+                                        float *scores, 
+                                        std::vector<unsigned int> *touched)
+    const
+{
+    std::vector<unsigned long> &words = ctx.m_words;
+    int n = (int) words.size();
+
+    std::sort(words.begin(), words.end());
+
+    /* Accumulate the weights of the words into the query vector */
+    sp_list &q = ctx.m_query;
+    q.clear();
+
+    bool frozen = IsFrozen();
+
+    double mag = 0.0;
+    for (int i = 0; i < n; ) {
+        unsigned long w = words[i];
+        float weight = frozen ? m_inverted_file.m_weight[w] : 
+            m_word_leaves[w]->m_weight;
+        float score = 0.0;
+
+        for (; i < n && words[i] == w; i++)
+            score += weight;
+
+        q.push_back(sp_entry(w, score));
+        mag += ComputeMagnitude(m_distance_type, score);
+    }
+
+    if (m_distance_type == DistanceDot)
+        mag = sqrt(mag);
+
+    /* Now, compute the normalized vector */
+    double mag_inv = normalize ? 1.0 / mag : 1.0;
+    int num_words = (int) q.size();
+    for (int i = 0; i < num_words; i++)
+        q[i].second = q[i].second * mag_inv;
+
+    if (frozen)
+        m_inverted_file.ScoreQuery(q, m_distance_type, scores, touched);
+    else
+        ScoreQueryIncremental(q, scores, touched);
+
+    return mag;
+}
+
+int VocabTree::FreezeDatabase(bool raw)
+{
+    if (IsFrozen())
+        return 0;
+
+    if (m_root == NULL)
+        return -1;
+
+    if (raw && !m_incremental) {
+        printf("[VocabTree::FreezeDatabase] Error: only incremental "
+               "databases hold raw counts\n");
+        return -1;
+    }
+
+    if (m_incremental) {
+        UpdateWeights();
+
+        if (raw)
+            CompactDatabase();
+        else
+            ApplyWeights();
+    }
+
+    if (m_num_nodes == 0) {
+        /* The tree was built in memory, so the ids haven't been set */
+        m_root->ComputeIDs(m_branch_factor, 0);
+        m_num_nodes = CountNodes();
+    }
+
+    unsigned long *counts = new unsigned long[m_num_nodes];
+    for (unsigned long i = 0; i < m_num_nodes; i++)
+        counts[i] = 0;
+
+    m_root->CountPostings(m_branch_factor, counts);
+
+    unsigned long num_images = raw ? m_image_status.size() : 0;
+    if (m_inverted_file.Allocate(m_num_nodes, counts, 
+                                 raw, num_images) != 0) {
+        delete [] counts;
+        return -1;
+    }
+
+    m_root->PackPostings(m_branch_factor, m_inverted_file);
+
+    delete [] counts;
+
+    if (raw) {
+        /* The weights are kept in the leaves, and packed along with
+         * the postings; the magnitudes are moved over */
+        for (unsigned long i = 0; i < num_images; i++) {
+            m_inverted_file.m_image_norm_table[i] = 
+                m_normalize ? m_image_norms[i] : 1.0;
+        }
+
+        m_incremental = false;
+        m_weights_stale = false;
+        m_image_status.clear();
+        m_image_norms.clear();
+    }
+
+    printf("[VocabTree::FreezeDatabase] Packed %lu %spostings for %lu "
+           "words\n", m_inverted_file.m_num_entries, raw ? "raw " : "", 
+           m_num_nodes);
+    fflush(stdout);
+
+    return Compile();
+}
+
+unsigned int VocabTree::Checksum() const
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    /* How features are searched for: descending the tree, or one
+     * approximate search over the leaves */
+    unsigned int leaf_search = m_compiled.IsEmpty() ? 
+        (dynamic_cast<VocabTreeFlatNode *>(m_root) != NULL) :
+        (m_compiled.m_leaf_tree != NULL);
+    crc = crc32(crc, (const Bytef *) &leaf_search, sizeof(unsigned int));
+    crc = crc32(crc, (const Bytef *) &m_dim, sizeof(int));
+
+    /* The nodes, in breadth-first order, as laid out by
+     * CompiledVocabTree::Compile */
+    if (!m_compiled.IsEmpty()) {
+        for (unsigned long i = 0; i < m_compiled.m_num_nodes; i++) {
+            unsigned long long id = m_compiled.WordId(i);
+            unsigned int num_children = m_compiled.m_num_children[i];
+
+            crc = crc32(crc, (const Bytef *) &id, sizeof(id));
+            crc = crc32(crc, (const Bytef *) &num_children, 
+                        sizeof(unsigned int));
+            crc = crc32(crc, m_compiled.m_desc + i * m_dim, m_dim);
+        }
+
+        return (unsigned int) crc;
+    }
+
+    if (m_root == NULL)
+        return (unsigned int) crc;
+
+    std::vector<const VocabTreeNode *> queue;
+    queue.push_back(m_root);
+
+    for (unsigned long i = 0; i < queue.size(); i++) {
+        const VocabTreeInteriorNode *interior = 
+            dynamic_cast<const VocabTreeInteriorNode *>(queue[i]);
+
+        unsigned int num_children = 0;
+        if (interior != NULL) {
+            for (int j = 0; j < m_branch_factor; j++) {
+                if (interior->m_children[j] != NULL) {
+                    queue.push_back(interior->m_children[j]);
+                    num_children++;
+                }
+            }
+        }
+
+        unsigned long long id = queue[i]->m_id;
+        crc = crc32(crc, (const Bytef *) &id, sizeof(id));
+        crc = crc32(crc, (const Bytef *) &num_children, 
+                    sizeof(unsigned int));
+        crc = crc32(crc, queue[i]->m_desc, m_dim);
+    }
+
+    return (unsigned int) crc;
+}
+
+int VocabTree::Compile()
+{
+    if (m_root == NULL)
+        return -1;
+
+    std::vector<unsigned long> node_ids;
+    if (m_compiled.Compile(m_root, m_branch_factor, m_dim, node_ids) != 0)
+        return -1;
+
+    /* A flattened tree is searched with a kd-tree, as in
+     * VocabTreeFlatNode */
+    if (dynamic_cast<VocabTreeFlatNode *>(m_root) != NULL)
+        return m_compiled.BuildLeafSearchTree();
+
+    return 0;
+}
 
 void VocabTreeInteriorNode::PopulateLeaves(int bf, int dim, 
                                            VocabTreeNode **leaves)
@@ -522,6 +996,9 @@ void VocabTreeLeaf::PopulateLeaves(int bf, int dim,
 
 int VocabTree::Flatten()
 {
+    if (IsMapped())
+        return m_compiled.BuildLeafSearchTree();
+
     if (m_root == NULL)
         return -1;
 
@@ -555,6 +1032,42 @@ int VocabTree::Flatten()
 
 int VocabTree::Combine(const VocabTree &tree)
 {
+    if (m_incremental != tree.m_incremental) {
+        printf("[VocabTree::Combine] Error: can't combine an incremental "
+               "database with a weighted one\n");
+        return -1;
+    }
+
+    if (m_incremental) {
+        /* Merge the image tables; each index may be used by one
+         * database only */
+        int num_images = (int) tree.m_image_status.size();
+        for (int i = 0; i < num_images; i++) {
+            if (tree.m_image_status[i] != ImageAbsent && 
+                i < (int) m_image_status.size() &&
+                m_image_status[i] != ImageAbsent) {
+                printf("[VocabTree::Combine] Error: image %d is in both "
+                       "databases\n", i);
+                return -1;
+            }
+        }
+
+        if ((int) m_image_status.size() < num_images) {
+            m_image_status.resize(num_images, ImageAbsent);
+            m_image_norms.resize(num_images, 0.0);
+        }
+
+        for (int i = 0; i < num_images; i++) {
+            if (tree.m_image_status[i] != ImageAbsent) {
+                m_image_status[i] = tree.m_image_status[i];
+                m_image_norms[i] = tree.m_image_norms[i];
+            }
+        }
+
+        m_database_images += tree.m_database_images;
+        m_weights_stale = true;
+    }
+
     return m_root->Combine(tree.m_root, m_branch_factor);
 }
 
@@ -568,7 +1081,18 @@ int VocabTree::Clear()
     if (m_root != NULL) {
         m_root->Clear(m_branch_factor);
         delete m_root;
+        m_root = NULL;
     }
 
+    m_inverted_file.Clear();
+    m_compiled.Clear();
+    m_word_leaves.clear();
+    UnmapDatabase();
+
+    m_incremental = false;
+    m_weights_stale = false;
+    m_image_status.clear();
+    m_image_norms.clear();
+
     return 0;
 }
@@ -42,9 +42,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string>
 #include <vector>
 
 #include "../lib/ann_1.1_char/include/ANN/ANN.h"
+#include "DescriptorSet.h"
+#include "kmeans.h"
 
 /* Types of distances supported */
 typedef enum {
@@ -52,6 +55,14 @@ typedef enum {
     DistanceMin = 1,
 } DistanceType;
 
+/* State of an image index in an incremental database */
+typedef enum {
+    ImageAbsent = 0,   /* No image has this index */
+    ImageLive = 1,     /* The image is in the database */
+    ImageRemoved = 2,  /* The image was removed, but its postings remain
+                        * until CompactDatabase */
+} ImageStatus;
+
 /* Sparse matrix types */
 typedef std::pair<unsigned long,float> sp_entry;
 typedef std::vector<sp_entry> sp_list;
@@ -69,6 +80,162 @@ public:
                     * feature appears */
 };
 
+/* Compact inverted file, packed from the per-leaf image lists once
+ * the database is complete.  The postings for the visual word with
+ * id w are stored in entries [m_word_start[w], m_word_start[w+1]) of
+ * the parallel arrays m_index and m_count.
+ *
+ * A raw inverted file (packed from an incremental database) holds the
+ * raw count of each posting in m_raw_count (16 bits, saturating)
+ * instead of m_count, and the word weights (m_weight) and image
+ * magnitudes (m_image_norm) are applied while scoring.  Postings take
+ * 6 bytes instead of 8, and the weights can be recomputed (e.g., for
+ * another distance) without touching the postings. */
+class InvertedFile {
+public:
+    InvertedFile() : m_num_words(0), m_num_entries(0), m_word_start(NULL),
+                     m_index(NULL), m_count(NULL), m_weight(NULL),
+                     m_raw_count(NULL), m_num_images(0), 
+                     m_image_norm(NULL), m_owned(false) { }
+    ~InvertedFile() { Clear(); }
+
+    /* Allocate the arrays, given the number of postings for each word
+     * (an array of length num_words).  If raw is set, raw counts are
+     * allocated instead of weighted ones, along with the magnitudes of
+     * num_images images. */
+    int Allocate(unsigned long num_words, const unsigned long *counts,
+                 bool raw = false, unsigned long num_images = 0);
+    /* Use arrays owned by someone else (e.g., a mapped database file)
+     * in place, without copying them.  For a raw file, count is NULL
+     * and raw_count and image_norm are given. */
+    void Alias(unsigned long num_words, unsigned long num_entries,
+               unsigned long *word_start, unsigned int *index, 
+               float *count, float *weight, 
+               unsigned short *raw_count = NULL, 
+               unsigned long num_images = 0, float *image_norm = NULL);
+    void Clear();
+
+    bool IsEmpty() const { return m_word_start == NULL; }
+    bool IsRaw() const { return m_raw_count != NULL; }
+
+    /* Recompute the image magnitudes of a raw file from the raw counts
+     * and word weights, for the given distance (or set them all to 1
+     * if normalize is false) */
+    int ComputeImageNorms(DistanceType dtype, bool normalize);
+
+    /* Given a sparse query BoW vector q (a list of (word, value)
+     * entries), accumulate its similarity to every database image
+     * into scores.  Only the postings of the words in q are visited.
+     * If touched is given, each image whose score goes from zero to
+     * non-zero is appended to it. */
+    int ScoreQuery(const sp_list &q, DistanceType dtype, float *scores,
+                   std::vector<unsigned int> *touched = NULL) const;
+
+    /* Member variables */
+    unsigned long m_num_words;    /* Number of words (tree nodes) */
+    unsigned long m_num_entries;  /* Total number of postings */
+    unsigned long *m_word_start;  /* Offset of the first posting of each
+                                   * word (length m_num_words + 1) */
+    unsigned int *m_index;        /* Database image of each posting */
+    float *m_count;               /* (Weighted, normalized) count of
+                                   * each posting */
+    float *m_weight;              /* Weight of each word */
+    unsigned short *m_raw_count;  /* Raw count of each posting (raw) */
+    unsigned long m_num_images;   /* Number of image indices (raw) */
+    float *m_image_norm;          /* Magnitude of each image (raw); images
+                                   * with magnitude 0 are skipped */
+    bool m_owned;                 /* Were the arrays allocated here? */
+
+    /* Image magnitudes computed here (m_image_norm points at them) */
+    std::vector<float> m_image_norm_table;
+
+private:
+    /* Copying would free the owned arrays twice */
+    InvertedFile(const InvertedFile &);
+    InvertedFile &operator=(const InvertedFile &);
+};
+
+/* Squared distance between two descriptors a and b of length dim */
+unsigned long vec_diff_normsq(int dim, 
+                              const unsigned char *a, const unsigned char *b);
+
+/* Contribution of one BoW vector entry to the magnitude of the vector,
+ * for the given distance */
+double ComputeMagnitude(DistanceType dtype, double dim);
+
+/* Scratch state for scoring one query against a frozen database.
+ * Each thread that issues queries should own its own context; the
+ * tree itself is never modified while scoring, so any number of
+ * contexts can be used against one shared tree at the same time. */
+class VocabQueryContext {
+public:
+    VocabQueryContext() { }
+    VocabQueryContext(int num_db_images) { Resize(num_db_images); }
+
+    /* Size the score and top-k buffers for a database of the given
+     * number of images, and clear the scores */
+    void Resize(int num_db_images) {
+        m_scores.assign(num_db_images, 0.0);
+        m_scores_d.resize(num_db_images);
+        m_perm.resize(num_db_images);
+        m_touched.clear();
+    }
+
+    int GetNumDatabaseImages() const { return (int) m_scores.size(); }
+
+    /* Select the k best-scoring images of the last query (only the
+     * touched images are examined) into m_perm and m_scores_d, best
+     * first.  Returns the number of images selected. */
+    int SelectTopK(int k);
+
+    /* Member variables */
+    std::vector<unsigned long> m_words; /* Word id of each query feature */
+    sp_list m_query;                    /* Sparse query BoW vector */
+    std::vector<float> m_scores;        /* Score of each database image */
+    std::vector<unsigned int> m_touched; /* Images with non-zero scores */
+    std::vector<double> m_scores_d;     /* Top-k buffer: sorted scores */
+    std::vector<int> m_perm;            /* Top-k buffer: sorted images */
+};
+
+class VocabTreeNode;
+
+/* A subtree whose construction has been deferred by BuildRecurse so
+ * that it can be clustered concurrently with its siblings */
+typedef struct {
+    VocabTreeNode *node;        /* Node to build */
+    int n;                      /* Number of features in the subtree */
+    int depth_curr;             /* Depth of the node */
+    unsigned int *idx;          /* Features of the subtree */
+    unsigned int *clustering;   /* Slice of the clustering work array */
+    unsigned int seed;          /* Seed for the subtree's k-means */
+} vocab_build_task_t;
+
+/* State shared by the nodes while a tree is being built */
+class VocabBuildContext {
+public:
+    VocabBuildContext() : m_task_size(0), m_init(KMeansInitRandom),
+                          m_assign(KMeansAssignKdTree), m_options(NULL),
+                          m_partition(partition_by_cluster) { }
+
+    int m_task_size;    /* Interior subtrees with at most this many
+                         * features are deferred to m_tasks (0 builds
+                         * every subtree immediately) */
+    KMeansInit m_init;  /* Seeding strategy for k-means */
+    KMeansAssign m_assign; /* Assignment step for k-means */
+    const KMeansOptions *m_options; /* Stopping rules and telemetry for
+                                     * k-means (NULL for the defaults) */
+    KMeansPartition m_partition; /* Reorders a node's features by child */
+    std::vector<vocab_build_task_t> m_tasks;
+
+    /* Seconds spent in k-means and in partitioning, summed over the
+     * nodes of each level (if the vectors are non-empty) */
+    std::vector<double> m_kmeans_time;
+    std::vector<double> m_partition_time;
+
+    /* Add to the times of a level; safe to call from several threads */
+    void AddTime(int level, double kmeans_time, double partition_time);
+};
+
 /* Abstract class for a node of the vocabulary tree */
 class VocabTreeNode {
 public:
@@ -93,14 +260,25 @@ public:
      *   depth_curr : current depth
      *   bf     : branching factor of the tree (children per node)
      *   restarts   : number of random restarts during clustering
-     *   v      : list of arrays representing the features
+     *   data   : contiguous array of all of the features
+     *   idx    : indices into data of the n features to cluster; this
+     *            array is reordered so that each child's features are
+     *            contiguous
      *
      *   means      : work array for storing means that get passed to kmeans
      *   clustering : work array for storing clustering in kmeans
+     *   ctx        : build options; small subtrees are appended to
+     *                ctx->m_tasks instead of being built immediately
+     *                (NULL uses the defaults and builds everything)
+     *   seed       : if non-NULL, k-means draws its random numbers
+     *                from this seed instead of rand()
      */
     virtual int BuildRecurse(int n, int dim, int depth, int depth_curr, 
-                             int bf, int restarts, unsigned char **v,
-                             double *means, unsigned int *clustering) = 0;
+                             int bf, int restarts, 
+                             const unsigned char *data, unsigned int *idx,
+                             double *means, unsigned int *clustering,
+                             VocabBuildContext *ctx = NULL,
+                             unsigned int *seed = NULL) = 0;
 
     /* Push a feature down to a leaf of the tree, and accumulate it to
      * the score of that leaf.  Optionally, add the feature to the
@@ -118,6 +296,22 @@ public:
                                               int bf, int dim,
                                               bool add = true) = 0;
 
+    /* Push a feature down to a leaf of the tree without touching the
+     * scores or the inverted file, and return the id of that leaf
+     * 
+     * Inputs: 
+     *   v     : array containing the feature descriptor
+     *   bf    : branch factor of the tree
+     *   dim   : dimensionality of the tree
+     *
+     * Output:
+     *   dist  : if not NULL, the squared distance from v to the
+     *           centroid of the leaf
+     */
+    virtual unsigned long QuantizeFeature(const unsigned char *v, 
+                                          int bf, int dim, 
+                                          unsigned long *dist) const = 0;
+
     /* Update the counts in an inverted file associated with a visual
      * word 
      *
@@ -212,7 +406,16 @@ public:
 
     virtual int GetMaxDatabaseImageIndex(int bf) const
         { return 0; }
-        
+
+    /* Functions for packing the image lists into an InvertedFile.
+     * CountPostings stores the length of each leaf's image list in
+     * counts[m_id]; PackPostings copies the lists into the inverted
+     * file and releases them */
+    virtual int CountPostings(int bf, unsigned long *counts) const
+        { return 0; }
+    virtual int PackPostings(int bf, InvertedFile &inv)
+        { return 0; }
+
     /* Member variables */
     unsigned char *m_desc; /* Descriptor for this node */
     unsigned long m_id;    /* ID of this node */
@@ -232,13 +435,19 @@ public:
     virtual void Clear(int bf);
 
     virtual int BuildRecurse(int n, int dim, int depth, int depth_curr, 
-                             int bf, int restarts, unsigned char **v,
-                             double *means, unsigned int *clustering);
+                             int bf, int restarts, 
+                             const unsigned char *data, unsigned int *idx,
+                             double *means, unsigned int *clustering,
+                             VocabBuildContext *ctx = NULL,
+                             unsigned int *seed = NULL);
 
     virtual unsigned long PushAndScoreFeature(unsigned char *v, 
                                               unsigned int index, 
                                               int bf, int dim,
                                               bool add = true);
+    virtual unsigned long QuantizeFeature(const unsigned char *v, 
+                                          int bf, int dim, 
+                                          unsigned long *dist) const;
 
     virtual int AddFeatureToInvertedFile(unsigned int index, 
                                          int bf, int dim) { return 0; }
@@ -274,6 +483,9 @@ public:
     virtual int Combine(VocabTreeNode *other, int bf);
     virtual int GetMaxDatabaseImageIndex(int bf) const;
 
+    virtual int CountPostings(int bf, unsigned long *counts) const;
+    virtual int PackPostings(int bf, InvertedFile &inv);
+
     /* Member variables */
     VocabTreeNode **m_children; /* Array of child nodes */
 };
@@ -295,13 +507,19 @@ public:
     virtual void Clear(int bf);
 
     virtual int BuildRecurse(int n, int dim, int depth, int depth_curr, 
-                             int bf, int restarts, unsigned char **v,
-                             double *means, unsigned int *clustering);
+                             int bf, int restarts, 
+                             const unsigned char *data, unsigned int *idx,
+                             double *means, unsigned int *clustering,
+                             VocabBuildContext *ctx = NULL,
+                             unsigned int *seed = NULL);
 
     virtual unsigned long PushAndScoreFeature(unsigned char *v, 
                                               unsigned int index, 
                                               int bf, int dim,
                                               bool add = true);
+    virtual unsigned long QuantizeFeature(const unsigned char *v, 
+                                          int bf, int dim, 
+                                          unsigned long *dist) const;
 
     virtual int ScoreQuery(float *q, int bf, DistanceType dtype, 
                            float *scores);
@@ -342,6 +560,9 @@ public:
     virtual int Combine(VocabTreeNode *other, int bf);
     virtual int GetMaxDatabaseImageIndex(int bf) const;
 
+    virtual int CountPostings(int bf, unsigned long *counts) const;
+    virtual int PackPostings(int bf, InvertedFile &inv);
+
     /* Member variables */
     float m_score;   /* Current, temporary score for the current image */
     float m_weight;  /* Weight for this visual word */
@@ -359,21 +580,102 @@ public:
                                               unsigned int index, 
                                               int bf, int dim, 
                                               bool add = true);
+    virtual unsigned long QuantizeFeature(const unsigned char *v, 
+                                          int bf, int dim, 
+                                          unsigned long *dist) const;
 
     void BuildANNTree(int num_leaves, int dim);
 
     ann_1_1_char::ANNkd_tree *m_tree; /* For finding nearest neighbors */
 };
 
+/* Compact, pointer-free layout of a vocabulary tree.  The nodes are
+ * numbered in breadth-first order, so the children of a node are
+ * consecutive: node i has m_num_children[i] children, starting at
+ * node m_first_child[i], and the centroids of those children are
+ * contiguous in m_desc.  Leaves have no children.  The arrays are
+ * either allocated by Compile or alias a mapped database file.
+ * Descending the compiled tree needs no virtual calls or pointer
+ * chasing: each level is one scan over a block of bf centroids. */
+class CompiledVocabTree {
+public:
+    CompiledVocabTree() : m_num_nodes(0), m_dim(0), m_desc(NULL), 
+                          m_first_child(NULL), m_num_children(NULL),
+                          m_owned(false), m_leaf_pts(NULL), 
+                          m_leaf_tree(NULL) { }
+    ~CompiledVocabTree() { Clear(); }
+
+    /* Lay out the tree rooted at root.  At exit, node_ids[i] holds
+     * the id (m_id) of the node that became node i */
+    int Compile(const VocabTreeNode *root, int bf, int dim, 
+                std::vector<unsigned long> &node_ids);
+    /* Use arrays owned by someone else in place */
+    void Alias(unsigned long num_nodes, int dim, unsigned char *desc,
+               unsigned int *first_child, unsigned int *num_children);
+    void Clear();
+
+    bool IsEmpty() const { return m_desc == NULL; }
+
+    /* Build a kd-tree over all of the leaves, so that features are
+     * quantized with one (approximate) search instead of descending
+     * the tree, as with VocabTree::Flatten */
+    int BuildLeafSearchTree();
+
+    /* Return the word id of the leaf that v falls into: the id of
+     * the original node if the tree was compiled in memory, or the
+     * node number if it was mapped.  If dist is not NULL, the squared
+     * distance from v to the centroid of the leaf is stored there. */
+    unsigned long QuantizeFeature(const unsigned char *v, 
+                                  unsigned long *dist = NULL) const;
+
+    unsigned long WordId(unsigned long node) const 
+        { return m_node_ids.empty() ? node : m_node_ids[node]; }
+
+    /* Member variables */
+    unsigned long m_num_nodes;     /* Number of nodes */
+    int m_dim;                     /* Dimension of the descriptors */
+    unsigned char *m_desc;         /* Centroid of each node */
+    unsigned int *m_first_child;   /* First child of each node */
+    unsigned int *m_num_children;  /* Number of children of each node */
+    bool m_owned;                  /* Were the arrays allocated here? */
+    std::vector<unsigned long> m_node_ids; /* Original id of each node */
+
+    std::vector<unsigned int> m_leaf_nodes; /* Node of each kd-tree point */
+    ann_1_1_char::ANNpointArray m_leaf_pts; /* Points of the kd-tree */
+    ann_1_1_char::ANNkd_tree *m_leaf_tree;  /* Search tree over the leaves */
+
+private:
+    /* Copying would free the owned arrays and the kd-tree twice */
+    CompiledVocabTree(const CompiledVocabTree &);
+    CompiledVocabTree &operator=(const CompiledVocabTree &);
+};
+
 class VocabTree {
 public:
     VocabTree() : m_database_images(0), m_branch_factor(0),
                   m_depth(0), m_dim(0), m_num_nodes(0),
                   m_distance_type(DistanceMin),
-                  m_root(NULL){ }
+                  m_root(NULL), m_map(NULL), m_map_size(0),
+                  m_incremental(false), m_use_tfidf(true), 
+                  m_normalize(true), m_weights_stale(false) { }
 
-    /* I/O routines */
+    /* I/O routines.  An incremental database is written with its
+     * raw counts, followed by a trailer holding the status of each
+     * image index; Read restores it and recomputes the weights. */
     int Read(const char *filename);
+
+    /* Read and write databases in the mapped (VTDB) format: a header
+     * followed by the centroids, the child tables, the packed
+     * postings and the word weights (and, for a raw inverted file,
+     * the image magnitudes), laid out so the file can be
+     * used in place.  Read calls ReadMapped automatically when it
+     * sees a VTDB file.  A mapped database is frozen, and can be
+     * queried but not modified; Flatten builds the leaf search tree.
+     * WriteMapped requires a frozen database. */
+    int ReadMapped(const char *filename);
+    int WriteMapped(const char *filename) const;
+    bool IsMapped() const { return m_map != NULL; }
+    void UnmapDatabase();
     int WriteHeader(FILE *f) const;
     int Write(const char *filename) const;
     int WriteFlat(const char *filename) const;
@@ -386,15 +688,56 @@ public:
     /* Build the vocabulary tree using kmeans 
      *
      * Inputs: 
-     *  n        : number of features to cluster
-     *  dim      : dimensionality of each feature vector (e.g., 128)
+     *  descs    : features to cluster, in memory or mapped from a file
      *  depth    : total depth of the tree to create
      *  bf       : desired branching factor of the tree (children per node)
      *  restarts : number of random restarts during clustering
-     *  vp       : array of pointers to arrays representing the features
+     *  init     : how k-means chooses its initial means
+     *  assign   : how k-means assigns the features in each round
+     *  options  : stopping rules and telemetry for each k-means run
+     *             (NULL for the defaults); records carry the level
+     *  partition: how each node's features are reordered by child
+     *             (NULL for partition_by_cluster)
+     *
+     * The features are partitioned through an array of 32-bit indices,
+     * and are never moved.  The top levels are clustered one node at a
+     * time, with the assignment step of k-means running in parallel.
+     * Subtrees that are small relative to n are then built
+     * concurrently, one per thread; the result does not depend on the
+     * number of threads.  Returns 0 on success, or -1 if the tree
+     * could not be built (it is then incomplete).
      */
+    int Build(const DescriptorSet &descs, int depth, int bf, int restarts,
+              KMeansInit init = KMeansInitRandom,
+              KMeansAssign assign = KMeansAssignKdTree,
+              const KMeansOptions *options = NULL,
+              KMeansPartition partition = NULL);
+
+    /* As above, for n features of dimension dim given as an array of
+     * pointers.  The features are first copied into one array, and vp
+     * is deleted. */
     int Build(int n, int dim, int depth, int bf, int restarts, 
-              unsigned char **vp);
+              unsigned char **vp, KMeansInit init = KMeansInitRandom,
+              KMeansAssign assign = KMeansAssignKdTree,
+              const KMeansOptions *options = NULL);
+
+    /* Build the vocabulary tree with mini-batch k-means, reading
+     * random batches of features from a list of key files rather than
+     * holding every feature in memory.  Each level of the tree is
+     * trained from num_batches batches of about batch_size features;
+     * memory use depends only on the batch and tree sizes.  A node is
+     * split only if at least 2 * bf + 1 samples reach it.
+     *
+     * Inputs: 
+     *  key_files   : key files to sample features from
+     *  dim, depth, bf, init : as for Build
+     *  batch_size  : number of features per batch
+     *  num_batches : number of batches used to train each level
+     */
+    int BuildMiniBatch(const std::vector<std::string> &key_files,
+                       int dim, int depth, int bf, 
+                       int batch_size, int num_batches,
+                       KMeansInit init = KMeansInitPlusPlus);
 
     /* Push a feature down to a leaf of the tree, and accumulate it to
      * the score of that leaf.  Optionally, add the feature to the
@@ -419,10 +762,71 @@ public:
     double AddImageToDatabase(int index, int n, unsigned char *v, 
                               unsigned long *ids = NULL);
 
+    /* Add an image to the database given the word ids of its features
+     * (as computed by QuantizeBatch), appending its postings to the
+     * image lists of the leaves.  AddImageToDatabase is QuantizeBatch
+     * followed by this; calling the two separately lets the features
+     * be quantized elsewhere (e.g., on other threads), or the word ids
+     * be kept and reused.
+     *
+     * Inputs:
+     *   index : identifier for the image
+     *   n     : number of features
+     *   words : word id of each feature
+     *
+     *   Returns 0 on success, -1 if the database is frozen or a word
+     *   id is not a leaf (or, for an incremental database, if the
+     *   index is in use) */
+    int AddWordsToDatabase(int index, int n, const unsigned long *words);
+    int AddWordsToDatabase(int index, const std::vector<unsigned long> &words)
+        { return AddWordsToDatabase(index, (int) words.size(), 
+                                    words.empty() ? NULL : &(words[0])); }
+
     /* Given a tree populated with database images, compute the TFIDF
      * weights */
     int ComputeTFIDFWeights(unsigned int num_db_images);
 
+    /* Incremental databases.  ComputeTFIDFWeights and NormalizeDatabase
+     * fold the weights into the image lists, so adding or removing an
+     * image means rebuilding the database.  An incremental database
+     * instead keeps the raw count of each word in each image in the
+     * image lists, and the word weights (IDF, in the leaves) and image
+     * magnitudes separately, applying them when scoring.  Images can
+     * then be added (with AddWordsToDatabase or AddImageToDatabase)
+     * and removed at any time, and the weights are recomputed from the
+     * raw counts by UpdateWeights.
+     *
+     * An incremental database can be queried without freezing it.
+     * Queries use the weights as of the last UpdateWeights (an image
+     * added since then is scored, with a magnitude computed from those
+     * weights), so UpdateWeights should be called after each batch of
+     * updates; FreezeDatabase and the non-const ScoreQueryKeys call it
+     * if needed.  Updates must not run concurrently with queries.
+     * FreezeDatabase applies the weights to the image lists, making
+     * the database a regular (weighted) one. */
+
+    /* Start an empty incremental database, with TFIDF weights (or
+     * constant weights) and, optionally, normalized image vectors.
+     * The distance type should be set first. */
+    int StartIncrementalDatabase(bool use_tfidf = true, 
+                                 bool normalize = true);
+    bool IsIncremental() const { return m_incremental; }
+    bool IsLive(unsigned int index) const 
+        { return index < m_image_status.size() && 
+                 m_image_status[index] == ImageLive; }
+
+    /* Remove an image from an incremental database.  Its postings are
+     * skipped from then on, and dropped by CompactDatabase, after
+     * which its index can be reused.  Returns -1 if the image is not
+     * in the database. */
+    int RemoveImage(int index);
+    /* Drop the postings of removed images */
+    int CompactDatabase();
+    /* Recompute the word weights and image magnitudes of an
+     * incremental database from the raw counts, if images have been
+     * added or removed since they were last computed */
+    int UpdateWeights();
+
     /* Given a set of feature descriptors in a query image, compute
      * the similarity between the query image and all of the images in
      * the database.
@@ -438,10 +842,83 @@ public:
      *               (similarity to the query vector)
      *
      *   Returns the magnitude of the query vector
+     *
+     * If the database is frozen, only the words hit by the query
+     * features are visited, so the cost depends on the number of
+     * query features rather than on the size of the vocabulary.
      */
     double ScoreQueryKeys(int n, bool normalize, unsigned char *v, 
                           float *scores);
 
+    /* Reentrant version of ScoreQueryKeys for a frozen (or
+     * incremental) database.  All per-query state (word histogram,
+     * scores, top-k buffers) lives in the caller-owned context ctx,
+     * which must be sized for the database; at exit, ctx.m_scores
+     * holds the score of each database image, and ctx.m_touched lists
+     * the images with non-zero scores.  Only the scores touched by the
+     * previous query are reset, so callers should not write to
+     * ctx.m_scores.
+     * The tree is not modified, so concurrent calls with distinct
+     * contexts are safe.
+     *
+     *   Returns the magnitude of the query vector, or -1.0 if the
+     *   database is neither frozen nor incremental */
+    double ScoreQueryKeys(int n, bool normalize, const unsigned char *v, 
+                          VocabQueryContext &ctx) const;
+
+    /* As above, for a query image whose features have already been
+     * mapped to words (e.g., by QuantizeBatch, or from a word cache) */
+    double ScoreQueryWords(int n, bool normalize, 
+                           const unsigned long *words,
+                           VocabQueryContext &ctx) const;
+
+    /* Score a query against the frozen inverted file (or the image
+     * lists of an incremental database), using ctx for scratch space
+     * and accumulating into scores (used by both versions of
+     * ScoreQueryKeys).  ScoreQueryWordsSparse scores the words in
+     * ctx.m_words, and reorders them. */
+    double ScoreQueryKeysSparse(int n, bool normalize, 
+                                const unsigned char *v, 
+                                VocabQueryContext &ctx, float *scores,
+                                std::vector<unsigned int> *touched) const;
+    double ScoreQueryWordsSparse(bool normalize, VocabQueryContext &ctx, 
+                                 float *scores,
+                                 std::vector<unsigned int> *touched) const;
+
+    /* Map each of n features (concatenated in v) to the id of the
+     * leaf it falls into, storing the ids in words and, if dists is
+     * not NULL, the squared distances to the leaf centroids in dists.
+     * The tree is not modified, so concurrent calls are safe; large
+     * batches are split across threads. */
+    int QuantizeBatch(int n, const unsigned char *v, unsigned long *words,
+                      unsigned long *dists = NULL) const;
+
+    /* Pack the image lists stored in the leaves into one compact
+     * inverted file, used by ScoreQueryKeys from then on, and compile
+     * the tree for descent.  The leaf image lists are released, so
+     * this should be called once the database is complete (i.e.,
+     * after ComputeTFIDFWeights and NormalizeDatabase); a frozen tree
+     * can be queried, but not written out or modified.  If raw is
+     * set, an incremental database is packed into a raw inverted
+     * file, keeping the raw counts, word weights and image magnitudes
+     * apart; SetDistanceType then recomputes the magnitudes. */
+    int FreezeDatabase(bool raw = false);
+    bool IsFrozen() const { return !m_inverted_file.IsEmpty(); }
+
+    /* Build m_compiled, the breadth-first layout of the tree used by
+     * QuantizeBatch.  If the tree has been flattened, a search
+     * tree over the leaves is built as well.  The pointer tree must
+     * not be modified afterwards. */
+    int Compile();
+
+    /* Checksum (CRC-32) of everything that decides which word a
+     * feature maps to: the centroids, the word ids, and whether the
+     * leaves are searched directly (as for a flattened tree).  Word
+     * ids stored for one tree can be reused with another tree with
+     * the same checksum.  The node ids must be set, as they are by
+     * Read. */
+    unsigned int Checksum() const;
+
     /* Empty out the database */
     int ClearDatabase();
     /* Normalize the database */
@@ -470,6 +947,41 @@ public:
     unsigned long m_num_nodes;     /* Number of nodes in the tree */
     DistanceType m_distance_type;  /* Type of the distance measure */
     VocabTreeNode *m_root;         /* Root of the tree */
+    InvertedFile m_inverted_file;  /* Packed inverted file (if frozen) */
+    CompiledVocabTree m_compiled;  /* Compiled tree (if frozen) */
+    char *m_map;                   /* Mapped database file */
+    unsigned long m_map_size;      /* Size of the mapped file */
+
+    /* Leaf of each word id, filled in by MapWordLeaves */
+    std::vector<VocabTreeLeaf *> m_word_leaves;
+
+    /* Incremental database state */
+    bool m_incremental;            /* Do the image lists hold raw counts? */
+    bool m_use_tfidf;              /* Weight the words by IDF? */
+    bool m_normalize;              /* Normalize the image vectors? */
+    bool m_weights_stale;          /* Added or removed images since the
+                                    * last UpdateWeights? */
+    std::vector<unsigned char> m_image_status; /* ImageStatus of each index */
+    std::vector<float> m_image_norms;  /* Magnitude of each image vector */
+
+private:
+    /* Copying would share the nodes, the inverted file and the
+     * mapping */
+    VocabTree(const VocabTree &);
+    VocabTree &operator=(const VocabTree &);
+
+    /* Fill in m_word_leaves, if it is empty */
+    void MapWordLeaves();
+
+    /* Helpers for incremental databases */
+    int AddIncrementalImage(int index, int n, const unsigned long *words);
+    int ScoreQueryIncremental(const sp_list &q, float *scores,
+                              std::vector<unsigned int> *touched) const;
+    /* Fold the weights and magnitudes into the image lists (dropping
+     * removed images), leaving a regular database */
+    int ApplyWeights();
+    int ReadIncrementalState(FILE *f);
+    int WriteIncrementalState(FILE *f) const;
 };
 
 #endif /* __vocab_tree_h__ */
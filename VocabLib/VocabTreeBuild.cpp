@@ -37,14 +37,39 @@
 /* VocabTreeBuild.cpp */
 /* Routines for building a vocab tree */
 
+#include <algorithm>
+
+#include <string.h>
+
+#include <omp.h>
+
 #include "VocabTree.h"
 #include "kmeans.h"
 #include "util.h"
 
+/* Subtrees with at most 1/BUILD_TASK_FRACTION of the features are
+ * built as independent tasks.  The cutoff depends only on the input
+ * size, so the tree is the same for any number of threads. */
+#define BUILD_TASK_FRACTION 256
+
+void VocabBuildContext::AddTime(int level, double kmeans_time, 
+                                double partition_time)
+{
+    if (level >= (int) m_kmeans_time.size())
+        return;
+
+#pragma omp atomic
+    m_kmeans_time[level] += kmeans_time;
+#pragma omp atomic
+    m_partition_time[level] += partition_time;
+}
+
 int VocabTreeLeaf::BuildRecurse(int n, int dim, int depth, 
                                 int depth_curr, int bf, 
-                                int restarts, unsigned char **v,
-                                double *means, unsigned int *clustering)
+                                int restarts, const unsigned char *data,
+                                unsigned int *idx,
+                                double *means, unsigned int *clustering,
+                                VocabBuildContext *ctx, unsigned int *seed)
 {
     /* Nothing to do on the bottom level, everything was taken care of
      * above us */
@@ -53,9 +78,13 @@ int VocabTreeLeaf::BuildRecurse(int n, int dim, int depth,
 
 int VocabTreeInteriorNode::BuildRecurse(int n, int dim, int depth, 
                                         int depth_curr, int bf, 
-                                        int restarts, unsigned char **v,
+                                        int restarts, 
+                                        const unsigned char *data,
+                                        unsigned int *idx,
                                         double *means, 
-                                        unsigned int *clustering)
+                                        unsigned int *clustering,
+                                        VocabBuildContext *ctx,
+                                        unsigned int *seed)
 {
     if (depth_curr > depth)
         return 0;
@@ -73,7 +102,20 @@ int VocabTreeInteriorNode::BuildRecurse(int n, int dim, int depth,
     m_children = new VocabTreeNode *[bf];
 
     /* Run k-means */
-    double error = kmeans(n, dim, bf, restarts, v, means, clustering);
+    KMeansInit init = (ctx != NULL) ? ctx->m_init : KMeansInitRandom;
+    KMeansAssign assign = (ctx != NULL) ? ctx->m_assign : KMeansAssignKdTree;
+
+    KMeansOptions options;
+    if (ctx != NULL && ctx->m_options != NULL)
+        options = *ctx->m_options;
+    options.level = depth_curr;
+
+    double start = omp_get_wtime();
+    double error = kmeans(n, dim, bf, restarts, data, idx, means, 
+                          clustering, seed, init, assign, &options);
+
+    if (ctx != NULL)
+        ctx->AddTime(depth_curr, omp_get_wtime() - start, 0.0);
 
     double error_means = 0.0;
     for (int i = 0; i < bf; i++) {
@@ -123,30 +165,44 @@ int VocabTreeInteriorNode::BuildRecurse(int n, int dim, int depth,
     }
 
     if (depth_curr < depth) {
-        /* Reorder the pointers to the vectors */
-        int idx = 0;
-        for (int i = 0; i < bf; i++) {
-            for (int j = 0; j < n; j++) {
-                if ((int) clustering[j] == i) {
-                    unsigned char *v_tmp = v[idx];
-                    v[idx] = v[j];
-                    v[j] = v_tmp;
-
-                    unsigned int tmp = clustering[idx];
-                    clustering[idx] = clustering[j];
-                    clustering[j] = tmp;
-
-                    idx++;
-                }
-            }
+        /* Reorder the indices of the vectors by cluster */
+        start = omp_get_wtime();
+        int ret = (ctx != NULL) ? ctx->m_partition(n, bf, idx, clustering) :
+            partition_by_cluster(n, bf, idx, clustering);
+
+        if (ret != 0) {
+            printf("[BuildRecurse] Error partitioning %d features\n", n);
+            delete [] counts;
+            return -1;
         }
-    
+
+        if (ctx != NULL)
+            ctx->AddTime(depth_curr, 0.0, omp_get_wtime() - start);
+
+        /* Each child owns the slice of idx and clustering holding its
+         * features, so deferred children can be built concurrently */
         int off = 0;
         for (int i = 0; i < bf; i++) {
-            if (m_children[i] != NULL) {
-                m_children[i]->BuildRecurse(counts[i], dim, depth, depth_curr + 1,
-                                            bf, restarts, v + off, means, 
-                                            clustering);
+            if (m_children[i] == NULL) {
+                /* Empty cluster */
+            } else if (ctx != NULL && counts[i] <= ctx->m_task_size &&
+                       counts[i] > 2 * bf) {
+                vocab_build_task_t task;
+                task.node = m_children[i];
+                task.n = counts[i];
+                task.depth_curr = depth_curr + 1;
+                task.idx = idx + off;
+                task.clustering = clustering + off;
+                task.seed = (unsigned int) rand();
+                ctx->m_tasks.push_back(task);
+            } else if (m_children[i]->BuildRecurse(counts[i], dim, depth, 
+                                                   depth_curr + 1, bf, 
+                                                   restarts, data, 
+                                                   idx + off, means, 
+                                                   clustering + off, 
+                                                   ctx, seed) != 0) {
+                delete [] counts;
+                return -1;
             }
 
             off += counts[i];
@@ -158,9 +214,64 @@ int VocabTreeInteriorNode::BuildRecurse(int n, int dim, int depth,
     return 0;
 }
 
-int VocabTree::Build(int n, int dim, int depth, int bf, int restarts, 
-                     unsigned char **vp)
+static bool task_larger(const vocab_build_task_t &a, 
+                        const vocab_build_task_t &b)
+{
+    return a.n > b.n;
+}
+
+/* Build the subtrees deferred by BuildRecurse, in parallel.  Returns
+ * -1 if any of them failed. */
+static int build_tasks(VocabBuildContext &ctx, const unsigned char *data,
+                       int dim, int depth, int bf, int restarts)
 {
+    std::vector<vocab_build_task_t> &tasks = ctx.m_tasks;
+    int num_tasks = (int) tasks.size();
+
+    if (num_tasks == 0)
+        return 0;
+
+    printf("[build_tasks] Building %d subtrees with %d threads\n",
+           num_tasks, omp_get_max_threads());
+    fflush(stdout);
+
+    /* Hand out the largest subtrees first so that the stragglers at
+     * the end are short */
+    std::stable_sort(tasks.begin(), tasks.end(), task_larger);
+
+    /* The tasks build their whole subtree */
+    ctx.m_task_size = 0;
+
+    int num_failed = 0;
+
+#pragma omp parallel reduction(+:num_failed)
+    {
+        double *means = new double[bf * dim];
+
+#pragma omp for schedule(dynamic, 1)
+        for (int i = 0; i < num_tasks; i++) {
+            vocab_build_task_t &task = tasks[i];
+            if (task.node->BuildRecurse(task.n, dim, depth, task.depth_curr,
+                                        bf, restarts, data, task.idx, 
+                                        means, task.clustering, &ctx, 
+                                        &task.seed) != 0)
+                num_failed++;
+        }
+
+        delete [] means;
+    }
+
+    return (num_failed > 0) ? -1 : 0;
+}
+
+int VocabTree::Build(const DescriptorSet &descs, int depth, int bf, 
+                     int restarts, KMeansInit init, KMeansAssign assign,
+                     const KMeansOptions *options, 
+                     KMeansPartition partition)
+{
+    int n = (int) descs.m_num_descriptors;
+    int dim = descs.m_dim;
+
     printf("[VocabTree::Build] Building tree from %d features\n", n);
     printf("[VocabTree::Build]   with depth %d, branching factor %d\n", 
            depth, bf);
@@ -172,6 +283,7 @@ int VocabTree::Build(int n, int dim, int depth, int bf, int restarts,
     m_branch_factor = bf;
 
     double *means = new double[bf * dim];
+    unsigned int *idx = new unsigned int[n];
     unsigned int *clustering = new unsigned int[n];
 
     if (means == NULL) {
@@ -179,25 +291,78 @@ int VocabTree::Build(int n, int dim, int depth, int bf, int restarts,
         exit(-1);
     }
 
-    if (clustering == NULL) {
+    if (idx == NULL || clustering == NULL) {
         printf("[VocabTree::Build] Error allocating clustering\n");
         exit(-1);
     }
 
+    for (int i = 0; i < n; i++)
+        idx[i] = i;
+
     m_root = new VocabTreeInteriorNode();
     m_root->m_desc = new unsigned char[dim];
     for (int i = 0; i < dim; i++) 
         m_root->m_desc[i] = 0;
     
-    m_root->BuildRecurse(n, dim, depth, 0, bf, restarts, 
-                         vp, means, clustering);
+    VocabBuildContext ctx;
+    ctx.m_task_size = n / BUILD_TASK_FRACTION;
+    ctx.m_init = init;
+    ctx.m_assign = assign;
+    ctx.m_options = options;
+    if (partition != NULL)
+        ctx.m_partition = partition;
+    ctx.m_kmeans_time.resize(depth + 1, 0.0);
+    ctx.m_partition_time.resize(depth + 1, 0.0);
 
-    delete [] vp;
-    delete means;
-    delete clustering;
+    if (m_root->BuildRecurse(n, dim, depth, 0, bf, restarts, 
+                             descs.m_data, idx, means, clustering, 
+                             &ctx) != 0 ||
+        build_tasks(ctx, descs.m_data, dim, depth, bf, restarts) != 0) {
+        printf("[VocabTree::Build] Error building tree\n");
+
+        delete [] means;
+        delete [] idx;
+        delete [] clustering;
+        return -1;
+    }
+
+    /* Times are summed over the nodes of each level, so with several
+     * threads they can exceed the wall-clock time */
+    printf("[VocabTree::Build] Time per level (s):\n");
+    printf("[VocabTree::Build]   level   k-means   partition\n");
+    for (int i = 0; i <= depth; i++) {
+        printf("[VocabTree::Build]   %5d %9.3f %11.3f\n", i, 
+               ctx.m_kmeans_time[i], ctx.m_partition_time[i]);
+    }
+    fflush(stdout);
+
+    delete [] means;
+    delete [] idx;
+    delete [] clustering;
+
+    /* Number the nodes, as Read does, so that the tree can be used
+     * (e.g., to add images) without being written and read back */
+    m_root->ComputeIDs(m_branch_factor, 0);
+    m_num_nodes = CountNodes();
 
     printf("[VocabTree::Build] Finished building tree.\n");
     fflush(stdout);
 
     return 0;
 }
+
+int VocabTree::Build(int n, int dim, int depth, int bf, int restarts, 
+                     unsigned char **vp, KMeansInit init,
+                     KMeansAssign assign, const KMeansOptions *options)
+{
+    DescriptorSet descs;
+    if (descs.Allocate(n, dim) != 0)
+        return -1;
+
+    for (int i = 0; i < n; i++)
+        memcpy(descs.GetDescriptor(i), vp[i], dim);
+
+    delete [] vp;
+
+    return Build(descs, depth, bf, restarts, init, assign, options);
+}
@@ -45,7 +45,105 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include "VocabTree.h"
+#include "defines.h"
+
+/* Header of a mapped (VTDB) database file.  Each array starts at the
+ * given byte offset, aligned to VTDB_ALIGN bytes; the nodes are in
+ * the breadth-first order of CompiledVocabTree, and the postings of
+ * word (node) i are entries [word_start[i], word_start[i+1]) of the
+ * index and count arrays.
+ *
+ * Version 2 adds raw databases (VTDB_RAW_COUNTS), whose counts are
+ * 16-bit raw counts and which end with the magnitude of each image.
+ * Weighted databases are still written as version 1. */
+#define VTDB_MAGIC "VTDB"
+#define VTDB_VERSION 2
+#define VTDB_ALIGN 64
+
+#define VTDB_RAW_COUNTS 0x1        /* Raw inverted file */
+#define VTDB_NORMALIZE 0x2         /* Image magnitudes are normalizing */
+
+typedef struct {
+    char magic[4];                 /* VTDB_MAGIC */
+    unsigned int version;          /* 1 or VTDB_VERSION */
+    unsigned int flags;            /* VTDB_RAW_COUNTS, VTDB_NORMALIZE */
+    int branch_factor;             /* Fields of the tree */
+    int depth;
+    int dim;
+    int distance_type;
+    int num_db_images;             /* 1 + largest image index */
+    unsigned long long num_nodes;  /* Number of nodes (words) */
+    unsigned long long num_entries; /* Number of postings */
+    unsigned long long desc_offset;         /* u8  [num_nodes * dim] */
+    unsigned long long first_child_offset;  /* u32 [num_nodes] */
+    unsigned long long num_children_offset; /* u32 [num_nodes] */
+    unsigned long long word_start_offset;   /* u64 [num_nodes + 1] */
+    unsigned long long index_offset;        /* u32 [num_entries] */
+    unsigned long long count_offset;        /* f32 [num_entries], or
+                                             * u16 if raw */
+    unsigned long long weight_offset;       /* f32 [num_nodes] */
+    unsigned long long file_size;
+    unsigned long long image_norm_offset;   /* f32 [num_db_images], if
+                                             * raw (version 2) */
+    unsigned long long reserved;
+} vtdb_header_t;
+
+/* Trailer of an incremental database, written after the tree and
+ * followed by the ImageStatus of each image index (one byte each).
+ * The image lists of the tree hold raw counts, and the leaf weights
+ * are the word weights; the image magnitudes are recomputed on
+ * reading.  Readers that don't know about the trailer stop at the end
+ * of the tree. */
+#define VTINC_MAGIC "VTIC"
+#define VTINC_VERSION 1
+
+#define VTINC_TFIDF 0x1
+#define VTINC_NORMALIZE 0x2
+
+typedef struct {
+    char magic[4];                 /* VTINC_MAGIC */
+    unsigned int version;          /* VTINC_VERSION */
+    unsigned int flags;            /* VTINC_TFIDF, VTINC_NORMALIZE */
+    int distance_type;             /* Distance the magnitudes are for */
+    unsigned int num_images;       /* Number of image indices */
+    unsigned int pad[3];
+} vtinc_trailer_t;
+
+static unsigned long long vtdb_align(unsigned long long offset)
+{
+    return (offset + VTDB_ALIGN - 1) / VTDB_ALIGN * VTDB_ALIGN;
+}
+
+/* Pad the file with zeros up to the given offset */
+static void vtdb_pad(FILE *f, unsigned long long offset)
+{
+    static const char zeros[VTDB_ALIGN] = { 0 };
+    long pos = ftell(f);
+
+    /* After a failed write the gap may be out of range; the error is
+     * left for the caller to find with ferror */
+    if (pos < 0 || (unsigned long long) pos > offset || 
+        offset - pos > VTDB_ALIGN)
+        return;
+
+    fwrite(zeros, 1, (size_t) (offset - pos), f);
+}
+
+/* Write an array at the given offset */
+static void vtdb_write_array(FILE *f, unsigned long long offset, 
+                             const void *data, size_t size, size_t count)
+{
+    vtdb_pad(f, offset);
+    fwrite(data, size, count, f);
+}
 
 int VocabTreeInteriorNode::Write(FILE *f, int bf, int dim) const {
     WriteNode(f, bf, dim);
@@ -239,6 +337,16 @@ int VocabTree::Read(const char *filename)
         return -1;
     }
 
+    /* Check for a mapped database */
+    char magic[4];
+    if (fread(magic, sizeof(char), 4, f) == 4 && 
+        memcmp(magic, VTDB_MAGIC, 4) == 0) {
+        fclose(f);
+        return ReadMapped(filename);
+    }
+
+    rewind(f);
+
     /* Read the fields for the tree */
     fread(&m_branch_factor, sizeof(int), 1, f);
     fread(&m_depth, sizeof(int), 1, f);
@@ -257,8 +365,65 @@ int VocabTree::Read(const char *filename)
 
     m_num_nodes = CountNodes();
 
+    int ret = ReadIncrementalState(f);
+
     fclose(f);
 
+    return ret;
+}
+
+int VocabTree::ReadIncrementalState(FILE *f)
+{
+    vtinc_trailer_t t;
+    if (fread(&t, sizeof(vtinc_trailer_t), 1, f) != 1 ||
+        memcmp(t.magic, VTINC_MAGIC, 4) != 0) {
+        /* A regular database */
+        return 0;
+    }
+
+    if (t.version != VTINC_VERSION) {
+        printf("[VocabTree::Read] Error: unknown incremental database "
+               "version %u\n", t.version);
+        return -1;
+    }
+
+    m_image_status.resize(t.num_images);
+    if (t.num_images > 0 &&
+        fread(&(m_image_status[0]), sizeof(unsigned char), t.num_images,
+              f) != t.num_images) {
+        printf("[VocabTree::Read] Error: incremental database is "
+               "truncated\n");
+        m_image_status.clear();
+        return -1;
+    }
+
+    m_incremental = true;
+    m_use_tfidf = (t.flags & VTINC_TFIDF) != 0;
+    m_normalize = (t.flags & VTINC_NORMALIZE) != 0;
+    m_distance_type = (DistanceType) t.distance_type;
+    m_image_norms.assign(t.num_images, 0.0);
+    m_weights_stale = true;
+
+    return UpdateWeights();
+}
+
+int VocabTree::WriteIncrementalState(FILE *f) const
+{
+    vtinc_trailer_t t;
+    memset(&t, 0, sizeof(vtinc_trailer_t));
+    memcpy(t.magic, VTINC_MAGIC, 4);
+    t.version = VTINC_VERSION;
+    t.flags = (m_use_tfidf ? VTINC_TFIDF : 0) | 
+        (m_normalize ? VTINC_NORMALIZE : 0);
+    t.distance_type = (int) m_distance_type;
+    t.num_images = (unsigned int) m_image_status.size();
+
+    fwrite(&t, sizeof(vtinc_trailer_t), 1, f);
+    if (t.num_images > 0) {
+        fwrite(&(m_image_status[0]), sizeof(unsigned char), t.num_images, 
+               f);
+    }
+
     return 0;
 }
 
@@ -277,6 +442,11 @@ int VocabTree::Write(const char *filename) const
     if (m_root == NULL) 
         return -1;
 
+    if (IsFrozen()) {
+        printf("[VocabTree::Write] Error: can't write a frozen database\n");
+        return -1;
+    }
+
     FILE *f = fopen(filename, "wb");
     
     if (f == NULL) {
@@ -289,6 +459,9 @@ int VocabTree::Write(const char *filename) const
     
     m_root->Write(f, m_branch_factor, m_dim);
 
+    if (m_incremental)
+        WriteIncrementalState(f);
+
     fclose(f);
 
     return 0;
@@ -347,6 +520,11 @@ int VocabTree::WriteDatabaseVectors(const char *filename,
     if (m_root == NULL)
         return -1;
 
+    if (IsFrozen()) {
+        printf("[WriteDatabaseVectors] Error: database is frozen\n");
+        return -1;
+    }
+
     std::vector<sp_list> vectors;
     vectors.resize(num_vectors);
     
@@ -382,3 +560,327 @@ int VocabTree::WriteDatabaseVectors(const char *filename,
 
     return 0;
 }
+
+/* Check that an array of count elements of elem_size bytes at offset
+ * lies inside a file of the given size */
+static bool vtdb_extent_ok(unsigned long long offset, 
+                           unsigned long long count, 
+                           unsigned long long elem_size, 
+                           unsigned long long size)
+{
+    return offset <= size && elem_size > 0 && 
+        count <= (size - offset) / elem_size;
+}
+
+/* Check the header of a mapped database of the given size, and the
+ * arrays the tree is descended through */
+static bool vtdb_header_ok(const char *map, unsigned long long size)
+{
+    if (size < sizeof(vtdb_header_t))
+        return false;
+
+    const vtdb_header_t *h = (const vtdb_header_t *) map;
+    if (memcmp(h->magic, VTDB_MAGIC, 4) != 0 ||
+        h->version < 1 || h->version > VTDB_VERSION || 
+        h->file_size != size)
+        return false;
+
+    if (h->dim <= 0 || h->num_db_images < 0 || h->num_nodes == 0 ||
+        h->num_nodes > 0xffffffffULL)
+        return false;
+
+    bool raw = (h->flags & VTDB_RAW_COUNTS) != 0;
+    if (raw && h->version < 2)
+        return false;
+
+    unsigned long long n = h->num_nodes, m = h->num_entries;
+    size_t count_size = raw ? sizeof(unsigned short) : sizeof(float);
+
+    if (!vtdb_extent_ok(h->desc_offset, n, h->dim, size) ||
+        !vtdb_extent_ok(h->first_child_offset, n, 
+                        sizeof(unsigned int), size) ||
+        !vtdb_extent_ok(h->num_children_offset, n, 
+                        sizeof(unsigned int), size) ||
+        !vtdb_extent_ok(h->word_start_offset, n + 1, 
+                        sizeof(unsigned long long), size) ||
+        !vtdb_extent_ok(h->index_offset, m, sizeof(unsigned int), size) ||
+        !vtdb_extent_ok(h->count_offset, m, count_size, size) ||
+        !vtdb_extent_ok(h->weight_offset, n, sizeof(float), size))
+        return false;
+
+    if (raw && !vtdb_extent_ok(h->image_norm_offset, h->num_db_images,
+                               sizeof(float), size))
+        return false;
+
+    /* The children of each node, and the postings of each word, must
+     * lie inside their arrays */
+    const unsigned int *first_child = 
+        (const unsigned int *) (map + h->first_child_offset);
+    const unsigned int *num_children = 
+        (const unsigned int *) (map + h->num_children_offset);
+    const unsigned long long *word_start = 
+        (const unsigned long long *) (map + h->word_start_offset);
+
+    if (word_start[0] != 0 || word_start[n] != m)
+        return false;
+
+    for (unsigned long long i = 0; i < n; i++) {
+        if ((unsigned long long) first_child[i] + num_children[i] > n ||
+            word_start[i] > word_start[i+1])
+            return false;
+    }
+
+    return true;
+}
+
+int VocabTree::ReadMapped(const char *filename)
+{
+    if (sizeof(unsigned long) != sizeof(unsigned long long)) {
+        printf("[VocabTree::ReadMapped] Error: mapped databases need "
+               "64-bit longs\n");
+        return -1;
+    }
+
+    /* Drop the tree or mapping this object held */
+    Clear();
+
+#ifndef WIN32
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("[VocabTree::ReadMapped] Error opening file %s for reading\n",
+               filename);
+        return -1;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    unsigned long size = (unsigned long) st.st_size;
+
+    char *map = NULL;
+    if (size >= sizeof(vtdb_header_t)) {
+        void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED)
+            map = (char *) addr;
+    }
+
+    close(fd);
+#else
+    /* No mmap: read the whole file into memory instead */
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("[VocabTree::ReadMapped] Error opening file %s for reading\n",
+               filename);
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    unsigned long size = (unsigned long) ftell(f);
+    rewind(f);
+
+    char *map = new char[size];
+    if (fread(map, 1, size, f) != size) {
+        delete [] map;
+        map = NULL;
+    }
+
+    fclose(f);
+#endif
+
+    if (map == NULL) {
+        printf("[VocabTree::ReadMapped] Error mapping file %s\n", filename);
+        return -1;
+    }
+
+    m_map = map;
+    m_map_size = size;
+
+    if (!vtdb_header_ok(map, size)) {
+        printf("[VocabTree::ReadMapped] Error: %s is not a version 1-%d "
+               "database, or is truncated or corrupt\n", 
+               filename, VTDB_VERSION);
+        UnmapDatabase();
+        return -1;
+    }
+
+    const vtdb_header_t *h = (const vtdb_header_t *) map;
+
+    m_branch_factor = h->branch_factor;
+    m_depth = h->depth;
+    m_dim = h->dim;
+    m_distance_type = (DistanceType) h->distance_type;
+    m_database_images = h->num_db_images;
+    m_num_nodes = (unsigned long) h->num_nodes;
+
+    m_compiled.Alias(m_num_nodes, m_dim, 
+                     (unsigned char *) (map + h->desc_offset),
+                     (unsigned int *) (map + h->first_child_offset),
+                     (unsigned int *) (map + h->num_children_offset));
+
+    if (h->flags & VTDB_RAW_COUNTS) {
+        m_normalize = (h->flags & VTDB_NORMALIZE) != 0;
+        m_inverted_file.Alias(m_num_nodes, (unsigned long) h->num_entries,
+                              (unsigned long *) (map + h->word_start_offset),
+                              (unsigned int *) (map + h->index_offset),
+                              NULL, (float *) (map + h->weight_offset),
+                              (unsigned short *) (map + h->count_offset),
+                              (unsigned long) h->num_db_images,
+                              (float *) (map + h->image_norm_offset));
+    } else {
+        m_inverted_file.Alias(m_num_nodes, (unsigned long) h->num_entries,
+                              (unsigned long *) (map + h->word_start_offset),
+                              (unsigned int *) (map + h->index_offset),
+                              (float *) (map + h->count_offset),
+                              (float *) (map + h->weight_offset));
+    }
+
+    return 0;
+}
+
+void VocabTree::UnmapDatabase()
+{
+    if (m_map == NULL)
+        return;
+
+    m_compiled.Clear();
+    m_inverted_file.Clear();
+
+#ifndef WIN32
+    munmap(m_map, m_map_size);
+#else
+    delete [] m_map;
+#endif
+
+    m_map = NULL;
+    m_map_size = 0;
+}
+
+int VocabTree::WriteMapped(const char *filename) const
+{
+    if (!IsFrozen() || m_root == NULL) {
+        printf("[VocabTree::WriteMapped] Error: the database must be "
+               "frozen before it is written\n");
+        return -1;
+    }
+
+    /* Lay the tree out in breadth-first order, and gather the
+     * postings and weights in that order */
+    CompiledVocabTree compiled;
+    std::vector<unsigned long> node_ids;
+    compiled.Compile(m_root, m_branch_factor, m_dim, node_ids);
+
+    unsigned long num_nodes = compiled.m_num_nodes;
+    const InvertedFile &inv = m_inverted_file;
+
+    std::vector<unsigned long long> word_start(num_nodes + 1);
+    std::vector<float> weight(num_nodes);
+    unsigned long long num_entries = 0;
+    int max_index = -1;
+
+    for (unsigned long i = 0; i < num_nodes; i++) {
+        unsigned long w = node_ids[i];
+        word_start[i] = num_entries;
+        weight[i] = inv.m_weight[w];
+        num_entries += inv.m_word_start[w+1] - inv.m_word_start[w];
+
+        for (unsigned long j = inv.m_word_start[w]; 
+             j < inv.m_word_start[w+1]; j++) {
+            max_index = MAX(max_index, (int) inv.m_index[j]);
+        }
+    }
+
+    word_start[num_nodes] = num_entries;
+
+    bool raw = inv.IsRaw();
+    size_t count_size = raw ? sizeof(unsigned short) : sizeof(float);
+
+    vtdb_header_t h;
+    memset(&h, 0, sizeof(vtdb_header_t));
+    memcpy(h.magic, VTDB_MAGIC, 4);
+    h.version = raw ? VTDB_VERSION : 1;
+    h.flags = raw ? (VTDB_RAW_COUNTS | (m_normalize ? VTDB_NORMALIZE : 0)) :
+        0;
+    h.branch_factor = m_branch_factor;
+    h.depth = m_depth;
+    h.dim = m_dim;
+    h.distance_type = (int) m_distance_type;
+    h.num_db_images = raw ? (int) inv.m_num_images : max_index + 1;
+    h.num_nodes = num_nodes;
+    h.num_entries = num_entries;
+
+    h.desc_offset = vtdb_align(sizeof(vtdb_header_t));
+    h.first_child_offset = 
+        vtdb_align(h.desc_offset + (unsigned long long) num_nodes * m_dim);
+    h.num_children_offset = 
+        vtdb_align(h.first_child_offset + num_nodes * sizeof(unsigned int));
+    h.word_start_offset = 
+        vtdb_align(h.num_children_offset + num_nodes * sizeof(unsigned int));
+    h.index_offset = 
+        vtdb_align(h.word_start_offset + 
+                   (num_nodes + 1) * sizeof(unsigned long long));
+    h.count_offset = 
+        vtdb_align(h.index_offset + num_entries * sizeof(unsigned int));
+    h.weight_offset = 
+        vtdb_align(h.count_offset + num_entries * count_size);
+    h.file_size = h.weight_offset + num_nodes * sizeof(float);
+
+    if (raw) {
+        h.image_norm_offset = vtdb_align(h.file_size);
+        h.file_size = h.image_norm_offset + 
+            (unsigned long long) inv.m_num_images * sizeof(float);
+    }
+
+    FILE *f = fopen(filename, "wb");
+    
+    if (f == NULL) {
+        printf("[VocabTree::WriteMapped] Error opening file %s for writing\n",
+               filename);
+        return -1;
+    }
+
+    fwrite(&h, sizeof(vtdb_header_t), 1, f);
+
+    vtdb_write_array(f, h.desc_offset, compiled.m_desc, 
+                     sizeof(unsigned char), num_nodes * m_dim);
+    vtdb_write_array(f, h.first_child_offset, compiled.m_first_child, 
+                     sizeof(unsigned int), num_nodes);
+    vtdb_write_array(f, h.num_children_offset, compiled.m_num_children, 
+                     sizeof(unsigned int), num_nodes);
+    vtdb_write_array(f, h.word_start_offset, &(word_start[0]), 
+                     sizeof(unsigned long long), num_nodes + 1);
+
+    /* Postings, word by word */
+    vtdb_pad(f, h.index_offset);
+    for (unsigned long i = 0; i < num_nodes; i++) {
+        unsigned long w = node_ids[i];
+        fwrite(inv.m_index + inv.m_word_start[w], sizeof(unsigned int),
+               inv.m_word_start[w+1] - inv.m_word_start[w], f);
+    }
+
+    vtdb_pad(f, h.count_offset);
+    for (unsigned long i = 0; i < num_nodes; i++) {
+        unsigned long w = node_ids[i];
+        const void *counts = raw ? 
+            (const void *) (inv.m_raw_count + inv.m_word_start[w]) :
+            (const void *) (inv.m_count + inv.m_word_start[w]);
+        fwrite(counts, count_size, 
+               inv.m_word_start[w+1] - inv.m_word_start[w], f);
+    }
+
+    vtdb_write_array(f, h.weight_offset, &(weight[0]), 
+                     sizeof(float), num_nodes);
+
+    if (raw && inv.m_num_images > 0) {
+        vtdb_write_array(f, h.image_norm_offset, inv.m_image_norm,
+                         sizeof(float), inv.m_num_images);
+    }
+
+    /* Don't leave a truncated database behind for ReadMapped */
+    bool failed = (ferror(f) != 0);
+    if (fclose(f) != 0 || failed) {
+        printf("[VocabTree::WriteMapped] Error writing file %s\n", filename);
+        remove(filename);
+        return -1;
+    }
+
+    return 0;
+}
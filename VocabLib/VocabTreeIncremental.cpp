@@ -0,0 +1,300 @@
+/* VocabTreeIncremental.cpp */
+/* Incremental databases: raw counts in the image lists, with the word
+ * weights and image magnitudes applied when scoring */
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "VocabTree.h"
+#include "defines.h"
+
+int VocabTree::StartIncrementalDatabase(bool use_tfidf, bool normalize)
+{
+    if (m_root == NULL || IsFrozen()) {
+        printf("[VocabTree::StartIncrementalDatabase] Error: the database "
+               "is frozen\n");
+        return -1;
+    }
+
+    m_incremental = true;
+    m_use_tfidf = use_tfidf;
+    m_normalize = normalize;
+
+    ClearDatabase();
+    SetConstantLeafWeights();
+    MapWordLeaves();
+
+    return 0;
+}
+
+int VocabTree::AddIncrementalImage(int index, int n,
+                                   const unsigned long *words)
+{
+    if (index < 0 || (index < (int) m_image_status.size() &&
+                      m_image_status[index] != ImageAbsent)) {
+        printf("[VocabTree::AddWordsToDatabase] Error: image index %d is "
+               "in use\n", index);
+        return -1;
+    }
+
+    if ((int) m_image_status.size() <= index) {
+        m_image_status.resize(index + 1, ImageAbsent);
+        m_image_norms.resize(index + 1, 0.0);
+    }
+
+    std::vector<unsigned long> sorted(words, words + n);
+    std::sort(sorted.begin(), sorted.end());
+
+    /* Add one posting per distinct word, holding its raw count, and
+     * compute the magnitude of the image with the current weights */
+    float mag = 0.0;
+    for (int i = 0; i < n; ) {
+        unsigned long w = sorted[i];
+        float count = 0.0;
+
+        for (; i < n && sorted[i] == w; i++)
+            count += 1.0;
+
+        VocabTreeLeaf *leaf = m_word_leaves[w];
+        leaf->m_image_list.push_back(ImageCount(index, count));
+        mag += ComputeMagnitude(m_distance_type, count * leaf->m_weight);
+    }
+
+    m_image_status[index] = ImageLive;
+    m_image_norms[index] = mag;
+    m_database_images++;
+    m_weights_stale = true;
+
+    return 0;
+}
+
+int VocabTree::RemoveImage(int index)
+{
+    if (!m_incremental) {
+        printf("[VocabTree::RemoveImage] Error: the database is not "
+               "incremental\n");
+        return -1;
+    }
+
+    if (index < 0 || !IsLive(index)) {
+        printf("[VocabTree::RemoveImage] Error: image %d is not in the "
+               "database\n", index);
+        return -1;
+    }
+
+    m_image_status[index] = ImageRemoved;
+    m_database_images--;
+    m_weights_stale = true;
+
+    return 0;
+}
+
+int VocabTree::CompactDatabase()
+{
+    if (!m_incremental)
+        return 0;
+
+    MapWordLeaves();
+
+    int num_words = (int) m_word_leaves.size();
+    unsigned long num_dropped = 0;
+
+    for (int w = 0; w < num_words; w++) {
+        if (m_word_leaves[w] == NULL)
+            continue;
+
+        std::vector<ImageCount> &list = m_word_leaves[w]->m_image_list;
+        int len = (int) list.size(), len_out = 0;
+
+        for (int i = 0; i < len; i++) {
+            if (m_image_status[list[i].m_index] != ImageRemoved)
+                list[len_out++] = list[i];
+        }
+
+        num_dropped += len - len_out;
+        list.resize(len_out);
+    }
+
+    int num_images = (int) m_image_status.size();
+    for (int i = 0; i < num_images; i++) {
+        if (m_image_status[i] == ImageRemoved) {
+            m_image_status[i] = ImageAbsent;
+            m_image_norms[i] = 0.0;
+        }
+    }
+
+    printf("[VocabTree::CompactDatabase] Dropped %lu postings\n",
+           num_dropped);
+
+    return 0;
+}
+
+int VocabTree::UpdateWeights()
+{
+    if (!m_incremental) {
+        printf("[VocabTree::UpdateWeights] Error: the database is not "
+               "incremental\n");
+        return -1;
+    }
+
+    if (!m_weights_stale)
+        return 0;
+
+    MapWordLeaves();
+
+    int num_words = (int) m_word_leaves.size();
+    int num_images = (int) m_image_status.size();
+
+    int num_live = 0;
+    for (int i = 0; i < num_images; i++) {
+        if (m_image_status[i] == ImageLive)
+            num_live++;
+    }
+
+    m_database_images = num_live;
+
+    /* IDF of each word, counting the live images only, as
+     * ComputeTFIDFWeights does */
+    if (m_use_tfidf) {
+#pragma omp parallel for schedule(dynamic, 256)
+        for (int w = 0; w < num_words; w++) {
+            VocabTreeLeaf *leaf = m_word_leaves[w];
+            if (leaf == NULL)
+                continue;
+
+            const std::vector<ImageCount> &list = leaf->m_image_list;
+            int len = (int) list.size(), df = 0;
+
+            for (int i = 0; i < len; i++) {
+                if (m_image_status[list[i].m_index] == ImageLive)
+                    df++;
+            }
+
+            if (df > 0)
+                leaf->m_weight = log((double) num_live / (double) df);
+            else
+                leaf->m_weight = 0.0;
+        }
+    }
+
+    /* Magnitudes of the weighted image vectors, summed word by word
+     * as NormalizeDatabase does */
+    std::fill(m_image_norms.begin(), m_image_norms.end(), 0.0);
+
+    if (m_normalize) {
+        for (int w = 0; w < num_words; w++) {
+            const VocabTreeLeaf *leaf = m_word_leaves[w];
+            if (leaf == NULL)
+                continue;
+
+            const std::vector<ImageCount> &list = leaf->m_image_list;
+            int len = (int) list.size();
+
+            for (int i = 0; i < len; i++) {
+                unsigned int index = list[i].m_index;
+                if (m_image_status[index] != ImageLive)
+                    continue;
+
+                float count = list[i].m_count * leaf->m_weight;
+                m_image_norms[index] +=
+                    ComputeMagnitude(m_distance_type, count);
+            }
+        }
+    }
+
+    m_weights_stale = false;
+
+    return 0;
+}
+
+int VocabTree::ApplyWeights()
+{
+    int num_words = (int) m_word_leaves.size();
+
+    for (int w = 0; w < num_words; w++) {
+        VocabTreeLeaf *leaf = m_word_leaves[w];
+        if (leaf == NULL)
+            continue;
+
+        std::vector<ImageCount> &list = leaf->m_image_list;
+        int len = (int) list.size(), len_out = 0;
+
+        for (int i = 0; i < len; i++) {
+            unsigned int index = list[i].m_index;
+            if (m_image_status[index] != ImageLive)
+                continue;
+
+            float count = list[i].m_count * leaf->m_weight;
+
+            if (m_normalize) {
+                float mag = m_image_norms[index];
+                count = (mag > 0.0) ? count / mag : 0.0;
+            }
+
+            list[len_out++] = ImageCount(index, count);
+        }
+
+        list.resize(len_out);
+    }
+
+    m_incremental = false;
+    m_weights_stale = false;
+    m_image_status.clear();
+    m_image_norms.clear();
+
+    return 0;
+}
+
+int VocabTree::ScoreQueryIncremental(const sp_list &q, float *scores,
+                                     std::vector<unsigned int> *touched)
+    const
+{
+    int n = (int) q.size();
+
+    for (int j = 0; j < n; j++) {
+        const VocabTreeLeaf *leaf = m_word_leaves[q[j].first];
+        float qw = q[j].second;
+
+        const std::vector<ImageCount> &list = leaf->m_image_list;
+        int len = (int) list.size();
+
+        for (int i = 0; i < len; i++) {
+            unsigned int img = list[i].m_index;
+            if (m_image_status[img] != ImageLive)
+                continue;
+
+            /* Weight and normalize the raw count, as ApplyWeights
+             * would */
+            float count = list[i].m_count * leaf->m_weight;
+
+            if (m_normalize) {
+                float mag = m_image_norms[img];
+                if (mag == 0.0)
+                    continue;
+
+                count /= mag;
+            }
+
+            float prev = scores[img];
+
+            switch (m_distance_type) {
+            case DistanceDot:
+                scores[img] += qw * count;
+                break;
+            case DistanceMin:
+                scores[img] += MIN(qw, count);
+                break;
+            }
+
+            if (touched != NULL && prev == 0.0 && scores[img] != 0.0)
+                touched->push_back(img);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,330 @@
+/* VocabTreeMiniBatch.cpp */
+/* Mini-batch hierarchical k-means, for training sets that do not fit
+ * in memory */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "VocabTree.h"
+#include "keys2.h"
+#include "kmeans.h"
+#include "util.h"
+
+using namespace ann_1_1_char;
+
+/* A node of the tree under construction.  The children of a node are
+ * stored next to each other, as in CompiledVocabTree, so that the
+ * nearest child can be found with one call to annNearestPt */
+typedef struct {
+    int first_child;    /* Index of the first child, or -1 for a leaf */
+    int num_children;   /* Number of children */
+} mb_node_t;
+
+/* Training state of a node that is being split at the current level */
+typedef struct {
+    int node;                       /* Index of the node */
+    bool initialized;               /* Have the centroids been seeded? */
+    std::vector<unsigned char> init_buf; /* Samples held for seeding */
+    float *centroids;               /* bf running means */
+    unsigned char *centroids_u8;    /* Rounded means, for assignment */
+    unsigned int *counts;           /* Samples absorbed by each mean */
+} mb_frontier_t;
+
+/* Read randomly chosen key files until at least batch_size
+ * descriptors have been collected; returns the number read */
+static int read_batch(const std::vector<std::string> &key_files, int dim,
+                      int batch_size, std::vector<unsigned char> &batch)
+{
+    int num_files = (int) key_files.size();
+    int n = 0;
+
+    batch.clear();
+
+    /* Give up after a generous number of empty files */
+    for (int tries = 0; n < batch_size && tries < 16 * num_files; tries++) {
+        const char *file = key_files[rand() % num_files].c_str();
+
+        unsigned char *keys;
+        int num_keys = ReadKeyFile(file, &keys);
+
+        if (num_keys <= 0) {
+            delete [] keys;
+            continue;
+        }
+
+        batch.resize((size_t) (n + num_keys) * dim);
+        memcpy(&batch[(size_t) n * dim], keys, (size_t) num_keys * dim);
+
+        n += num_keys;
+        delete [] keys;
+    }
+
+    return n;
+}
+
+/* Fold sample v into mean c of frontier node f */
+static void update_mean(mb_frontier_t &f, int c, int dim,
+                        const unsigned char *v)
+{
+    f.counts[c]++;
+
+    float eta = 1.0f / f.counts[c];
+    float *mean = f.centroids + c * dim;
+    for (int j = 0; j < dim; j++)
+        mean[j] += eta * ((float) v[j] - mean[j]);
+}
+
+/* Seed the means of frontier node f from its buffered samples, then
+ * fold the rest of the buffer in */
+static void seed_means(mb_frontier_t &f, int dim, int bf, KMeansInit init)
+{
+    int n = (int) f.init_buf.size() / dim;
+
+    const unsigned char *data = &f.init_buf[0];
+    std::vector<unsigned int> idx(n);
+    for (int i = 0; i < n; i++)
+        idx[i] = i;
+
+    int *starts = new int[bf];
+    kmeans_choose_starts(n, dim, bf, data, &idx[0], init, starts);
+
+    for (int c = 0; c < bf; c++) {
+        const unsigned char *v = data + (size_t) starts[c] * dim;
+        for (int j = 0; j < dim; j++)
+            f.centroids[c * dim + j] = v[j];
+        f.counts[c] = 1;
+    }
+
+    delete [] starts;
+
+    for (int c = 0; c < bf * dim; c++)
+        f.centroids_u8[c] = (unsigned char) iround(f.centroids[c]);
+
+    for (int i = 0; i < n; i++) {
+        const unsigned char *v = data + (size_t) i * dim;
+        ann_1_1_char::ANNdist d;
+        int c = annNearestPt(dim, v, f.centroids_u8, bf, d);
+        update_mean(f, c, dim, v);
+    }
+
+    f.initialized = true;
+    std::vector<unsigned char>().swap(f.init_buf);
+}
+
+/* Create a tree node, and its subtree, from the temporary nodes */
+static VocabTreeNode *make_node(const std::vector<mb_node_t> &nodes,
+                                const std::vector<unsigned char> &desc,
+                                int idx, int bf, int dim)
+{
+    const mb_node_t &node = nodes[idx];
+    VocabTreeNode *out;
+
+    if (node.first_child < 0) {
+        out = new VocabTreeLeaf();
+    } else {
+        VocabTreeInteriorNode *interior = new VocabTreeInteriorNode();
+        interior->m_children = new VocabTreeNode *[bf];
+
+        for (int i = 0; i < bf; i++) {
+            if (i < node.num_children) {
+                interior->m_children[i] =
+                    make_node(nodes, desc, node.first_child + i, bf, dim);
+            } else {
+                interior->m_children[i] = NULL;
+            }
+        }
+
+        out = interior;
+    }
+
+    out->m_desc = new unsigned char[dim];
+    memcpy(out->m_desc, &desc[(size_t) idx * dim], dim);
+
+    return out;
+}
+
+int VocabTree::BuildMiniBatch(const std::vector<std::string> &key_files,
+                              int dim, int depth, int bf,
+                              int batch_size, int num_batches,
+                              KMeansInit init)
+{
+    if (key_files.size() == 0) {
+        printf("[VocabTree::BuildMiniBatch] Error: no key files\n");
+        return -1;
+    }
+
+    printf("[VocabTree::BuildMiniBatch] Building tree with depth %d, "
+           "branching factor %d\n", depth, bf);
+    printf("[VocabTree::BuildMiniBatch]   from %d batches of %d features "
+           "per level\n", num_batches, batch_size);
+    fflush(stdout);
+
+    m_depth = depth;
+    m_dim = dim;
+    m_branch_factor = bf;
+
+    std::vector<mb_node_t> nodes;
+    std::vector<unsigned char> desc;
+    std::vector<unsigned char> batch;
+
+    /* The root descriptor is all zeros, as in Build */
+    mb_node_t root = { -1, 0 };
+    nodes.push_back(root);
+    desc.resize(dim, 0);
+
+    /* Nodes on the current level that will be split */
+    std::vector<int> level;
+    level.push_back(0);
+
+    for (int depth_curr = 0; depth_curr <= depth && !level.empty();
+         depth_curr++) {
+        int num_level = (int) level.size();
+
+        printf("[VocabTree::BuildMiniBatch] (level %d): "
+               "Training %d nodes\n", depth_curr, num_level);
+        fflush(stdout);
+
+        /* frontier_idx[node] is the position of node in frontier, or
+         * -1 if it is not being split */
+        std::vector<int> frontier_idx(nodes.size(), -1);
+        std::vector<mb_frontier_t> frontier(num_level);
+
+        for (int i = 0; i < num_level; i++) {
+            frontier[i].node = level[i];
+            frontier[i].initialized = false;
+            frontier[i].centroids = new float[bf * dim];
+            frontier[i].centroids_u8 = new unsigned char[bf * dim];
+            frontier[i].counts = new unsigned int[bf];
+            frontier_idx[level[i]] = i;
+        }
+
+        /* A node is split only if it sees more than 2 * bf samples,
+         * mirroring the leaf rule in BuildRecurse */
+        const size_t init_size = (size_t) (2 * bf + 1) * dim;
+
+        for (int b = 0; b < num_batches; b++) {
+            int n = read_batch(key_files, dim, batch_size, batch);
+
+            std::vector<int> assign_node(n), assign_mean(n);
+
+            /* Push every sample down to the current level, and to the
+             * nearest mean of its node, with the means fixed */
+#pragma omp parallel for schedule(dynamic, 256)
+            for (int i = 0; i < n; i++) {
+                const unsigned char *v = &batch[(size_t) i * dim];
+                int node = 0;
+
+                while (nodes[node].first_child >= 0) {
+                    ann_1_1_char::ANNdist d;
+                    int first = nodes[node].first_child;
+                    node = first +
+                        annNearestPt(dim, v, &desc[(size_t) first * dim],
+                                     nodes[node].num_children, d);
+                }
+
+                int f = frontier_idx[node];
+                int c = -1;
+
+                if (f >= 0 && frontier[f].initialized) {
+                    ann_1_1_char::ANNdist d;
+                    c = annNearestPt(dim, v, frontier[f].centroids_u8,
+                                     bf, d);
+                }
+
+                assign_node[i] = f;
+                assign_mean[i] = c;
+            }
+
+            /* Apply the updates, in order */
+            for (int i = 0; i < n; i++) {
+                int f = assign_node[i];
+                if (f < 0)
+                    continue;
+
+                mb_frontier_t &fr = frontier[f];
+                const unsigned char *v = &batch[(size_t) i * dim];
+
+                if (assign_mean[i] >= 0) {
+                    update_mean(fr, assign_mean[i], dim, v);
+                } else if (fr.initialized) {
+                    /* Seeded earlier in this batch */
+                    ann_1_1_char::ANNdist d;
+                    int c = annNearestPt(dim, v, fr.centroids_u8, bf, d);
+                    update_mean(fr, c, dim, v);
+                } else {
+                    fr.init_buf.insert(fr.init_buf.end(), v, v + dim);
+                    if (fr.init_buf.size() >= init_size)
+                        seed_means(fr, dim, bf, init);
+                }
+            }
+
+            /* Refresh the rounded means used for assignment */
+#pragma omp parallel for
+            for (int f = 0; f < num_level; f++) {
+                if (!frontier[f].initialized)
+                    continue;
+
+                for (int c = 0; c < bf * dim; c++) {
+                    frontier[f].centroids_u8[c] =
+                        (unsigned char) iround(frontier[f].centroids[c]);
+                }
+            }
+        }
+
+        /* Add the children of the nodes that were split */
+        std::vector<int> next_level;
+        int num_split = 0;
+
+        for (int i = 0; i < num_level; i++) {
+            mb_frontier_t &fr = frontier[i];
+
+            if (fr.initialized) {
+                int first = (int) nodes.size();
+                nodes[fr.node].first_child = first;
+                nodes[fr.node].num_children = bf;
+
+                desc.insert(desc.end(), fr.centroids_u8,
+                            fr.centroids_u8 + bf * dim);
+
+                for (int c = 0; c < bf; c++) {
+                    mb_node_t child = { -1, 0 };
+                    nodes.push_back(child);
+
+                    if (depth_curr < depth)
+                        next_level.push_back(first + c);
+                }
+
+                num_split++;
+            }
+
+            delete [] fr.centroids;
+            delete [] fr.centroids_u8;
+            delete [] fr.counts;
+        }
+
+        printf("[VocabTree::BuildMiniBatch] (level %d): "
+               "Split %d of %d nodes\n", depth_curr, num_split, num_level);
+        fflush(stdout);
+
+        level.swap(next_level);
+    }
+
+    if (nodes[0].first_child < 0) {
+        printf("[VocabTree::BuildMiniBatch] Error: too few features to "
+               "split the root\n");
+        return -1;
+    }
+
+    m_root = make_node(nodes, desc, 0, bf, dim);
+
+    /* Number the nodes, as Build does */
+    m_root->ComputeIDs(m_branch_factor, 0);
+    m_num_nodes = CountNodes();
+
+    printf("[VocabTree::BuildMiniBatch] Finished building tree "
+           "(%d nodes).\n", (int) nodes.size());
+    fflush(stdout);
+
+    return 0;
+}
@@ -241,12 +241,28 @@ int VocabTree::ClearDatabase()
     if (m_root != NULL) {
         m_root->ClearDatabase(m_branch_factor);
     }
+
+    m_inverted_file.Clear();
+
+    /* An incremental database stays incremental, but empty */
+    m_image_status.clear();
+    m_image_norms.clear();
+    if (m_incremental) {
+        m_database_images = 0;
+        m_weights_stale = true;
+    }
     
     return 0;
 }
 
 int VocabTree::SetInteriorNodeWeight(float weight)
 {
+    if (IsMapped()) {
+        printf("[VocabTree::SetInteriorNodeWeight] Error: the weights of a "
+               "mapped database can't be changed\n");
+        return -1;
+    }
+
     if (m_root != NULL) {
         m_root->SetInteriorNodeWeight(m_branch_factor, weight);
     }
@@ -256,6 +272,12 @@ int VocabTree::SetInteriorNodeWeight(float weight)
 
 int VocabTree::SetInteriorNodeWeight(int dist_from_leaves, float weight)
 {
+    if (IsMapped()) {
+        printf("[VocabTree::SetInteriorNodeWeight] Error: the weights of a "
+               "mapped database can't be changed\n");
+        return -1;
+    }
+
     if (m_root != NULL) {
         m_root->SetInteriorNodeWeight(m_branch_factor, 
                                       dist_from_leaves,weight);
@@ -266,6 +288,12 @@ int VocabTree::SetInteriorNodeWeight(int dist_from_leaves, float weight)
 
 int VocabTree::SetConstantLeafWeights() 
 {
+    if (IsMapped()) {
+        printf("[VocabTree::SetConstantLeafWeights] Error: the weights of a "
+               "mapped database can't be changed\n");
+        return -1;
+    }
+
     if (m_root != NULL) {
         m_root->SetConstantLeafWeights(m_branch_factor);
     }
@@ -275,6 +303,13 @@ int VocabTree::SetConstantLeafWeights()
 
 int VocabTree::SetDistanceType(DistanceType type)
 {
+    /* The image magnitudes depend on the distance */
+    if (m_incremental && type != m_distance_type)
+        m_weights_stale = true;
+
+    if (m_inverted_file.IsRaw() && type != m_distance_type)
+        m_inverted_file.ComputeImageNorms(type, m_normalize);
+
     m_distance_type = type;
     return 0;
 }
@@ -0,0 +1,218 @@
+/* VocabWordCache.cpp */
+/* Per-image cache of the visual words of the features in a key file */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "defines.h"
+#include "VocabWordCache.h"
+
+std::string ImageWords::CacheFile(const char *keyfile,
+                                  unsigned int tree_checksum)
+{
+    char suffix[32];
+    sprintf(suffix, ".%08x.bow", tree_checksum);
+
+    return std::string(keyfile) + suffix;
+}
+
+int ImageWords::KeyFileStamp(const char *keyfile, unsigned long long &size,
+                             long long &mtime)
+{
+    struct stat st;
+    std::string gz = std::string(keyfile) + ".gz";
+
+    if (stat(keyfile, &st) != 0 && stat(gz.c_str(), &st) != 0)
+        return -1;
+
+    size = (unsigned long long) st.st_size;
+    mtime = (long long) st.st_mtime;
+
+    return 0;
+}
+
+int ImageWords::Read(const char *filename, unsigned int tree_checksum,
+                     unsigned long long key_size, long long key_mtime)
+{
+    m_words.clear();
+    m_scales.clear();
+    m_dists.clear();
+
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL)
+        return -1;
+
+    word_cache_header_t h;
+    if (fread(&h, sizeof(word_cache_header_t), 1, f) != 1 ||
+        memcmp(h.magic, WORD_CACHE_MAGIC, 4) != 0 ||
+        h.version != WORD_CACHE_VERSION ||
+        h.tree_checksum != tree_checksum ||
+        h.key_file_size != key_size || h.key_file_mtime != key_mtime) {
+        fclose(f);
+        return -1;
+    }
+
+    int n = (int) h.num_keys;
+    m_words.resize(n);
+    m_scales.resize(n);
+    if (h.flags & WORD_CACHE_DISTANCES)
+        m_dists.resize(n);
+
+    bool ok = true;
+    if (n > 0) {
+        ok = fread(&(m_words[0]), sizeof(unsigned int), n, f) ==
+                (size_t) n &&
+            fread(&(m_scales[0]), sizeof(float), n, f) == (size_t) n;
+
+        if (ok && !m_dists.empty()) {
+            ok = fread(&(m_dists[0]), sizeof(unsigned int), n, f) ==
+                (size_t) n;
+        }
+    }
+
+    fclose(f);
+
+    if (!ok) {
+        printf("[ImageWords::Read] Error: %s is truncated\n", filename);
+
+        m_words.clear();
+        m_scales.clear();
+        m_dists.clear();
+        return -1;
+    }
+
+    return 0;
+}
+
+int ImageWords::Write(const char *filename, unsigned int tree_checksum,
+                      unsigned long long key_size, 
+                      long long key_mtime) const
+{
+    std::string tmp = std::string(filename) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+
+    if (f == NULL) {
+        printf("[ImageWords::Write] Error opening file %s for writing\n",
+               tmp.c_str());
+        return -1;
+    }
+
+    int n = (int) m_words.size();
+
+    word_cache_header_t h;
+    memset(&h, 0, sizeof(word_cache_header_t));
+    memcpy(h.magic, WORD_CACHE_MAGIC, 4);
+    h.version = WORD_CACHE_VERSION;
+    h.tree_checksum = tree_checksum;
+    h.num_keys = n;
+    h.flags = m_dists.empty() ? 0 : WORD_CACHE_DISTANCES;
+    h.key_file_size = key_size;
+    h.key_file_mtime = key_mtime;
+
+    fwrite(&h, sizeof(word_cache_header_t), 1, f);
+    if (n > 0) {
+        fwrite(&(m_words[0]), sizeof(unsigned int), n, f);
+        fwrite(&(m_scales[0]), sizeof(float), n, f);
+
+        if (!m_dists.empty())
+            fwrite(&(m_dists[0]), sizeof(unsigned int), n, f);
+    }
+
+    if (ferror(f) != 0 || fclose(f) != 0 ||
+        rename(tmp.c_str(), filename) != 0) {
+        printf("[ImageWords::Write] Error writing file %s\n", filename);
+        remove(tmp.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+void ImageWords::Quantize(const VocabTree &tree, int n,
+                          const unsigned char *keys, const keypt_t *info,
+                          bool dists)
+{
+    std::vector<unsigned long> words(n), d;
+    if (dists)
+        d.resize(n);
+
+    if (n > 0)
+        tree.QuantizeBatch(n, keys, &(words[0]), dists ? &(d[0]) : NULL);
+
+    m_words.resize(n);
+    m_scales.resize(n);
+    m_dists.resize(d.size());
+
+    for (int i = 0; i < n; i++) {
+        m_words[i] = (unsigned int) words[i];
+        m_scales[i] = info[i].scale;
+    }
+
+    for (int i = 0; i < (int) d.size(); i++)
+        m_dists[i] = (unsigned int) MIN(d[i], (unsigned long) UINT_MAX);
+}
+
+int ImageWords::ReadOrQuantize(const VocabTree &tree,
+                               unsigned int tree_checksum,
+                               const char *keyfile)
+{
+    std::string cache = CacheFile(keyfile, tree_checksum);
+
+    /* Stamp the key file before reading it, so a key file rewritten
+     * while it is quantized leaves a stale cache rather than a wrong
+     * one */
+    unsigned long long key_size = 0;
+    long long key_mtime = 0;
+    bool stamped = (KeyFileStamp(keyfile, key_size, key_mtime) == 0);
+
+    if (stamped && 
+        Read(cache.c_str(), tree_checksum, key_size, key_mtime) == 0)
+        return GetNumKeys();
+
+    unsigned char *keys;
+    keypt_t *info;
+    int n = ReadKeyFile(keyfile, &keys, &info);
+
+    if (n < 0)
+        n = 0;
+
+    Quantize(tree, n, keys, info, true);
+
+    /* Don't cache a key file that couldn't be read */
+    if (stamped && n > 0)
+        Write(cache.c_str(), tree_checksum, key_size, key_mtime);
+
+    delete [] keys;
+    delete [] info;
+
+    return n;
+}
+
+int ImageWords::Select(double min_scale, int max_keys,
+                       std::vector<unsigned long> &words,
+                       std::vector<unsigned int> *keys) const
+{
+    int n = GetNumKeys();
+
+    words.clear();
+    if (keys != NULL)
+        keys->clear();
+
+    for (int i = 0; i < n; i++) {
+        if (m_scales[i] < min_scale)
+            continue;
+
+        words.push_back(m_words[i]);
+        if (keys != NULL)
+            keys->push_back(i);
+
+        if (max_keys > 0 && (int) words.size() >= max_keys)
+            break;
+    }
+
+    return (int) words.size();
+}
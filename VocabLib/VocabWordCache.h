@@ -0,0 +1,96 @@
+/* VocabWordCache.h */
+/* Per-image cache of the visual words of the features in a key file */
+
+#ifndef __VOCAB_WORD_CACHE_H__
+#define __VOCAB_WORD_CACHE_H__
+
+#include <string>
+#include <vector>
+
+#include "keys2.h"
+#include "VocabTree.h"
+
+/* Layout of a word cache file: this header, followed by num_keys
+ * word ids (unsigned int), num_keys keypoint scales (float) and, if
+ * WORD_CACHE_DISTANCES is set, num_keys squared distances from the
+ * features to their words (unsigned int).  Entry i is key i of the
+ * key file.  Numbers are in native byte order.  Version 2 adds the
+ * size and modification time of the key file. */
+#define WORD_CACHE_MAGIC "VTBW"
+#define WORD_CACHE_VERSION 2
+
+#define WORD_CACHE_DISTANCES 0x1
+
+typedef struct {
+    char magic[4];                  /* WORD_CACHE_MAGIC */
+    unsigned int version;           /* WORD_CACHE_VERSION */
+    unsigned int tree_checksum;     /* VocabTree::Checksum of the tree */
+    unsigned int num_keys;
+    unsigned int flags;             /* WORD_CACHE_DISTANCES */
+    unsigned int pad0;
+    unsigned long long key_file_size;  /* Size of the key file */
+    long long key_file_mtime;       /* Modification time of the key file */
+    char pad[24];
+} word_cache_header_t;
+
+/* The words of every feature of one image.  A cache is only valid
+ * for trees with the checksum it was written with, and for the key
+ * file as it was when the cache was written; a stale or missing cache
+ * is rebuilt from the key file. */
+class ImageWords {
+public:
+    ImageWords() { }
+
+    /* Name of the word cache of a key file for the tree with the
+     * given checksum: the key file name with .<checksum>.bow
+     * appended, so that caches for several trees (e.g., a tree and
+     * the flattened tree stored in a database) can coexist */
+    static std::string CacheFile(const char *keyfile,
+                                 unsigned int tree_checksum);
+
+    /* Get the size and modification time of a key file (or of its
+     * gzipped version, as ReadKeyFile reads).  Returns -1 if neither
+     * exists. */
+    static int KeyFileStamp(const char *keyfile, unsigned long long &size,
+                            long long &mtime);
+
+    /* Read a cache file.  Returns 0 on success, or -1 if the file is
+     * missing, malformed, or was written for another tree or another
+     * version of the key file */
+    int Read(const char *filename, unsigned int tree_checksum,
+             unsigned long long key_size, long long key_mtime);
+
+    /* Write a cache file.  The file is written under a temporary name
+     * and renamed, so readers never see a partial file. */
+    int Write(const char *filename, unsigned int tree_checksum,
+              unsigned long long key_size, long long key_mtime) const;
+
+    /* Quantize the n features of a key file (with keypoints info)
+     * with the given tree, optionally keeping the distances */
+    void Quantize(const VocabTree &tree, int n, const unsigned char *keys,
+                  const keypt_t *info, bool dists);
+
+    /* Read the words of a key file from its cache if the cache is
+     * valid for tree and the key file, and otherwise quantize the key
+     * file and write the cache.  No cache is written for a key file
+     * that can't be read.  Returns the number of keys. */
+    int ReadOrQuantize(const VocabTree &tree, unsigned int tree_checksum,
+                       const char *keyfile);
+
+    /* Select the words of the keys with scale at least min_scale, up
+     * to max_keys of them (0 for no limit), in key file order, as
+     * ReadAndFilterKeys does.  Optionally, the index of each selected
+     * key in the key file is stored in keys.  Returns the number of
+     * words selected. */
+    int Select(double min_scale, int max_keys,
+               std::vector<unsigned long> &words,
+               std::vector<unsigned int> *keys = NULL) const;
+
+    int GetNumKeys() const { return (int) m_words.size(); }
+
+    std::vector<unsigned int> m_words;  /* Word of each key */
+    std::vector<float> m_scales;        /* Keypoint scale of each key */
+    std::vector<unsigned int> m_dists;  /* Squared distances (optional) */
+};
+
+#endif /* __VOCAB_WORD_CACHE_H__ */
@@ -43,13 +43,19 @@
 #include <string.h>
 #include <time.h>
 
+#include <vector>
+
 #include <fcntl.h>
-//#include <unistd.h>
-//#include <sys/mman.h>
 #include <sys/stat.h>
 
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
 #include <zlib.h>
 
+#include "defines.h"
 #include "keys2.h"
 
 int GetNumberOfKeysNormal(FILE *fp)
@@ -79,12 +85,24 @@ int GetNumberOfKeysGzip(gzFile fp)
     return num;
 }
 
+static int GetNumberOfKeysBinary(FILE *fp)
+{
+    key_file_header_t h;
+
+    if (fread(&h, sizeof(key_file_header_t), 1, fp) != 1) {
+	printf("Invalid keypoint file.\n");
+	return 0;
+    }
+
+    return (int) h.num_keys;
+}
+
 /* Returns the number of keys in a file */
 int GetNumberOfKeys(const char *filename)
 {
     FILE *file;
 
-    file = fopen (filename, "r");
+    file = fopen (filename, "rb");
     if (! file) {
         /* Try to file a gzipped keyfile */
         char buf[1024];
@@ -101,7 +119,8 @@ int GetNumberOfKeys(const char *filename)
         }
     }
     
-    int n = GetNumberOfKeysNormal(file);
+    int n = IsBinaryKeyFile(file) ? 
+        GetNumberOfKeysBinary(file) : GetNumberOfKeysNormal(file);
     fclose(file);
     return n;
 }
@@ -112,7 +131,11 @@ int ReadKeyFile(const char *filename, short int **keys, keypt_t **info)
 {
     FILE *file;
 
-    file = fopen (filename, "r");
+    *keys = NULL;
+    if (info != NULL)
+        *info = NULL;
+
+    file = fopen (filename, "rb");
     if (! file) {
         /* Try to file a gzipped keyfile */
         char buf[1024];
@@ -129,80 +152,292 @@ int ReadKeyFile(const char *filename, short int **keys, keypt_t **info)
         }
     }
     
+    if (IsBinaryKeyFile(file)) {
+        /* Widen the stored bytes */
+        unsigned char *bytes;
+        int n = ReadKeysBinary(file, &bytes, info);
+        fclose(file);
+
+        if (bytes != NULL) {
+            *keys = new short int[n * 128];
+            for (int i = 0; i < n * 128; i++)
+                (*keys)[i] = bytes[i];
+
+            delete [] bytes;
+        }
+
+        return n;
+    }
+
     int n = ReadKeys(file, keys, info);
     fclose(file);
     return n;
-
-    // return ReadKeysMMAP(file);
 }
 
-#if 0
-/* Read keys using MMAP to speed things up */
-std::vector<Keypoint *> ReadKeysMMAP(FILE *fp) 
-{    
-    int i, j, num, len, val, n;
+int ReadKeyFile(const char *filename, unsigned char **keys, keypt_t **info)
+{
+    FILE *file;
 
-    std::vector<Keypoint *> kps;
+    *keys = NULL;
+    if (info != NULL)
+        *info = NULL;
 
-    struct stat sb;
+    file = fopen (filename, "rb");
+    if (! file) {
+        /* Try to file a gzipped keyfile */
+        char buf[1024];
+        sprintf(buf, "%s.gz", filename);
+        gzFile gzf = gzopen(buf, "rb");
 
-    /* Stat the file */
-    if (fstat(fileno(fp), &sb) < 0) {
-	printf("[ReadKeysMMAP] Error: could not stat file\n");
-	return kps;
+        if (gzf == NULL) {
+            printf("Could not open file: %s\n", filename);
+            return 0;
+        } else {
+            int n = ReadKeysGzip(gzf, keys, info);
+            gzclose(gzf);
+            return n;
+        }
     }
+    
+    int n = IsBinaryKeyFile(file) ? 
+        ReadKeysBinary(file, keys, info) : ReadKeysMMAP(file, keys, info);
+    fclose(file);
+    return n;
+}
 
-    char *file = (char *)mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, 
-			      fileno(fp), 0);
+/* The key readers below share one hand-written parser.  The text
+ * comes either from a block buffer, refilled from a FILE or gzFile
+ * KEY_READ_BLOCK_SIZE bytes at a time, or from a whole mapped file;
+ * values are decoded in place, with no allocation per key. */
+#define KEY_READ_BLOCK_SIZE (1 << 20)
 
-    char *file_start = file;
+typedef struct {
+    const char *p, *end;    /* Unparsed text in the current block */
+    FILE *fp;               /* Source of the blocks (or gz) */
+    gzFile gz;
+    char *block;            /* Block buffer (NULL for a mapped file) */
+} key_reader_t;
 
-    if (sscanf(file, "%d %d%n", &num, &len, &n) != 2) {
-	printf("[ReadKeysMMAP] Invalid keypoint file beginning.");
-	return kps;
+static void key_reader_init(key_reader_t &r, FILE *fp, gzFile gz)
+{
+    r.fp = fp;
+    r.gz = gz;
+    r.block = new char[KEY_READ_BLOCK_SIZE];
+    r.p = r.end = r.block;
+}
+
+static void key_reader_init(key_reader_t &r, const char *text, size_t size)
+{
+    r.fp = NULL;
+    r.gz = NULL;
+    r.block = NULL;
+    r.p = text;
+    r.end = text + size;
+}
+
+static void key_reader_free(key_reader_t &r)
+{
+    delete [] r.block;
+    r.block = NULL;
+}
+
+/* Read the next block; returns false at the end of the input */
+static bool key_reader_fill(key_reader_t &r)
+{
+    if (r.block == NULL)
+        return false;
+
+    int n;
+    if (r.gz != NULL)
+        n = gzread(r.gz, r.block, KEY_READ_BLOCK_SIZE);
+    else
+        n = (int) fread(r.block, 1, KEY_READ_BLOCK_SIZE, r.fp);
+
+    if (n <= 0)
+        return false;
+
+    r.p = r.block;
+    r.end = r.block + n;
+
+    return true;
+}
+
+/* The next character, or -1 at the end of the input */
+static inline int key_reader_peek(key_reader_t &r)
+{
+    if (r.p == r.end && !key_reader_fill(r))
+        return -1;
+
+    return (unsigned char) *r.p;
+}
+
+static inline int key_reader_skip_space(key_reader_t &r)
+{
+    int c;
+    while ((c = key_reader_peek(r)) == ' ' || c == '\n' || 
+           c == '\r' || c == '\t')
+        r.p++;
+
+    return c;
+}
+
+/* Read an unsigned decimal integer.  Values too large for an int
+ * are clamped to 1000000000. */
+static inline bool key_reader_uint(key_reader_t &r, int &v)
+{
+    int c = key_reader_skip_space(r);
+    if (c < '0' || c > '9')
+        return false;
+
+    int x = 0;
+    do {
+        if (x < 100000000)
+            x = x * 10 + (c - '0');
+        else
+            x = 1000000000;
+
+        r.p++;
+        c = key_reader_peek(r);
+    } while (c >= '0' && c <= '9');
+
+    v = x;
+    return true;
+}
+
+/* Read a floating point number */
+static bool key_reader_float(key_reader_t &r, float &v)
+{
+    char buf[64];
+    int len = 0;
+
+    int c = key_reader_skip_space(r);
+    while (len < 63 && 
+           ((c >= '0' && c <= '9') || c == '-' || c == '+' || 
+            c == '.' || c == 'e' || c == 'E')) {
+        buf[len++] = (char) c;
+        r.p++;
+        c = key_reader_peek(r);
     }
 
-    file += n;
+    buf[len] = 0;
+
+    char *end;
+    v = strtof(buf, &end);
+
+    return len > 0 && *end == 0;
+}
+
+/* Parse a key file: the number of keys and the descriptor length,
+ * then for each key its row, column, scale and orientation, followed
+ * by the 128 descriptor values in [0,255] */
+template <class T>
+static int parse_keys(key_reader_t &r, T **keys, keypt_t **info,
+                      const char *caller)
+{
+    int num, len;
+    
+    *keys = NULL;
+    if (info != NULL)
+        *info = NULL;
+
+    if (!key_reader_uint(r, num) || !key_reader_uint(r, len)) {
+        printf("[%s] Invalid keypoint file\n", caller);
+        return 0;
+    }
 
     if (len != 128) {
-	printf("[ReadKeysMMAP] Keypoint descriptor length invalid "
-	       "(should be 128).");
-	return kps;
+        printf("[%s] Keypoint descriptor length invalid "
+               "(should be 128)\n", caller);
+        return 0;
     }
 
-    for (i = 0; i < num; i++) {
-	/* Allocate memory for the keypoint. */
-	unsigned char *d = new unsigned char[len];
-	float x, y, scale, ori;
+    *keys = new T[128 * num];
 
-	if (sscanf(file, "%f %f %f %f%n", &y, &x, &scale, &ori, &n) != 4) {
-	    printf("[ReadKeysMMAP] Invalid keypoint file format.");
-	    return kps;
-	}
+    if (info != NULL) 
+        *info = new keypt_t[num];
 
-	file += n;
+    T *p = *keys;
+    for (int i = 0; i < num; i++) {
+        float x, y, scale, ori;
 
-	for (j = 0; j < len; j++) {
-	    if (sscanf(file, "%d%n", &val, &n) != 1 || val < 0 || val > 255) {
-		printf("[ReadKeysMMAP] Invalid keypoint file value.");
-		return kps;
-	    }
-	    d[j] = (unsigned char) val;
-	    file += n;
-	}
+        if (!key_reader_float(r, y) || !key_reader_float(r, x) ||
+            !key_reader_float(r, scale) || !key_reader_float(r, ori)) {
+            printf("[%s] Invalid keypoint file format (key %d)\n", 
+                   caller, i);
+            goto fail;
+        }
+
+        if (info != NULL) {
+            (*info)[i].x = x;
+            (*info)[i].y = y;
+            (*info)[i].scale = scale;
+            (*info)[i].orient = ori;
+        }
+
+        for (int j = 0; j < 128; j++) {
+            int v;
+            if (!key_reader_uint(r, v) || v > 255) {
+                printf("[%s] Invalid keypoint file value (key %d)\n",
+                       caller, i);
+                goto fail;
+            }
 
-	kps.push_back(new Keypoint(x, y, scale, ori, d));
+            p[j] = (T) v;
+        }
+
+        p += 128;
     }
 
-    /* Unmap */
-    if (munmap(file_start, sb.st_size) < 0) {
-	printf("[ReadKeysMMAP] Error: could not unmap memory\n");
-	return kps;
+    return num;
+
+ fail:
+    delete [] *keys;
+    *keys = NULL;
+
+    if (info != NULL) {
+        delete [] *info;
+        *info = NULL;
     }
 
-    return kps;    
+    return 0;
 }
+
+/* Read keys by mapping the file into memory */
+int ReadKeysMMAP(FILE *fp, unsigned char **keys, keypt_t **info)
+{
+#ifndef WIN32
+    struct stat sb;
+
+    /* Stat the file */
+    if (fstat(fileno(fp), &sb) < 0) {
+	printf("[ReadKeysMMAP] Error: could not stat file\n");
+	return 0;
+    }
+
+    size_t size = (size_t) sb.st_size;
+    void *addr = (size == 0) ? MAP_FAILED :
+        mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+
+    if (addr == MAP_FAILED) {
+        /* Not mappable (e.g., a pipe); read it instead */
+        return ReadKeys(fp, keys, info);
+    }
+
+    madvise(addr, size, MADV_SEQUENTIAL);
+
+    key_reader_t r;
+    key_reader_init(r, (const char *) addr, size);
+    int num = parse_keys(r, keys, info, "ReadKeysMMAP");
+
+    /* Unmap */
+    if (munmap(addr, size) < 0)
+	printf("[ReadKeysMMAP] Error: could not unmap memory\n");
+
+    return num;
+#else
+    return ReadKeys(fp, keys, info);
 #endif
+}
 
 /* Read keypoints from the given file pointer and return the list of
  * keypoints.  The file format starts with 2 integers giving the total
@@ -214,71 +449,167 @@ std::vector<Keypoint *> ReadKeysMMAP(FILE *fp)
  * list of integers in range [0,255]. */
 int ReadKeys(FILE *fp, short int **keys, keypt_t **info)
 {
-    int i, num, len;
+    key_reader_t r;
+    key_reader_init(r, fp, NULL);
+    int num = parse_keys(r, keys, info, "ReadKeys");
+    key_reader_free(r);
 
-    std::vector<Keypoint *> kps;
+    return num;
+}
 
-    if (fscanf(fp, "%d %d", &num, &len) != 2) {
-	printf("Invalid keypoint file\n");
-	return 0;
+int ReadKeys(FILE *fp, unsigned char **keys, keypt_t **info)
+{
+    key_reader_t r;
+    key_reader_init(r, fp, NULL);
+    int num = parse_keys(r, keys, info, "ReadKeys");
+    key_reader_free(r);
+
+    return num;
+}
+
+bool IsBinaryKeyFile(FILE *fp)
+{
+    char magic[4];
+    bool binary = (fread(magic, 1, 4, fp) == 4 && 
+                   memcmp(magic, KEY_FILE_MAGIC, 4) == 0);
+
+    rewind(fp);
+    return binary;
+}
+
+/* Inflate the chunks of a compressed binary key file.  The
+ * compressed data is read with one read, and the chunks are
+ * inflated in parallel straight into keys and info (which may be
+ * NULL, in which case the keypt_t are skipped). */
+static bool ReadKeyChunks(FILE *fp, const key_file_header_t &h,
+                          unsigned char *keys, keypt_t *info)
+{
+    if (h.chunk_keys == 0)
+        return false;
+
+    int num_keys = (int) h.num_keys;
+    int chunk_keys = (int) h.chunk_keys;
+    int num_chunks = (num_keys + chunk_keys - 1) / chunk_keys;
+
+    std::vector<key_file_chunk_t> chunks(num_chunks);
+    if (fseek(fp, (long) h.info_offset, SEEK_SET) != 0 ||
+        fread(&chunks[0], sizeof(key_file_chunk_t), num_chunks, fp) != 
+            (size_t) num_chunks) {
+        return false;
     }
 
-    if (len != 128) {
-	printf("Keypoint descriptor length invalid (should be 128).");
-	return 0;
+    unsigned long long start = chunks[0].offset, end = 0;
+    for (int c = 0; c < num_chunks; c++) {
+        unsigned long long chunk_end = chunks[c].offset + 
+            chunks[c].info_size + chunks[c].desc_size;
+
+        if (chunks[c].offset < start)
+            start = chunks[c].offset;
+        if (chunk_end > end)
+            end = chunk_end;
     }
 
-    *keys = new short int[128 * num];
+    std::vector<unsigned char> data(end - start);
+    if (fseek(fp, (long) start, SEEK_SET) != 0 ||
+        fread(&data[0], 1, end - start, fp) != end - start) {
+        return false;
+    }
 
-    if (info != NULL) 
+    int failed = 0;
+
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:failed)
+    for (int c = 0; c < num_chunks; c++) {
+        int first = c * chunk_keys;
+        int n = MIN(chunk_keys, num_keys - first);
+        const unsigned char *src = &data[0] + (chunks[c].offset - start);
+
+        if (info != NULL) {
+            uLongf len = n * sizeof(keypt_t);
+            if (uncompress((Bytef *) (info + first), &len, 
+                           src, chunks[c].info_size) != Z_OK ||
+                len != n * sizeof(keypt_t)) {
+                failed++;
+            }
+        }
+
+        uLongf len = (uLongf) n * h.dim;
+        if (uncompress(keys + (size_t) first * h.dim, &len, 
+                       src + chunks[c].info_size, 
+                       chunks[c].desc_size) != Z_OK ||
+            len != (uLongf) n * h.dim) {
+            failed++;
+        }
+    }
+
+    return failed == 0;
+}
+
+int ReadKeysBinary(FILE *fp, unsigned char **keys, keypt_t **info)
+{
+    key_file_header_t h;
+
+    *keys = NULL;
+    if (info != NULL)
+        *info = NULL;
+
+    if (fread(&h, sizeof(key_file_header_t), 1, fp) != 1 ||
+        memcmp(h.magic, KEY_FILE_MAGIC, 4) != 0) {
+        printf("[ReadKeysBinary] Error: not a binary key file\n");
+        return 0;
+    }
+
+    if (h.version != KEY_FILE_VERSION || h.dim != 128) {
+        printf("[ReadKeysBinary] Error: unsupported version %u or "
+               "descriptor length %u\n", h.version, h.dim);
+        return 0;
+    }
+
+    int num = (int) h.num_keys;
+    if (num <= 0)
+        return 0;
+
+    size_t desc_size = (size_t) num * h.dim;
+    *keys = new unsigned char[desc_size];
+    if (info != NULL)
         *info = new keypt_t[num];
 
-    short int *p = *keys;
-    for (i = 0; i < num; i++) {
-	/* Allocate memory for the keypoint. */
-	// short int *d = new short int[128];
-	float x, y, scale, ori;
+    bool ok;
+    if (h.flags & KEY_FILE_COMPRESSED) {
+        ok = ReadKeyChunks(fp, h, *keys, (info != NULL) ? *info : NULL);
+    } else {
+        ok = true;
+        if (info != NULL) {
+            ok = fseek(fp, (long) h.info_offset, SEEK_SET) == 0 &&
+                fread(*info, sizeof(keypt_t), num, fp) == (size_t) num;
+        }
 
-	if (fscanf(fp, "%f %f %f %f\n", &y, &x, &scale, &ori) != 4) {
-	    printf("Invalid keypoint file format.");
-	    return 0;
-	}
+        ok = ok && fseek(fp, (long) h.desc_offset, SEEK_SET) == 0 &&
+            fread(*keys, 1, desc_size, fp) == desc_size;
+    }
+
+    if (!ok) {
+        printf("[ReadKeysBinary] Error: file is truncated or corrupt\n");
+
+        delete [] *keys;
+        *keys = NULL;
 
         if (info != NULL) {
-            (*info)[i].x = x;
-            (*info)[i].y = y;
-            (*info)[i].scale = scale;
-            (*info)[i].orient = ori;
+            delete [] *info;
+            *info = NULL;
         }
-        
-	char buf[1024];
-	for (int line = 0; line < 7; line++) {
-	    fgets(buf, 1024, fp);
-
-	    if (line < 6) {
-		sscanf(buf, 
-		       "%hu %hu %hu %hu %hu %hu %hu %hu %hu %hu "
-		       "%hu %hu %hu %hu %hu %hu %hu %hu %hu %hu", 
-		       p+0, p+1, p+2, p+3, p+4, p+5, p+6, p+7, p+8, p+9, 
-		       p+10, p+11, p+12, p+13, p+14, 
-		       p+15, p+16, p+17, p+18, p+19);
-
-		p += 20;
-	    } else {
-		sscanf(buf, 
-		       "%hu %hu %hu %hu %hu %hu %hu %hu",
-		       p+0, p+1, p+2, p+3, p+4, p+5, p+6, p+7);
-		p += 8;
-	    }
-	}
+
+        return 0;
     }
 
-    return num; // kps;
+    return num;
 }
 
 int WriteBinaryKeyFile(const char *filename, int num_keys, 
-                       const short int *keys, const keypt_t *info)
+                       const unsigned char *keys, const keypt_t *info,
+                       bool compress)
 {
+    const int dim = 128;
+
     FILE *f = fopen(filename, "wb");
     
     if (f == NULL) {
@@ -288,80 +619,109 @@ int WriteBinaryKeyFile(const char *filename, int num_keys,
         return 0;
     }
 
-    fwrite(&num_keys, sizeof(int), 1, f);
-    fwrite(info, sizeof(keypt_t), num_keys, f);
-    fwrite(keys, sizeof(short int), num_keys * 128, f);
-
-    fclose(f);
-
-    return num_keys;
-}
+    key_file_header_t h;
+    memset(&h, 0, sizeof(key_file_header_t));
+    memcpy(h.magic, KEY_FILE_MAGIC, 4);
+    h.version = KEY_FILE_VERSION;
+    h.num_keys = num_keys;
+    h.dim = dim;
+    h.info_offset = sizeof(key_file_header_t);
+
+    if (!compress) {
+        h.desc_offset = h.info_offset + (size_t) num_keys * sizeof(keypt_t);
+
+        fwrite(&h, sizeof(key_file_header_t), 1, f);
+        fwrite(info, sizeof(keypt_t), num_keys, f);
+        fwrite(keys, 1, (size_t) num_keys * dim, f);
+    } else {
+        h.flags = KEY_FILE_COMPRESSED;
+        h.chunk_keys = KEY_FILE_CHUNK_KEYS;
+
+        int num_chunks = 
+            (num_keys + KEY_FILE_CHUNK_KEYS - 1) / KEY_FILE_CHUNK_KEYS;
+        std::vector<key_file_chunk_t> chunks(num_chunks);
+        std::vector<std::vector<unsigned char> > data(num_chunks);
+
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int c = 0; c < num_chunks; c++) {
+            int first = c * KEY_FILE_CHUNK_KEYS;
+            int n = MIN(KEY_FILE_CHUNK_KEYS, num_keys - first);
+            uLong info_size = n * sizeof(keypt_t);
+            uLong desc_size = (uLong) n * dim;
+
+            data[c].resize(compressBound(info_size) + 
+                           compressBound(desc_size));
+
+            uLongf info_len = compressBound(info_size);
+            compress2(&data[c][0], &info_len, 
+                      (const Bytef *) (info + first), info_size, 
+                      Z_DEFAULT_COMPRESSION);
+
+            uLongf desc_len = compressBound(desc_size);
+            compress2(&data[c][0] + info_len, &desc_len, 
+                      keys + (size_t) first * dim, desc_size, 
+                      Z_DEFAULT_COMPRESSION);
+
+            chunks[c].info_size = info_len;
+            chunks[c].desc_size = desc_len;
+        }
 
-int ReadKeysGzip(gzFile fp, short int **keys, keypt_t **info)
-{
-    int i, num, len;
+        unsigned long long offset = h.info_offset + 
+            num_chunks * sizeof(key_file_chunk_t);
+        for (int c = 0; c < num_chunks; c++) {
+            chunks[c].offset = offset;
+            offset += chunks[c].info_size + chunks[c].desc_size;
+        }
 
-    std::vector<Keypoint *> kps;
-    char header[256];
-    gzgets(fp, header, 256);
+        fwrite(&h, sizeof(key_file_header_t), 1, f);
+        if (num_chunks > 0)
+            fwrite(&chunks[0], sizeof(key_file_chunk_t), num_chunks, f);
 
-    if (sscanf(header, "%d %d", &num, &len) != 2) {
-	printf("Invalid keypoint file.\n");
-	return 0;
+        for (int c = 0; c < num_chunks; c++) {
+            fwrite(&data[c][0], 1, 
+                   chunks[c].info_size + chunks[c].desc_size, f);
+        }
     }
 
-    if (len != 128) {
-	printf("Keypoint descriptor length invalid (should be 128).");
-	return 0;
+    if (ferror(f) != 0 || fclose(f) != 0) {
+        printf("[WriteBinaryKeyFile] Error writing file %s\n", filename);
+        return 0;
     }
 
-    *keys = new short int[128 * num];
+    return num_keys;
+}
 
-    if (info != NULL) 
-        *info = new keypt_t[num];
+int WriteBinaryKeyFile(const char *filename, int num_keys, 
+                       const short int *keys, const keypt_t *info,
+                       bool compress)
+{
+    std::vector<unsigned char> bytes((size_t) num_keys * 128);
+    for (size_t i = 0; i < bytes.size(); i++)
+        bytes[i] = (unsigned char) keys[i];
 
-    short int *p = *keys;
-    for (i = 0; i < num; i++) {
-	/* Allocate memory for the keypoint. */
-	// short int *d = new short int[128];
-	float x, y, scale, ori;
-        char buf[1024];
-        gzgets(fp, buf, 1024);
+    return WriteBinaryKeyFile(filename, num_keys, 
+                              bytes.empty() ? NULL : &bytes[0], info, 
+                              compress);
+}
 
-	if (sscanf(buf, "%f %f %f %f\n", &y, &x, &scale, &ori) != 4) {
-	    printf("Invalid keypoint file format.");
-	    return 0;
-	}
+int ReadKeysGzip(gzFile fp, short int **keys, keypt_t **info)
+{
+    key_reader_t r;
+    key_reader_init(r, NULL, fp);
+    int num = parse_keys(r, keys, info, "ReadKeysGzip");
+    key_reader_free(r);
 
-        if (info != NULL) {
-            (*info)[i].x = x;
-            (*info)[i].y = y;
-            (*info)[i].scale = scale;
-            (*info)[i].orient = ori;
-        }
-        
-	for (int line = 0; line < 7; line++) {
-	    gzgets(fp, buf, 1024);
-
-	    if (line < 6) {
-		sscanf(buf, 
-		       "%hu %hu %hu %hu %hu %hu %hu %hu %hu %hu "
-		       "%hu %hu %hu %hu %hu %hu %hu %hu %hu %hu", 
-		       p+0, p+1, p+2, p+3, p+4, p+5, p+6, p+7, p+8, p+9, 
-		       p+10, p+11, p+12, p+13, p+14, 
-		       p+15, p+16, p+17, p+18, p+19);
-
-		p += 20;
-	    } else {
-		sscanf(buf, 
-		       "%hu %hu %hu %hu %hu %hu %hu %hu",
-		       p+0, p+1, p+2, p+3, p+4, p+5, p+6, p+7);
-		p += 8;
-	    }
-	}
-    }
+    return num;
+}
 
-    return num; // kps;
+int ReadKeysGzip(gzFile fp, unsigned char **keys, keypt_t **info)
+{
+    key_reader_t r;
+    key_reader_init(r, NULL, fp);
+    int num = parse_keys(r, keys, info, "ReadKeysGzip");
+    key_reader_free(r);
+
+    return num;
 }
 
 std::vector<KeypointMatch> 
@@ -53,6 +53,39 @@ typedef struct {
     float orient;
 } keypt_t;
 
+/* Layout of a binary key file: this header, then the keypt_t of
+ * every key, then the 8-bit descriptors (dim bytes per key), at the
+ * given offsets.  If KEY_FILE_COMPRESSED is set, info_offset instead
+ * points to a table of key_file_chunk_t, one per chunk_keys keys;
+ * each chunk holds the zlib-compressed keypt_t of its keys followed
+ * by their compressed descriptors.  Numbers are in native byte
+ * order. */
+#define KEY_FILE_MAGIC "VTKF"
+#define KEY_FILE_VERSION 1
+
+#define KEY_FILE_COMPRESSED 0x1
+
+/* Number of keys per compressed chunk written by WriteBinaryKeyFile */
+#define KEY_FILE_CHUNK_KEYS 4096
+
+typedef struct {
+    char magic[4];                  /* KEY_FILE_MAGIC */
+    unsigned int version;           /* KEY_FILE_VERSION */
+    unsigned int num_keys;
+    unsigned int dim;               /* Bytes per descriptor */
+    unsigned int flags;             /* KEY_FILE_COMPRESSED */
+    unsigned int chunk_keys;        /* Keys per chunk, if compressed */
+    unsigned long long info_offset; /* keypt_t block, or chunk table */
+    unsigned long long desc_offset; /* Descriptor block */
+    char pad[24];
+} key_file_header_t;
+
+typedef struct {
+    unsigned long long offset;      /* Offset of the compressed keypt_t */
+    unsigned int info_size;         /* Compressed sizes in bytes; the */
+    unsigned int desc_size;         /* descriptors follow the keypt_t */
+} key_file_chunk_t;
+
 /* Returns the number of keys in a file */
 int GetNumberOfKeys(const char *filename);
 
@@ -61,6 +94,11 @@ int GetNumberOfKeys(const char *filename);
 int ReadKeyFile(const char *filename, short int **keys, 
                 keypt_t **info = NULL);
 
+/* As above, decoding the descriptors straight into bytes.  Plain key
+ * files are mapped into memory (see ReadKeysMMAP). */
+int ReadKeyFile(const char *filename, unsigned char **keys, 
+                keypt_t **info = NULL);
+
 int ReadKeyPositions(const char *filename, keypt_t **info);
 
 /* Read keypoints from the given file pointer and return the list of
@@ -70,15 +108,38 @@ int ReadKeyPositions(const char *filename, keypt_t **info);
  * specified by 4 floating point numbers giving subpixel row and
  * column location, scale, and orientation (in radians from -PI to
  * PI).  Then the descriptor vector for each keypoint is given as a
- * list of integers in range [0,255]. */
+ * list of integers in range [0,255].  The text is read in large
+ * blocks and parsed in place; on a malformed file 0 is returned and
+ * *keys is set to NULL. */
 int ReadKeys(FILE *fp, short int **keys, keypt_t **info = NULL);
 int ReadKeysGzip(gzFile fp, short int **keys, keypt_t **info = NULL);
-
-/* Read keys using MMAP to speed things up */
-std::vector<Keypoint *> ReadKeysMMAP(FILE *fp);
-
+int ReadKeys(FILE *fp, unsigned char **keys, keypt_t **info = NULL);
+int ReadKeysGzip(gzFile fp, unsigned char **keys, keypt_t **info = NULL);
+
+/* Read keys using MMAP to speed things up (falls back to ReadKeys if
+ * the file cannot be mapped) */
+int ReadKeysMMAP(FILE *fp, unsigned char **keys, keypt_t **info = NULL);
+
+/* Read a binary key file (see key_file_header_t) from the given file
+ * pointer, positioned at its start.  An uncompressed file is read
+ * straight into the output arrays, one read per block; chunks of a
+ * compressed file are inflated in parallel. */
+int ReadKeysBinary(FILE *fp, unsigned char **keys, keypt_t **info = NULL);
+
+/* Is fp (positioned at its start) a binary key file?  fp is left at
+ * the start. */
+bool IsBinaryKeyFile(FILE *fp);
+
+/* Write keys in the binary format, optionally compressed.  ReadKeyFile
+ * and GetNumberOfKeys recognize these files by their header, whatever
+ * they are named.  Returns the number of keys written, or 0 on
+ * error. */
+int WriteBinaryKeyFile(const char *filename, int num_keys, 
+                       const unsigned char *keys, const keypt_t *info,
+                       bool compress = false);
 int WriteBinaryKeyFile(const char *filename, int num_keys, 
-                       const short int *keys, const keypt_t *info);
+                       const short int *keys, const keypt_t *info,
+                       bool compress = false);
 
 #ifndef __SIFT_READER__
 /* Create a search tree for the given set of keypoints */
@@ -41,12 +41,24 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <sys/time.h>
+#include <limits.h>
 
+#include <new>
+#include <set>
+#include <vector>
+
+#include <omp.h>
+
+#include "../lib/ann_1.1_char/include/ANN/ANN.h"
+#include "defines.h"
+#include "kmeans.h"
+#include "kmeans_hamerly.h"
 #include "kmeans_kd.h"
 
+using namespace ann_1_1_char;
+
 /* Choose k numbers at random from 0 to n-1 */
-static void choose(int n, int k, int *arr)
+static void choose(int n, int k, int *arr, unsigned int *seed)
 {
     int i;
     
@@ -55,19 +67,15 @@ static void choose(int n, int k, int *arr)
         return;
     }
 
+    /* Redraw on collisions, keeping the draws in a set so each check
+     * is logarithmic in k */
+    std::set<int> chosen;
+
     for (i = 0; i < k; i++) {
         while (1) {
-            int idx = rand() % n;
-            int j, redo = 0;
-
-            for (j = 0; j < i; j++) {
-                if (idx == arr[j]) {
-                    redo = 1;
-                    break;
-                }
-            }
+            int idx = (seed != NULL ? rand_r(seed) : rand()) % n;
 
-            if (!redo) {
+            if (chosen.insert(idx).second) {
                 arr[i] = idx;
                 break;
             }
@@ -75,8 +83,402 @@ static void choose(int n, int k, int *arr)
     }
 }
 
+/* Points are processed in blocks of this size during seeding; the
+ * weighted distance sum of each block is kept for sampling */
+#define SEED_BLOCK_SIZE 4096
+
+/* Uniform random number in [0, 1) */
+static double rand_unit(unsigned int *seed)
+{
+    int r = (seed != NULL) ? rand_r(seed) : rand();
+    return r / ((double) RAND_MAX + 1.0);
+}
+
+/* Hash (key, i) to a uniform number in [0, 1).  k-means|| samples
+ * every point independently; hashing the point index rather than
+ * drawing from a shared generator keeps that parallel and
+ * reproducible. */
+static double hash_unit(unsigned long long key, unsigned long long i)
+{
+    unsigned long long z = key + (i + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Sum the weighted distances of each block into block_sum, and return
+ * the total.  Distances are integers, so the sums are exact. */
+static unsigned long long sum_min_dist(int n, const unsigned int *weight,
+                                       const unsigned int *mind,
+                                       unsigned long long *block_sum)
+{
+    int num_blocks = (n + SEED_BLOCK_SIZE - 1) / SEED_BLOCK_SIZE;
+
+#pragma omp parallel for
+    for (int b = 0; b < num_blocks; b++) {
+        int end = MIN(n, (b + 1) * SEED_BLOCK_SIZE);
+        unsigned long long sum = 0;
+
+        for (int i = b * SEED_BLOCK_SIZE; i < end; i++) 
+            sum += (unsigned long long) mind[i] * 
+                (weight != NULL ? weight[i] : 1);
+
+        block_sum[b] = sum;
+    }
+
+    unsigned long long total = 0;
+    for (int b = 0; b < num_blocks; b++)
+        total += block_sum[b];
+
+    return total;
+}
+
+/* Lower mind[i] to the distance from point i to center c */
+static void update_min_dist(int n, int dim, const unsigned char *data,
+                            const unsigned int *idx, const unsigned char *c,
+                            unsigned int *mind)
+{
+#pragma omp parallel for schedule(static, SEED_BLOCK_SIZE)
+    for (int i = 0; i < n; i++) {
+        unsigned int d = (unsigned int) 
+            annDistSq(dim, kmeans_point(data, idx, dim, i), c);
+        if (d < mind[i])
+            mind[i] = d;
+    }
+}
+
+/* Lower mind[i] to the distance from point i to the nearest of the
+ * num_centers points indexed by centers.  If nearest is non-NULL, it
+ * receives the position in centers of that nearest point. */
+static void update_min_dist_tree(int n, int dim, const unsigned char *data,
+                                 const unsigned int *idx,
+                                 const int *centers, int num_centers,
+                                 unsigned int *mind, int *nearest)
+{
+    ANNpointArray pts = new ANNpoint[num_centers];
+    for (int j = 0; j < num_centers; j++)
+        pts[j] = (ANNpoint) kmeans_point(data, idx, dim, centers[j]);
+
+    ANNkd_tree *tree = new ANNkd_tree(pts, num_centers, dim, 4);
+
+#pragma omp parallel for schedule(dynamic, SEED_BLOCK_SIZE)
+    for (int i = 0; i < n; i++) {
+        int nn;
+        ANNdist d;
+        tree->annkPriSearch((ANNpoint) kmeans_point(data, idx, dim, i), 
+                            1, &nn, &d, 0.0);
+
+        if ((unsigned int) d < mind[i])
+            mind[i] = (unsigned int) d;
+        if (nearest != NULL)
+            nearest[i] = nn;
+    }
+
+    delete tree;
+    delete [] pts;
+}
+
+/* Draw a point with probability proportional to weight[i] * mind[i] */
+static int sample_min_dist(int n, const unsigned int *weight,
+                           const unsigned int *mind, 
+                           const unsigned long long *block_sum,
+                           unsigned long long total, unsigned int *seed)
+{
+    unsigned long long target = 
+        (unsigned long long) (rand_unit(seed) * total);
+
+    if (target >= total)
+        target = total - 1;
+
+    /* Find the block, then the point */
+    int b = 0;
+    while (target >= block_sum[b]) {
+        target -= block_sum[b];
+        b++;
+    }
+
+    int end = MIN(n, (b + 1) * SEED_BLOCK_SIZE);
+    int i;
+    for (i = b * SEED_BLOCK_SIZE; i < end - 1; i++) {
+        unsigned long long w = (unsigned long long) mind[i] * 
+            (weight != NULL ? weight[i] : 1);
+
+        if (target < w)
+            break;
+        target -= w;
+    }
+
+    return i;
+}
+
+/* k-means++ seeding.  The first num_chosen entries of arr are already
+ * chosen and accounted for in mind; the rest of the k are drawn with
+ * probability proportional to (weighted) squared distance to the
+ * nearest chosen point. */
+static void choose_plus_plus(int n, int dim, int k, 
+                             const unsigned char *data, 
+                             const unsigned int *idx,
+                             const unsigned int *weight, int num_chosen,
+                             int *arr, unsigned int *mind, 
+                             unsigned int *seed)
+{
+    int num_blocks = (n + SEED_BLOCK_SIZE - 1) / SEED_BLOCK_SIZE;
+    unsigned long long *block_sum = new unsigned long long[num_blocks];
+
+    for (int j = num_chosen; j < k; j++) {
+        unsigned long long total = sum_min_dist(n, weight, mind, block_sum);
+
+        if (total == 0) {
+            /* Every point coincides with a chosen one */
+            arr[j] = (seed != NULL ? rand_r(seed) : rand()) % n;
+        } else {
+            arr[j] = sample_min_dist(n, weight, mind, 
+                                     block_sum, total, seed);
+        }
+
+        update_min_dist(n, dim, data, idx, 
+                        kmeans_point(data, idx, dim, arr[j]), mind);
+    }
+
+    delete [] block_sum;
+}
+
+/* k-means|| seeding (Bahmani et al., "Scalable K-Means++").  A few
+ * rounds each sample about 2k points, independently with probability
+ * proportional to squared distance; the candidates are then weighted
+ * by the number of points nearest to them and reduced to k with
+ * weighted k-means++. */
+static void choose_parallel(int n, int dim, int k, 
+                            const unsigned char *data, 
+                            const unsigned int *idx,
+                            int *arr, unsigned int *seed)
+{
+    const int rounds = 5;
+    const double oversample = 2.0 * k;
+
+    int num_blocks = (n + SEED_BLOCK_SIZE - 1) / SEED_BLOCK_SIZE;
+    unsigned long long *block_sum = new unsigned long long[num_blocks];
+    unsigned int *mind = new unsigned int[n];
+    unsigned char *selected = new unsigned char[n];
+
+    for (int i = 0; i < n; i++)
+        mind[i] = UINT_MAX;
+
+    std::vector<int> cands;
+    cands.push_back((seed != NULL ? rand_r(seed) : rand()) % n);
+    update_min_dist(n, dim, data, idx, 
+                    kmeans_point(data, idx, dim, cands[0]), mind);
+
+    for (int r = 0; r < rounds; r++) {
+        unsigned long long total = sum_min_dist(n, NULL, mind, block_sum);
+        if (total == 0)
+            break;
+
+        unsigned long long hi = 
+            (unsigned long long) (seed != NULL ? rand_r(seed) : rand());
+        unsigned long long lo = 
+            (unsigned long long) (seed != NULL ? rand_r(seed) : rand());
+        unsigned long long key = (hi << 31) ^ lo;
+
+        double scale = oversample / (double) total;
+
+#pragma omp parallel for schedule(static, SEED_BLOCK_SIZE)
+        for (int i = 0; i < n; i++) 
+            selected[i] = (hash_unit(key, i) < scale * mind[i]) ? 1 : 0;
+
+        int num_old = (int) cands.size();
+        for (int i = 0; i < n; i++) {
+            if (selected[i])
+                cands.push_back(i);
+        }
+
+        int num_new = (int) cands.size() - num_old;
+        if (num_new > 0) {
+            update_min_dist_tree(n, dim, data, idx, &cands[num_old], 
+                                 num_new, mind, NULL);
+        }
+    }
+
+    int num_cands = (int) cands.size();
+
+    if (num_cands <= k) {
+        /* Too few candidates; take them all and finish with k-means++
+         * over the full set */
+        for (int j = 0; j < num_cands; j++)
+            arr[j] = cands[j];
+
+        choose_plus_plus(n, dim, k, data, idx, NULL, num_cands, 
+                         arr, mind, seed);
+    } else {
+        /* Weight each candidate by the points nearest to it */
+        int *nearest = new int[n];
+        update_min_dist_tree(n, dim, data, idx, &cands[0], num_cands, 
+                             mind, nearest);
+
+        unsigned int *weight = new unsigned int[num_cands];
+        for (int j = 0; j < num_cands; j++)
+            weight[j] = 0;
+        for (int i = 0; i < n; i++)
+            weight[nearest[i]]++;
+
+        delete [] nearest;
+
+        /* Weighted k-means++ over the candidates */
+        unsigned int *cidx = new unsigned int[num_cands];
+        unsigned int *cmind = new unsigned int[num_cands];
+        int *carr = new int[k];
+
+        for (int j = 0; j < num_cands; j++) {
+            cidx[j] = idx[cands[j]];
+            cmind[j] = UINT_MAX;
+        }
+
+        carr[0] = (seed != NULL ? rand_r(seed) : rand()) % num_cands;
+        update_min_dist(num_cands, dim, data, cidx, 
+                        kmeans_point(data, cidx, dim, carr[0]), cmind);
+        choose_plus_plus(num_cands, dim, k, data, cidx, weight, 1, 
+                         carr, cmind, seed);
+
+        for (int j = 0; j < k; j++)
+            arr[j] = cands[carr[j]];
+
+        delete [] cidx;
+        delete [] cmind;
+        delete [] carr;
+        delete [] weight;
+    }
+
+    delete [] block_sum;
+    delete [] mind;
+    delete [] selected;
+}
+
+/* Choose the k initial means, as positions in idx, with the given
+ * strategy */
+void kmeans_choose_starts(int n, int dim, int k, const unsigned char *data,
+                          const unsigned int *idx,
+                          KMeansInit init, int *arr, unsigned int *seed)
+{
+    switch (init) {
+    case KMeansInitPlusPlus: {
+        unsigned int *mind = new unsigned int[n];
+        for (int i = 0; i < n; i++)
+            mind[i] = UINT_MAX;
+
+        arr[0] = (seed != NULL ? rand_r(seed) : rand()) % n;
+        update_min_dist(n, dim, data, idx, 
+                        kmeans_point(data, idx, dim, arr[0]), mind);
+        choose_plus_plus(n, dim, k, data, idx, NULL, 1, arr, mind, seed);
+
+        delete [] mind;
+        break;
+    }
+    case KMeansInitParallel:
+        choose_parallel(n, dim, k, data, idx, arr, seed);
+        break;
+    case KMeansInitRandom:
+    default:
+        choose(n, k, arr, seed);
+        break;
+    }
+}
+
+/* Partitions smaller than this are done by one thread */
+#define PARTITION_PARALLEL_MIN 65536
+
+int partition_by_cluster(int n, int k, unsigned int *idx, 
+                         unsigned int *clustering)
+{
+    unsigned int *sorted = new (std::nothrow) unsigned int[n];
+
+    if (sorted == NULL) {
+        printf("[partition_by_cluster] Error allocating work array\n");
+        return -1;
+    }
+
+    /* Each block counts, then scatters, its own points; offsets are
+     * assigned cluster-major and block-minor, so the result is the
+     * same stable order for any number of blocks */
+    int num_blocks = 1;
+    if (n >= PARTITION_PARALLEL_MIN && !omp_in_parallel())
+        num_blocks = omp_get_max_threads();
+
+    int block_size = (n + num_blocks - 1) / num_blocks;
+    int *offsets = new int[num_blocks * k];
+
+#pragma omp parallel for if (num_blocks > 1)
+    for (int b = 0; b < num_blocks; b++) {
+        int *count = offsets + b * k;
+        int end = MIN(n, (b + 1) * block_size);
+
+        for (int c = 0; c < k; c++)
+            count[c] = 0;
+
+        for (int j = b * block_size; j < end; j++) 
+            count[clustering[j]]++;
+    }
+
+    int pos = 0;
+    for (int c = 0; c < k; c++) {
+        for (int b = 0; b < num_blocks; b++) {
+            int count = offsets[b * k + c];
+            offsets[b * k + c] = pos;
+            pos += count;
+        }
+    }
+
+#pragma omp parallel for if (num_blocks > 1)
+    for (int b = 0; b < num_blocks; b++) {
+        int *offset = offsets + b * k;
+        int end = MIN(n, (b + 1) * block_size);
+
+        for (int j = b * block_size; j < end; j++) 
+            sorted[offset[clustering[j]]++] = idx[j];
+    }
+
+    memcpy(idx, sorted, sizeof(unsigned int) * n);
+
+    /* The last block's offsets now mark the end of each cluster */
+    int start = 0;
+    for (int c = 0; c < k; c++) {
+        int end = offsets[(num_blocks - 1) * k + c];
+        for (int j = start; j < end; j++)
+            clustering[j] = c;
+        start = end;
+    }
+
+    delete [] offsets;
+    delete [] sorted;
+
+    return 0;
+}
+
+int partition_by_cluster_passes(int n, int k, unsigned int *idx, 
+                                unsigned int *clustering)
+{
+    int pos = 0;
+    for (int i = 0; i < k; i++) {
+        for (int j = 0; j < n; j++) {
+            if ((int) clustering[j] == i) {
+                unsigned int idx_tmp = idx[pos];
+                idx[pos] = idx[j];
+                idx[j] = idx_tmp;
+
+                unsigned int tmp = clustering[pos];
+                clustering[pos] = clustering[j];
+                clustering[j] = tmp;
+
+                pos++;
+            }
+        }
+    }
+
+    return 0;
+}
+
 /* Copy 'dim' elements to array 'vec' from array 'v' */
-static void fill_vector(double *vec, unsigned char *v, int dim)
+static void fill_vector(double *vec, const unsigned char *v, int dim)
 {
     int i;
     for (i = 0; i < dim; i++) 
@@ -84,7 +486,7 @@ static void fill_vector(double *vec, unsigned char *v, int dim)
 }
 
 /* Accumulate array 'v' (of dimension 'dim') into array 'acc' */
-static void vec_accum(int dim, double *acc, unsigned char *v)
+static void vec_accum(int dim, double *acc, const unsigned char *v)
 {
     int i;
     for (i = 0; i < dim; i++) {
@@ -130,7 +532,8 @@ static double vec_normsq(int dim, double *v)
  *   n          : number of input descriptors
  *   dim        : dimension of each input descriptor
  *   k          : number of means
- *   v          : array of pointers to dim-dimensional descriptors
+ *   data, idx  : descriptors, as indices into a contiguous array of
+ *                dim-dimensional descriptors (see kmeans_point)
  *   clustering : current assignment of descriptors to means (should
  *                range between 0 and k-1)
  * 
@@ -139,7 +542,8 @@ static double vec_normsq(int dim, double *v)
  *                array.  The means should be concatenated into one
  *                long array of length k*dim.
  */
-double compute_means(int n, int dim, int k, unsigned char **v, 
+double compute_means(int n, int dim, int k, const unsigned char *data,
+                     const unsigned int *idx, 
                      unsigned int *clustering, double *means_out)
 {
     int i;
@@ -154,7 +558,8 @@ double compute_means(int n, int dim, int k, unsigned char **v,
 
     for (i = 0; i < n; i++) {
         unsigned int cluster = clustering[i];
-        vec_accum(dim, means_out + cluster * dim, v[i]);
+        vec_accum(dim, means_out + cluster * dim, 
+                  kmeans_point(data, idx, dim, i));
 
         counts[cluster]++;
     }
@@ -173,7 +578,8 @@ double compute_means(int n, int dim, int k, unsigned char **v,
     return max_change;
 }
 
-double compute_error(int n, int dim, int k, unsigned char **v,
+double compute_error(int n, int dim, int k, const unsigned char *data,
+                     const unsigned int *idx,
                      double *means, unsigned int *clustering)
 {
     int i, j;
@@ -181,9 +587,10 @@ double compute_error(int n, int dim, int k, unsigned char **v,
     double error = 0;
     for (i = 0; i < n; i++) {
         unsigned int c = clustering[i];
+        const unsigned char *v = kmeans_point(data, idx, dim, i);
         
         for (j = 0; j < dim; j++) {
-            double d = means[c * dim + j] - v[i][j];
+            double d = means[c * dim + j] - v[j];
             error += d * d;
         }
     }
@@ -198,7 +605,8 @@ double compute_error(int n, int dim, int k, unsigned char **v,
  *   n          : number of input descriptors
  *   dim        : dimension of each input descriptor
  *   k          : number of means
- *   v          : array of pointers to dim-dimensional descriptors
+ *   data, idx  : descriptors, as indices into a contiguous array of
+ *                dim-dimensional descriptors (see kmeans_point)
  *   means      : current means, stored in a k*dim dimensional array
  * 
  * Output: 
@@ -208,7 +616,8 @@ double compute_error(int n, int dim, int k, unsigned char **v,
  *   
  * Return value : return the number of points that changed assignment
  */
-int compute_clustering(int n, int dim, int k, unsigned char **v,
+int compute_clustering(int n, int dim, int k, const unsigned char *data,
+                       const unsigned int *idx,
                        double *means, unsigned int *clustering, 
                        double &error_out)
 {
@@ -221,7 +630,7 @@ int compute_clustering(int n, int dim, int k, unsigned char **v,
     double *work = (double *) malloc(sizeof(double) * dim);
 
     for (i = 0; i < n; i++) {
-        fill_vector(vec, v[i], dim);
+        fill_vector(vec, kmeans_point(data, idx, dim, i), dim);
 
         int j;
         double min_dist = DBL_MAX;
@@ -253,6 +662,78 @@ int compute_clustering(int n, int dim, int k, unsigned char **v,
     return changed;
 }
 
+/* Assign the points to their nearest means with the chosen method,
+ * storing the means of the new assignment in means_out.  The error is
+ * only computed by the kd-tree assignment. */
+static int assign_points(KMeansAssign assign, kmeans_hamerly_t &bounds,
+                         kmeans_kd_t *search, int n, int dim, int k,
+                         const unsigned char *data,
+                         const unsigned int *idx, double *means,
+                         unsigned int *clustering, double &error,
+                         double *means_out)
+{
+    if (assign == KMeansAssignHamerly) {
+        return compute_clustering_hamerly(bounds, n, dim, k, data, idx,
+                                          means, clustering, means_out);
+    }
+
+    return compute_clustering_kd_tree(n, dim, k, data, idx, means,
+                                      clustering, error, means_out, search);
+}
+
+/* Write one telemetry record for a round of k-means */
+static void report_round(const KMeansOptions &opts, int run, int round,
+                         int n, int k, int changed, bool have_error, 
+                         double error, double seconds)
+{
+    if (opts.verbose) {
+        printf("Round %d: changed: %d\n", round, changed);
+        printf("Round took %0.3lfs\n", seconds);
+        fflush(stdout);
+    }
+
+    if (opts.telemetry == NULL)
+        return;
+
+    char error_str[64];
+    if (have_error)
+        sprintf(error_str, "%0.17g", error);
+    else
+        strcpy(error_str, "null");
+
+    /* One call per record, so that concurrent runs (e.g., subtrees
+     * built in parallel) do not interleave within a line */
+    fprintf(opts.telemetry, 
+            "{\"event\": \"kmeans_round\", \"level\": %d, \"run\": %d, "
+            "\"round\": %d, \"n\": %d, \"k\": %d, \"changed\": %d, "
+            "\"changed_fraction\": %0.6g, \"error\": %s, "
+            "\"seconds\": %0.6f, \"points_per_sec\": %0.1f}\n",
+            opts.level, run, round, n, k, changed, (double) changed / n, 
+            error_str, seconds, seconds > 0.0 ? n / seconds : 0.0);
+}
+
+/* Write the telemetry record summarizing one run of k-means */
+static void report_run(const KMeansOptions &opts, int run, int rounds,
+                       int n, int k, bool have_error, double error, 
+                       double seconds, const char *stop)
+{
+    if (opts.telemetry == NULL)
+        return;
+
+    char error_str[64];
+    if (have_error)
+        sprintf(error_str, "%0.17g", error);
+    else
+        strcpy(error_str, "null");
+
+    fprintf(opts.telemetry, 
+            "{\"event\": \"kmeans_run\", \"level\": %d, \"run\": %d, "
+            "\"rounds\": %d, \"n\": %d, \"k\": %d, \"error\": %s, "
+            "\"seconds\": %0.6f, \"stop\": \"%s\"}\n",
+            opts.level, run, rounds, n, k, error_str, seconds, stop);
+    fflush(opts.telemetry);
+}
+
 /* Function kmeans.  
  * Run kmeans clustering on a set of input descriptors.
  * 
@@ -261,7 +742,12 @@ int compute_clustering(int n, int dim, int k, unsigned char **v,
  *   dim        : dimension of each input descriptor
  *   k          : number of means to compute
  *   restarts   : number of random restarts to perform
- *   v          : array of pointers to dim-dimensional descriptors
+ *   data, idx  : descriptors, as indices into a contiguous array of
+ *                dim-dimensional descriptors (see kmeans_point)
+ *   seed       : optional seed for rand_r (rand() is used if NULL)
+ *   init       : how to choose the initial means
+ *   assign     : how to assign the points to the means in each round
+ *   options    : stopping rules and telemetry (NULL for the defaults)
  * 
  * Output: 
  *   means      : array of output means.  The means should be
@@ -271,8 +757,11 @@ int compute_clustering(int n, int dim, int k, unsigned char **v,
  *                length n.  clustering[i] contains the
  *                cluster ID for point i
  */
-double kmeans(int n, int dim, int k, int restarts, unsigned char **v, 
-              double *means, unsigned int *clustering)
+double kmeans(int n, int dim, int k, int restarts, 
+              const unsigned char *data, const unsigned int *idx, 
+              double *means, unsigned int *clustering, unsigned int *seed,
+              KMeansInit init, KMeansAssign assign, 
+              const KMeansOptions *options)
 {
     int i;
     double min_error = DBL_MAX;
@@ -281,7 +770,9 @@ double kmeans(int n, int dim, int k, int restarts, unsigned char **v,
     int *starts;
     unsigned int *clustering_curr;
 
-    double changed_pct_threshold = 0.05; // 0.005;
+    const KMeansOptions default_options;
+    const KMeansOptions &opts = 
+        (options != NULL) ? *options : default_options;
 
     if (n <= k) {
         printf("[kmeans] Error: n <= k\n");
@@ -319,64 +810,99 @@ double kmeans(int n, int dim, int k, int restarts, unsigned char **v,
         exit(-1);
     }
 
+    /* The kd-tree assignment computes the error as it goes; with
+     * Hamerly's bounds it costs an extra pass, made only if needed */
+    const bool have_error = 
+        (assign != KMeansAssignHamerly || opts.error_tolerance > 0.0);
+
+    const double call_start = omp_get_wtime();
+
     for (i = 0; i < restarts; i++) {
         int j;
-        double max_change = 0.0;
-        double error = 0.0;
+        double error = 0.0, prev_error = DBL_MAX;
         int round = 0;
+        const char *stop = NULL;
+        double run_start = omp_get_wtime();
 
-        choose(n, k, starts);
+        kmeans_choose_starts(n, dim, k, data, idx, init, starts, seed);
+
+        /* The bounds, or the search tree over the means, are kept
+         * from round to round of one run */
+        kmeans_hamerly_t bounds;
+        kmeans_kd_t *search = NULL;
+        if (assign == KMeansAssignHamerly)
+            kmeans_hamerly_alloc(bounds, n, dim, k);
+        else
+            search = kmeans_kd_alloc(dim, k);
 
         for (j = 0; j < k; j++) {
-            fill_vector(means_curr + j * dim, v[starts[j]], dim);
+            fill_vector(means_curr + j * dim, 
+                        kmeans_point(data, idx, dim, starts[j]), dim);
         }
         
-        /* Compute new assignments */
-        timeval start, stop;
-        gettimeofday(&start, NULL);
-
-        int changed = 0;
-        changed = compute_clustering_kd_tree(n, dim, k, v, means_curr,
-                                             clustering_curr, error);
-
-        double changed_pct = (double) changed / n;
-
-        do {
-            gettimeofday(&stop, NULL);
-
-            long seconds  = stop.tv_sec  - start.tv_sec;
-            long useconds = stop.tv_usec - start.tv_usec;
-            double etime = seconds + useconds * 0.000001;    
-
-            printf("Round %d: changed: %d\n", i, changed);
-            printf("Round took %0.3lfs\n", etime);            
-            fflush(stdout);
-
-            gettimeofday(&start, NULL);
+        while (stop == NULL) {
+            double round_start = omp_get_wtime();
+
+            /* Each pass assigns the points and also computes the
+             * means of the new assignment, so the data is streamed
+             * once per round */
+            int changed = 
+                assign_points(assign, bounds, search, n, dim, k, 
+                              data, idx, means_curr, clustering_curr, 
+                              error, means_new);
+
+            if (assign == KMeansAssignHamerly && have_error) {
+                error = compute_error(n, dim, k, data, idx, 
+                                      means_curr, clustering_curr);
+            }
 
-            /* Recompute means */
-            max_change = compute_means(n, dim, k, v, 
-                                       clustering_curr, means_new);
+            double now = omp_get_wtime();
+            report_round(opts, i, round, n, k, changed, have_error, error,
+                         now - round_start);
 
+            /* Move to the means of the current assignment */
             memcpy(means_curr, means_new, sizeof(double) * dim * k);
+            round++;
+
+            if ((double) changed / n <= opts.changed_tolerance)
+                stop = "changed";
+            else if (opts.error_tolerance > 0.0 && prev_error < DBL_MAX &&
+                     prev_error - error <= opts.error_tolerance * prev_error)
+                stop = "error";
+            else if (opts.max_rounds > 0 && round >= opts.max_rounds)
+                stop = "max_rounds";
+            else if (opts.time_budget > 0.0 && 
+                     now - call_start >= opts.time_budget)
+                stop = "time";
+
+            prev_error = error;
+        }
 
-            /* Compute new assignments */
-            changed = compute_clustering_kd_tree(n, dim, k, v, means_curr,
-                                                 clustering_curr, error);
+        kmeans_kd_free(search);
 
-            changed_pct = (double) changed / n;
+        if (assign == KMeansAssignHamerly) {
+            kmeans_hamerly_free(bounds);
 
-            round++;
-        } while (changed_pct > changed_pct_threshold);
+            /* Only needed to pick the best restart */
+            if (restarts > 1) {
+                error = compute_error(n, dim, k, data, idx, 
+                                      means_curr, clustering_curr);
+            }
+        }
 
-        max_change = compute_means(n, dim, k, v, clustering_curr, means_new);
-        memcpy(means_curr, means_new, sizeof(double) * dim * k);
+        report_run(opts, i, round, n, k, have_error || restarts > 1, error,
+                   omp_get_wtime() - run_start, stop);
 
         if (error < min_error) {
             min_error = error;
             memcpy(means, means_curr, sizeof(double) * k * dim);
             memcpy(clustering, clustering_curr, sizeof(unsigned int) * n);
         }
+
+        if (opts.time_budget > 0.0 && 
+            omp_get_wtime() - call_start >= opts.time_budget) {
+            break;
+        }
     }
 
 
@@ -386,5 +912,5 @@ double kmeans(int n, int dim, int k, int restarts, unsigned char **v,
     free(starts);
     free(work);
 
-    return compute_error(n, dim, k, v, means, clustering);
+    return compute_error(n, dim, k, data, idx, means, clustering);
 }
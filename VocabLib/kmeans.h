@@ -3,13 +3,67 @@
 #ifndef __KMEANS_H__
 #define __KMEANS_H__
 
+#include <stddef.h>
+#include <stdio.h>
+
+/* The k-means routines take their input vectors as 32-bit indices
+ * into one contiguous array of dim-byte vectors, so that a large
+ * training set costs 4 bytes per vector to address (rather than 8
+ * for a pointer) and can live in a memory-mapped file.  Vector i of
+ * such a set is: */
+inline const unsigned char *kmeans_point(const unsigned char *data,
+                                         const unsigned int *idx,
+                                         int dim, int i)
+{
+    return data + (size_t) idx[i] * dim;
+}
+
+/* Ways of choosing the initial means */
+typedef enum {
+    KMeansInitRandom   = 0,  /* k distinct points, uniformly at random */
+    KMeansInitPlusPlus = 1,  /* k-means++ (D^2 sampling) */
+    KMeansInitParallel = 2,  /* k-means|| (oversampled D^2 rounds) */
+} KMeansInit;
+
+/* Ways of assigning the points to the means in each round */
+typedef enum {
+    KMeansAssignKdTree  = 0,  /* Approximate, with a kd-tree over the means */
+    KMeansAssignHamerly = 1,  /* Exact, skipping points using distance
+                               * bounds (best for moderate k) */
+} KMeansAssign;
+
+/* When to stop iterating, and where to report progress.  A run stops
+ * at the first rule that fires; 0 disables a rule. */
+class KMeansOptions {
+public:
+    KMeansOptions() : max_rounds(0), changed_tolerance(0.05),
+                      error_tolerance(0.0), time_budget(0.0),
+                      telemetry(NULL), level(-1), verbose(1) { }
+
+    int max_rounds;           /* Stop after this many rounds */
+    double changed_tolerance; /* Stop once at most this fraction of the
+                               * points changed cluster in a round */
+    double error_tolerance;   /* Stop once a round improves the error by
+                               * at most this fraction */
+    double time_budget;       /* Seconds for the whole call; when spent,
+                               * the current run stops and no further
+                               * restarts are made */
+
+    FILE *telemetry;          /* If non-NULL, one JSON object per line is
+                               * written here for each round and run */
+    int level;                /* Written to each record if >= 0 (e.g.
+                               * the level of the tree being built) */
+    int verbose;              /* Print each round to stdout */
+};
+
 /* Run kmeans on a set of input vectors 
  * 
  * Inputs: n        : number of input vectors
  *         dim      : dimension of each input vector
  *         k        : number of means to compute
  *         restarts : number of random restarts to perform
- *         v        : set of pointers to input vectors (stored as arrays)
+ *         data     : contiguous array of input vectors
+ *         idx      : indices into data of the n vectors to cluster
  * 
  * Outputs: means      : vector of means (stored as a flat array,
  *                       i.e., the means are concatenated together in
@@ -17,8 +71,50 @@
  *          clustering : array containing assignment of input points
  *                       to clusters -- clustering[i] contains the
  *                       cluster ID for point i
+ *
+ * If seed is non-NULL, the initial means are chosen with rand_r(seed)
+ * rather than rand(), so that independent calls can run concurrently
+ * and reproducibly.  init selects the seeding strategy; k-means++ and
+ * k-means|| need fewer rounds to converge than random seeding.
+ * assign selects how the points are assigned to the means: the
+ * kd-tree search is approximate, while Hamerly's bounds give the
+ * exact assignment and skip most distance computations once the
+ * means settle.  options sets the stopping rules and telemetry
+ * (NULL for the defaults: stop once at most 5% of the points change
+ * cluster).  With Hamerly's assignment the error of a round is only
+ * computed if error_tolerance is set.
  */
-double kmeans(int n, int dim, int k, int restarts, unsigned char **v, 
-              double *means, unsigned int *clustering);
+double kmeans(int n, int dim, int k, int restarts, 
+              const unsigned char *data, const unsigned int *idx,
+              double *means, unsigned int *clustering, 
+              unsigned int *seed = NULL, 
+              KMeansInit init = KMeansInitRandom,
+              KMeansAssign assign = KMeansAssignKdTree,
+              const KMeansOptions *options = NULL);
+
+/* Choose k of the n input vectors as initial means, using the given
+ * strategy.  The positions in idx of the chosen vectors are stored in
+ * starts. */
+void kmeans_choose_starts(int n, int dim, int k, const unsigned char *data,
+                          const unsigned int *idx,
+                          KMeansInit init, int *starts, 
+                          unsigned int *seed = NULL);
+
+/* Reorder idx so that the points of each of the k clusters are
+ * contiguous, cluster 0 first, keeping their relative order.  On
+ * return clustering holds the cluster of each reordered point.  Runs
+ * in O(n + k) time, in parallel for large n.  Returns 0 on success. */
+int partition_by_cluster(int n, int k, unsigned int *idx, 
+                         unsigned int *clustering);
+
+/* The same reordering done with one pass over the points per cluster,
+ * in O(n k) time, as VocabTree::Build used to; the order within a
+ * cluster is not kept.  For comparing against partition_by_cluster. */
+int partition_by_cluster_passes(int n, int k, unsigned int *idx, 
+                                unsigned int *clustering);
+
+/* A function that reorders idx by cluster, as the two above */
+typedef int (*KMeansPartition)(int n, int k, unsigned int *idx, 
+                               unsigned int *clustering);
 
 #endif /* __KMEANS_H__ */
@@ -0,0 +1,271 @@
+/* kmeans_hamerly.cpp */
+/* Exact k-means assignment accelerated with Hamerly's distance bounds */
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <omp.h>
+
+#include "defines.h"
+#include "kmeans.h"
+#include "kmeans_hamerly.h"
+
+/* One thread's changes to the cluster sums, kept only for the
+ * clusters that points moved into or out of */
+struct kmeans_delta_t {
+    std::vector<int> slot;          /* Row of each cluster, or -1 */
+    std::vector<int> touched;       /* Cluster of each row */
+    std::vector<long long> sums;    /* dim entries per row */
+    std::vector<long long> counts;
+};
+
+/* Add (sign = 1) or remove (sign = -1) point v to or from cluster c */
+static void delta_move(kmeans_delta_t &delta, int dim, int c,
+                       const unsigned char *v, int sign)
+{
+    int s = delta.slot[c];
+    if (s < 0) {
+        s = delta.slot[c] = (int) delta.touched.size();
+        delta.touched.push_back(c);
+        delta.sums.resize(delta.sums.size() + dim, 0);
+        delta.counts.push_back(0);
+    }
+
+    long long *row = &delta.sums[(size_t) s * dim];
+    for (int j = 0; j < dim; j++)
+        row[j] += sign * (long long) v[j];
+
+    delta.counts[s] += sign;
+}
+
+void kmeans_hamerly_alloc(kmeans_hamerly_t &state, int n, int dim, int k)
+{
+    state.initialized = 0;
+    state.upper = (double *) malloc(sizeof(double) * n);
+    state.lower = (double *) malloc(sizeof(double) * n);
+    state.means_prev = (double *) malloc(sizeof(double) * k * dim);
+    state.sums = (long long *) calloc(k * dim, sizeof(long long));
+    state.counts = (long long *) calloc(k, sizeof(long long));
+
+    if (state.upper == NULL || state.lower == NULL ||
+        state.means_prev == NULL || state.sums == NULL ||
+        state.counts == NULL) {
+        printf("[kmeans_hamerly_alloc] Error allocating bounds\n");
+        exit(-1);
+    }
+}
+
+void kmeans_hamerly_free(kmeans_hamerly_t &state)
+{
+    free(state.upper);
+    free(state.lower);
+    free(state.means_prev);
+    free(state.sums);
+    free(state.counts);
+
+    state.upper = state.lower = state.means_prev = NULL;
+    state.sums = state.counts = NULL;
+    state.initialized = 0;
+}
+
+/* Squared distance between a descriptor and a mean */
+static double dist_sq(int dim, const unsigned char *v, const double *c)
+{
+    double dist = 0.0;
+    for (int j = 0; j < dim; j++) {
+        double d = (double) v[j] - c[j];
+        dist += d * d;
+    }
+
+    return dist;
+}
+
+/* Find the nearest mean to v, and the squared distances to the
+ * nearest and second-nearest means */
+static int nearest_two(int dim, int k, const unsigned char *v,
+                       const double *means, double &d1, double &d2)
+{
+    int best = 0;
+    d1 = d2 = DBL_MAX;
+
+    for (int j = 0; j < k; j++) {
+        double d = dist_sq(dim, v, means + j * dim);
+
+        if (d < d1) {
+            d2 = d1;
+            d1 = d;
+            best = j;
+        } else if (d < d2) {
+            d2 = d;
+        }
+    }
+
+    return best;
+}
+
+int compute_clustering_hamerly(kmeans_hamerly_t &state,
+                               int n, int dim, int k,
+                               const unsigned char *data,
+                               const unsigned int *idx,
+                               const double *means,
+                               unsigned int *clustering,
+                               double *means_out)
+{
+    const bool first = !state.initialized;
+
+    /* How far each mean moved, and half the distance from each mean
+     * to the nearest other mean */
+    double *drift = new double[k];
+    double *half_sep = new double[k];
+    double max_drift = 0.0, max_drift2 = 0.0;
+    int max_drift_mean = -1;
+
+    for (int j = 0; j < k; j++) {
+        drift[j] = 0.0;
+        half_sep[j] = 0.0;
+    }
+
+    if (!first) {
+        for (int j = 0; j < k; j++) {
+            double d = 0.0;
+            for (int l = 0; l < dim; l++) {
+                double diff = means[j * dim + l] - state.means_prev[j * dim + l];
+                d += diff * diff;
+            }
+
+            drift[j] = sqrt(d);
+
+            if (drift[j] > max_drift) {
+                max_drift2 = max_drift;
+                max_drift = drift[j];
+                max_drift_mean = j;
+            } else if (drift[j] > max_drift2) {
+                max_drift2 = drift[j];
+            }
+        }
+
+        /* The separation test costs O(k^2) per round; it is only
+         * worth it while that is small next to a pass over the points */
+        if ((double) k * k <= (double) n) {
+#pragma omp parallel for schedule(dynamic, 16)
+            for (int j = 0; j < k; j++) {
+                double min_d = DBL_MAX;
+                for (int l = 0; l < k; l++) {
+                    if (l == j)
+                        continue;
+
+                    double d = 0.0;
+                    for (int m = 0; m < dim; m++) {
+                        double diff = means[j * dim + m] - means[l * dim + m];
+                        d += diff * diff;
+                    }
+
+                    if (d < min_d)
+                        min_d = d;
+                }
+
+                half_sep[j] = 0.5 * sqrt(min_d);
+            }
+        }
+    }
+
+    /* Each thread moves the points it reassigns between its own
+     * copies of the affected cluster sums, while the point is at
+     * hand */
+    const int max_threads = omp_get_max_threads();
+    std::vector<kmeans_delta_t> deltas(max_threads);
+    int num_threads = 1;
+    int changed = 0;
+
+#pragma omp parallel reduction(+:changed)
+    {
+        kmeans_delta_t &delta = deltas[omp_get_thread_num()];
+        delta.slot.assign(k, -1);
+
+        if (omp_get_thread_num() == 0)
+            num_threads = omp_get_num_threads();
+
+#pragma omp for schedule(dynamic, 1024)
+        for (int i = 0; i < n; i++) {
+            const unsigned char *v = kmeans_point(data, idx, dim, i);
+            double d1, d2;
+
+            if (first) {
+                int best = nearest_two(dim, k, v, means, d1, d2);
+                state.upper[i] = sqrt(d1);
+                state.lower[i] = sqrt(d2);
+
+                delta_move(delta, dim, best, v, 1);
+                clustering[i] = best;
+                changed++;
+                continue;
+            }
+
+            int a = clustering[i];
+            double u = state.upper[i] + drift[a];
+            double l = state.lower[i] -
+                (a == max_drift_mean ? max_drift2 : max_drift);
+            double m = MAX(half_sep[a], l);
+
+            if (u > m) {
+                /* Tighten the upper bound, and if that is not enough,
+                 * look at every mean */
+                u = sqrt(dist_sq(dim, v, means + a * dim));
+
+                if (u > m) {
+                    int best = nearest_two(dim, k, v, means, d1, d2);
+                    u = sqrt(d1);
+                    l = sqrt(d2);
+
+                    if (best != a) {
+                        delta_move(delta, dim, a, v, -1);
+                        delta_move(delta, dim, best, v, 1);
+                        clustering[i] = best;
+                        changed++;
+                    }
+                }
+            }
+
+            state.upper[i] = u;
+            state.lower[i] = l;
+        }
+    }
+
+    /* Merge the changes into the cluster sums and normalize.  The
+     * sums are integers, so the order does not matter; each thread
+     * takes a range of clusters. */
+#pragma omp parallel for schedule(static)
+    for (int c = 0; c < k; c++) {
+        long long *sum = state.sums + (size_t) c * dim;
+
+        for (int t = 0; t < num_threads; t++) {
+            int s = deltas[t].slot[c];
+            if (s < 0)
+                continue;
+
+            const long long *row = &deltas[t].sums[(size_t) s * dim];
+            for (int j = 0; j < dim; j++)
+                sum[j] += row[j];
+
+            state.counts[c] += deltas[t].counts[s];
+        }
+
+        double scale = (state.counts[c] == 0) ? 0.0 : 1.0 / state.counts[c];
+
+        for (int j = 0; j < dim; j++)
+            means_out[c * dim + j] = (double) sum[j] * scale;
+    }
+
+    memcpy(state.means_prev, means, sizeof(double) * k * dim);
+    state.initialized = 1;
+
+    delete [] drift;
+    delete [] half_sep;
+
+    return changed;
+}
@@ -0,0 +1,39 @@
+/* kmeans_hamerly.h */
+
+#ifndef __KMEANS_HAMERLY_H__
+#define __KMEANS_HAMERLY_H__
+
+/* State kept between the rounds of Hamerly's k-means ("Making k-means
+ * even faster", SDM 2010).  For each point it stores an upper bound
+ * on the distance to its assigned mean and a lower bound on the
+ * distance to every other mean; when the means move, the bounds are
+ * loosened by the distance the means moved, and a point whose upper
+ * bound is below its lower bound keeps its assignment without
+ * computing any distances. */
+typedef struct {
+    int initialized;        /* Have the bounds been computed? */
+    double *upper;          /* Upper bound on distance to own mean */
+    double *lower;          /* Lower bound on distance to other means */
+    double *means_prev;     /* Means used in the previous round */
+    long long *sums;        /* Sum of the points of each cluster */
+    long long *counts;      /* Number of points in each cluster */
+} kmeans_hamerly_t;
+
+/* Allocate the state for n points and k means of dimension dim */
+void kmeans_hamerly_alloc(kmeans_hamerly_t &state, int n, int dim, int k);
+void kmeans_hamerly_free(kmeans_hamerly_t &state);
+
+/* Exactly assign each point to its nearest mean, returning the number
+ * of points that changed cluster.  The first call computes every
+ * distance; later calls use the bounds.  The means of the new
+ * clustering are stored in means_out (the sums are updated only for
+ * the points that moved). */
+int compute_clustering_hamerly(kmeans_hamerly_t &state,
+                               int n, int dim, int k,
+                               const unsigned char *data,
+                               const unsigned int *idx,
+                               const double *means,
+                               unsigned int *clustering,
+                               double *means_out);
+
+#endif /* __KMEANS_HAMERLY_H__ */
@@ -41,75 +41,269 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <vector>
+
 #include <omp.h>
 
 #include "../lib/ann_1.1/include/ANN/ANN.h"
+#include "kmeans.h"
+#include "kmeans_kd.h"
 
-static void fill_vector_float(float *vec, unsigned char *v, int dim)
+static void fill_vector_float(float *vec, const unsigned char *v, int dim)
 {
     int i;
     for (i = 0; i < dim; i++) 
         vec[i] = (double) v[i];
 }
 
-int compute_clustering_kd_tree(int n, int dim, int k, unsigned char **v,
-                               double *means, unsigned int *clustering, 
-                               double &error_out)
+/* Points are assigned in blocks of this size.  The error and change
+ * count of each block are summed in block order, so the result does
+ * not depend on the number of threads or the schedule. */
+#define CLUSTERING_BLOCK_SIZE 1024
+
+/* Copy the means into the search points in parallel above this k */
+#define KD_PARALLEL_COPY_MEANS 4096
+
+struct kmeans_kd_state {
+    int dim, k;
+    ANNpointArray pts;          /* The means, as float coordinates */
+    ANNkd_tree *tree;           /* Search tree over pts (NULL until built) */
+
+    /* Per-thread buffers, allocated by each thread on first use */
+    std::vector<float *> vec;                   /* Query point */
+
+    /* Per-thread sums for the new means, kept only for the clusters
+     * the thread assigned points to.  slot[t][c] is the row of
+     * cluster c in sums[t] and counts[t], or -1 */
+    std::vector<int *> slot;
+    std::vector<std::vector<int> > touched;
+    std::vector<std::vector<unsigned long long> > sums;
+    std::vector<std::vector<unsigned int> > counts;
+
+    /* Per-block partial results */
+    std::vector<double> block_error;
+    std::vector<int> block_changed;
+};
+
+kmeans_kd_t *kmeans_kd_alloc(int dim, int k)
 {
-    double error = 0.0;
+    kmeans_kd_t *state = new kmeans_kd_t;
 
-    // int changed = 0;
+    state->dim = dim;
+    state->k = k;
+    state->pts = annAllocPts(k, dim);
+    state->tree = NULL;
 
-    /* Using a kd-tree */
-    ANNpointArray pts = annAllocPts(k, dim);
+    return state;
+}
+
+void kmeans_kd_free(kmeans_kd_t *state)
+{
+    if (state == NULL)
+        return;
+
+    for (int t = 0; t < (int) state->vec.size(); t++) {
+        free(state->vec[t]);
+        delete [] state->slot[t];
+    }
+
+    delete state->tree;
+    annDeallocPts(state->pts);
+
+    delete state;
+}
 
+/* Point the search structure at a new set of means.  The tree is
+ * refitted if its cells still separate the means, and rebuilt
+ * otherwise. */
+static void kmeans_kd_update(kmeans_kd_t *state, const double *means)
+{
+    int k = state->k, dim = state->dim;
+    ANNpointArray pts = state->pts;
+
+#pragma omp parallel for if (k >= KD_PARALLEL_COPY_MEANS)
     for (int i = 0; i < k; i++) {
         for (int j = 0; j < dim; j++) {
             pts[i][j] = means[i * dim + j];
         }
     }
 
-    ANNkd_tree *tree = new ANNkd_tree(pts, k, dim, 4);
+    if (state->tree != NULL && state->tree->Refit())
+        return;
+
+    delete state->tree;
+    state->tree = new ANNkd_tree(pts, k, dim, 4);
+}
+
+/* Add descriptor 'v' (of dimension 'dim') into integer sum 'acc' */
+static void vec_accum_int(int dim, unsigned long long *acc, 
+                          const unsigned char *v)
+{
+    for (int i = 0; i < dim; i++)
+        acc[i] += v[i];
+}
+
+int compute_clustering_kd_tree(int n, int dim, int k, 
+                               const unsigned char *data,
+                               const unsigned int *idx,
+                               double *means, unsigned int *clustering, 
+                               double &error_out, double *means_out,
+                               kmeans_kd_t *state)
+{
+    /* Using a kd-tree */
+    kmeans_kd_t *state_local = NULL;
+    if (state == NULL)
+        state = state_local = kmeans_kd_alloc(dim, k);
+
+    kmeans_kd_update(state, means);
+
+    ANNkd_tree *tree = state->tree;
     annMaxPtsVisit(512);
 
-    const int max_threads = omp_get_max_threads();    
-    int changed[max_threads];
-    float *vec[max_threads];
+    /* Per-block partial results.  Each entry is written once, by the
+     * thread that owns the block, so threads never share a line
+     * while accumulating. */
+    const int num_blocks = 
+        (n + CLUSTERING_BLOCK_SIZE - 1) / CLUSTERING_BLOCK_SIZE;
+    state->block_error.resize(num_blocks);
+    state->block_changed.resize(num_blocks);
+    double *block_error = &state->block_error[0];
+    int *block_changed = &state->block_changed[0];
 
-    for (int i = 0; i < max_threads; i++) {
-        changed[i] = 0;
-        vec[i] = (float *) malloc(sizeof(float) * dim);
+    /* Per-thread integer sums for the new means.  Sums of uint8
+     * descriptors are exact, so merging them in any order gives the
+     * same means. */
+    const int max_threads = omp_get_max_threads();
+    if ((int) state->vec.size() < max_threads) {
+        state->vec.resize(max_threads, NULL);
+        state->slot.resize(max_threads, NULL);
+        state->touched.resize(max_threads);
+        state->sums.resize(max_threads);
+        state->counts.resize(max_threads);
     }
-    
-#pragma omp parallel for
-    for (int i = 0; i < n; i++) {
-        int my_thread = omp_get_thread_num();
 
-        int nn;
-        float dist;
-        fill_vector_float(vec[my_thread], v[i], dim);
-        tree->annkPriSearch(vec[my_thread], 1, &nn, &dist, 0.0);
+    int num_threads = 1;
+
+#pragma omp parallel
+    {
+        int t = omp_get_thread_num();
+
+        if (state->vec[t] == NULL)
+            state->vec[t] = (float *) malloc(sizeof(float) * dim);
+
+        float *vec = state->vec[t];
+        int *slot = NULL;
+        std::vector<int> &touched = state->touched[t];
+        std::vector<unsigned long long> &sums = state->sums[t];
+        std::vector<unsigned int> &counts = state->counts[t];
+
+        if (means_out != NULL) {
+            if (state->slot[t] == NULL) {
+                state->slot[t] = new int[k];
+                for (int c = 0; c < k; c++)
+                    state->slot[t][c] = -1;
+            }
+
+            /* Forget the clusters touched in the last round */
+            slot = state->slot[t];
+            for (int s = 0; s < (int) touched.size(); s++)
+                slot[touched[s]] = -1;
+
+            touched.clear();
+            sums.clear();
+            counts.clear();
+
+            if (t == 0)
+                num_threads = omp_get_num_threads();
+        }
+
+#pragma omp for schedule(dynamic, 4)
+        for (int b = 0; b < num_blocks; b++) {
+            int start = b * CLUSTERING_BLOCK_SIZE;
+            int end = start + CLUSTERING_BLOCK_SIZE;
+            if (end > n)
+                end = n;
+
+            double error = 0.0;
+            int changed = 0;
+
+            for (int i = start; i < end; i++) {
+                int nn;
+                float dist;
+                const unsigned char *v = kmeans_point(data, idx, dim, i);
+                fill_vector_float(vec, v, dim);
+                tree->annkPriSearch(vec, 1, &nn, &dist, 0.0);
 
-        error += (double) dist;
+                error += (double) dist;
 
-        if ((int) clustering[i] != nn) {
-            changed[my_thread]++;
-            clustering[i] = nn;
+                if ((int) clustering[i] != nn) {
+                    changed++;
+                    clustering[i] = nn;
+                }
+
+                if (slot != NULL) {
+                    int s = slot[nn];
+                    if (s < 0) {
+                        s = slot[nn] = (int) touched.size();
+                        touched.push_back(nn);
+                        sums.resize(sums.size() + dim, 0);
+                        counts.push_back(0);
+                    }
+
+                    vec_accum_int(dim, &sums[s * dim], v);
+                    counts[s]++;
+                }
+            }
+
+            block_error[b] = error;
+            block_changed[b] = changed;
         }
     }
 
+    double error = 0.0;
+    int changed_total = 0;
+    for (int b = 0; b < num_blocks; b++) {
+        error += block_error[b];
+        changed_total += block_changed[b];
+    }
+
     error_out = error;
 
-    for (int i = 0; i < max_threads; i++)
-        free(vec[i]);
+    if (means_out != NULL) {
+        /* Merge the per-thread sums and normalize, splitting the
+         * clusters among the threads */
+#pragma omp parallel if (k >= KD_PARALLEL_COPY_MEANS)
+        {
+            std::vector<unsigned long long> sum(dim);
 
-    delete tree;
-    annDeallocPts(pts);
+#pragma omp for schedule(static)
+            for (int c = 0; c < k; c++) {
+                unsigned long long count = 0;
+                std::fill(sum.begin(), sum.end(), 0);
 
-    int changed_total = 0;
-    for (int i = 0; i < max_threads; i++) {
-        changed_total += changed[i];
+                for (int t = 0; t < num_threads; t++) {
+                    int s = state->slot[t][c];
+                    if (s < 0)
+                        continue;
+
+                    const unsigned long long *thread_sum = 
+                        &state->sums[t][s * dim];
+                    for (int j = 0; j < dim; j++)
+                        sum[j] += thread_sum[j];
+
+                    count += state->counts[t][s];
+                }
+
+                double scale = (count == 0) ? 0.0 : 1.0 / count;
+
+                for (int j = 0; j < dim; j++)
+                    means_out[c * dim + j] = (double) sum[j] * scale;
+            }
+        }
     }
 
+    kmeans_kd_free(state_local);
+
     return changed_total;
 }
@@ -3,8 +3,26 @@
 #ifndef __KMEANS_KD_H__
 #define __KMEANS_KD_H__
 
-int compute_clustering_kd_tree(int n, int dim, int k, unsigned char **v,
+/* Search structure over the means, kept across the rounds of one
+ * k-means run.  The kd-tree over the means is refitted in place while
+ * the means move a little, and rebuilt (in parallel, for large k)
+ * once they no longer fit its cells; the point array and per-thread
+ * buffers are allocated once. */
+typedef struct kmeans_kd_state kmeans_kd_t;
+
+kmeans_kd_t *kmeans_kd_alloc(int dim, int k);
+void kmeans_kd_free(kmeans_kd_t *state);
+
+/* Assign each point to its nearest mean, returning the number of
+ * points that changed cluster.  If means_out is non-NULL, the means
+ * of the new clustering are computed in the same pass over the
+ * points.  If state is NULL, a search structure is built for this
+ * call only. */
+int compute_clustering_kd_tree(int n, int dim, int k, 
+                               const unsigned char *data,
+                               const unsigned int *idx,
                                double *means, unsigned int *clustering, 
-                               double &error_out);
+                               double &error_out, double *means_out = NULL,
+                               kmeans_kd_t *state = NULL);
 
 #endif /* __KMEANS_KD_H__ */
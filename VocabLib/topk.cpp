@@ -0,0 +1,80 @@
+/* topk.cpp */
+/* Partial selection of the best-scoring database images */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "topk.h"
+#include "defines.h"
+
+typedef std::pair<float,int> scored_image_t;
+
+/* Ordering used for the selection: higher score first, then lower
+ * index first */
+static bool better(const scored_image_t &a, const scored_image_t &b)
+{
+    if (a.first != b.first)
+        return a.first > b.first;
+
+    return a.second < b.second;
+}
+
+/* Offer an image to a bounded heap holding the k best images seen so
+ * far (the worst of them at the top) */
+static void offer(std::vector<scored_image_t> &heap, int k, 
+                  const scored_image_t &c)
+{
+    if ((int) heap.size() < k) {
+        heap.push_back(c);
+        std::push_heap(heap.begin(), heap.end(), better);
+    } else if (better(c, heap[0])) {
+        std::pop_heap(heap.begin(), heap.end(), better);
+        heap.back() = c;
+        std::push_heap(heap.begin(), heap.end(), better);
+    }
+}
+
+int select_top_k(int n, const float *scores, int k, 
+                 int *idx_out, double *scores_out,
+                 int num_candidates, const unsigned int *candidates)
+{
+    k = MIN(k, n);
+    if (k <= 0)
+        return 0;
+
+    std::vector<scored_image_t> heap;
+    heap.reserve(k);
+
+    if (num_candidates < 0) {
+        for (int i = 0; i < n; i++)
+            offer(heap, k, scored_image_t(scores[i], i));
+    } else {
+        for (int i = 0; i < num_candidates; i++) {
+            int idx = (int) candidates[i];
+            if (scores[idx] != 0.0)
+                offer(heap, k, scored_image_t(scores[idx], idx));
+        }
+    }
+
+    std::sort_heap(heap.begin(), heap.end(), better);
+
+    int num_selected = (int) heap.size();
+    for (int i = 0; i < num_selected; i++) {
+        idx_out[i] = heap[i].second;
+        scores_out[i] = (double) heap[i].first;
+    }
+
+    /* Pad with zero-scoring images, in index order */
+    for (int i = 0; i < n && num_selected < k; i++) {
+        if (scores[i] == 0.0) {
+            idx_out[num_selected] = i;
+            scores_out[num_selected] = 0.0;
+            num_selected++;
+        }
+    }
+
+    return num_selected;
+}
@@ -0,0 +1,31 @@
+/* topk.h */
+
+#ifndef __TOPK_H__
+#define __TOPK_H__
+
+/* Select the k best-scoring database images, without sorting all of
+ * the scores
+ * 
+ * Inputs: n              : number of database images
+ *         scores         : array of n scores (higher is better)
+ *         k              : number of images to select
+ *         num_candidates : number of entries in candidates, or -1 to
+ *                          consider all n images
+ *         candidates     : images that may have a non-zero score
+ *                          (e.g., the images touched by a query); all
+ *                          other images are taken to score zero
+ * 
+ * Outputs: idx_out    : indices of the selected images, best first
+ *          scores_out : scores of the selected images
+ *
+ * Ties are broken in favor of the lower image index, so the result
+ * is deterministic.  If fewer than k candidates have a non-zero
+ * score, the list is padded with zero-scoring images.  Returns the
+ * number of images selected, MIN(k, n).
+ */
+int select_top_k(int n, const float *scores, int k, 
+                 int *idx_out, double *scores_out,
+                 int num_candidates = -1, 
+                 const unsigned int *candidates = NULL);
+
+#endif /* __TOPK_H__ */
@@ -45,11 +45,15 @@
 
 #include <string>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "VocabTree.h"
+#include "VocabWordCache.h"
 #include "keys2.h"
 
 #include "defines.h"
-#include "qsort.h"
 
 /* Read in a set of keys from a file 
  *
@@ -66,24 +70,12 @@
  */
 unsigned char *ReadKeys(const char *keyfile, int dim, int &num_keys_out)
 {
-    short int *keys;
-    keypt_t *info = NULL;
-    int num_keys = ReadKeyFile(keyfile, &keys, &info);
-    
-    unsigned char *keys_char = new unsigned char[num_keys * dim];
-        
-    for (int j = 0; j < num_keys * dim; j++) {
-        keys_char[j] = (unsigned char) keys[j];
-    }
-
-    delete [] keys;
-
-    if (info != NULL) 
-        delete [] info;
+    unsigned char *keys;
+    int num_keys = ReadKeyFile(keyfile, &keys);
 
     num_keys_out = num_keys;
 
-    return keys_char;
+    return keys;
 }
 
 int BasifyFilename(const char *filename, char *base)
@@ -150,13 +142,137 @@ void PrintHTMLFooter(FILE *f)
 }
 #endif
 
+/* Number of queries handed to each worker thread per block */
+#define QUERIES_PER_THREAD 16
+
+/* Result of scoring one query image */
+typedef struct {
+    int num_keys;              /* Number of query features */
+    double mag;                /* Magnitude of the query vector */
+    double time_score;         /* Time spent scoring (seconds) */
+    double time_total;         /* Time including reading the keys */
+    std::vector<int> nbrs;     /* Top database images, best first */
+    std::vector<double> scores; /* Scores of the top database images */
+} query_result_t;
+
+static double GetTime() 
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static int GetThreadNum() 
+{
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+/* Fill in the result of a query scored into ctx, keeping the top
+ * num_nbrs matches */
+static void FinishQueryImage(VocabQueryContext &ctx, int num_nbrs, 
+                             int num_keys, double mag, double start, 
+                             double start_score, double end,
+                             query_result_t &result)
+{
+    result.num_keys = num_keys;
+    result.mag = mag;
+    result.time_score = end - start_score;
+    result.time_total = end - start;
+
+    /* Find the top scores */
+    int top = ctx.SelectTopK(num_nbrs);
+    result.nbrs.assign(ctx.m_perm.begin(), ctx.m_perm.begin() + top);
+    result.scores.assign(ctx.m_scores_d.begin(), 
+                         ctx.m_scores_d.begin() + top);
+}
+
+/* Read the keys of a query image and score them against the
+ * database, keeping the top num_nbrs matches.  Only ctx and result
+ * are modified, so this can be called from several threads at once
+ * (with distinct contexts) */
+void ScoreQueryImage(const VocabTree &tree, const char *keyfile, int dim,
+                     bool normalize, int num_nbrs, 
+                     VocabQueryContext &ctx, query_result_t &result)
+{
+    double start = GetTime();
+
+    int num_keys;
+    unsigned char *keys = ReadKeys(keyfile, dim, num_keys);
+
+    double start_score = GetTime();
+    double mag = tree.ScoreQueryKeys(num_keys, normalize, keys, ctx);
+    double end = GetTime();
+
+    delete [] keys;
+
+    FinishQueryImage(ctx, num_nbrs, num_keys, mag, start, start_score, end,
+                     result);
+}
+
+/* As ScoreQueryImage, taking the words of the query from the word
+ * cache of the key file if it is valid for the tree (with the given
+ * checksum), and writing the cache otherwise */
+void ScoreQueryImageCached(const VocabTree &tree, unsigned int checksum,
+                           const char *keyfile, bool normalize, 
+                           int num_nbrs, VocabQueryContext &ctx, 
+                           query_result_t &result)
+{
+    double start = GetTime();
+
+    ImageWords cached;
+    cached.ReadOrQuantize(tree, checksum, keyfile);
+
+    std::vector<unsigned long> words;
+    int num_keys = cached.Select(0.0, 0, words);
+
+    double start_score = GetTime();
+    double mag = tree.ScoreQueryWords(num_keys, normalize, 
+                                      num_keys > 0 ? &(words[0]) : NULL, 
+                                      ctx);
+    double end = GetTime();
+
+    FinishQueryImage(ctx, num_nbrs, num_keys, mag, start, start_score, end,
+                     result);
+}
+
+/* Take the --bow-cache flag out of argv, leaving the positional
+ * arguments */
+static bool parse_cache_option(int &argc, char **argv)
+{
+    bool use_cache = false;
+    int argc_out = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bow-cache") == 0)
+            use_cache = true;
+        else
+            argv[argc_out++] = argv[i];
+    }
+
+    argc = argc_out;
+    return use_cache;
+}
+
 int main(int argc, char **argv) 
 {
     const int dim = 128;
+    bool use_cache = parse_cache_option(argc, argv);
 
-    if (argc != 6 && argc != 7 && argc != 8) {
+    if (argc < 6 || argc > 9) {
         printf("Usage: %s <db.in> <list.in> <query.in> <num_nbrs> "
-               "<matches.out> [distance_type:1] [normalize:1]\n", argv[0]);
+               "<matches.out> [distance_type:1] [normalize:1] "
+               "[num_threads:1] [--bow-cache]\n", argv[0]);
+        printf("  --bow-cache: take the words of each query from its "
+               "word cache\n"
+               "               (<file>.<checksum>.bow) if one was written "
+               "for this tree,\n"
+               "               and write it otherwise\n");
         return 1;
     }
 
@@ -167,6 +283,7 @@ int main(int argc, char **argv)
     char *matches_out = argv[5];
     DistanceType distance_type = DistanceMin;
     bool normalize = true;
+    int num_threads = 1;
 
 #if 0    
     if (argc >= 7)
@@ -179,6 +296,12 @@ int main(int argc, char **argv)
     if (argc >= 8)
         normalize = (atoi(argv[7]) != 0);
 
+    if (argc >= 9)
+        num_threads = atoi(argv[8]);
+
+    if (num_threads < 1)
+        num_threads = 1;
+
     printf("[VocabMatch] Using database %s\n", db_in);
 
     switch (distance_type) {
@@ -210,7 +333,20 @@ int main(int argc, char **argv)
 #endif
 
     tree.SetDistanceType(distance_type);
-    tree.SetInteriorNodeWeight(0, 0.0);
+
+    /* Mapped databases are written with their weights set */
+    if (!tree.IsMapped())
+        tree.SetInteriorNodeWeight(0, 0.0);
+
+    tree.FreezeDatabase(tree.IsIncremental());
+
+    /* The checksum of the frozen tree keys the word caches */
+    unsigned int cache_checksum = 0;
+    if (use_cache) {
+        cache_checksum = tree.Checksum();
+        printf("[VocabMatch] Using word caches for tree checksum %08x\n",
+               cache_checksum);
+    }
     
     /* Read the database keyfiles */
     FILE *f = fopen(list_in, "r");
@@ -258,7 +394,8 @@ int main(int argc, char **argv)
     printf("[VocabMatch] Read %d database images\n", num_db_images);
 
     /* Now score each query keyfile */
-    printf("[VocabMatch] Scoring %d query images...\n", num_query_images);
+    printf("[VocabMatch] Scoring %d query images with %d thread(s)...\n", 
+           num_query_images, num_threads);
     fflush(stdout);
 
 #if 0
@@ -266,10 +403,6 @@ int main(int argc, char **argv)
     PrintHTMLHeader(f_html, num_nbrs);
 #endif
 
-    float *scores = new float[num_db_images];
-    double *scores_d = new double[num_db_images];
-    int *perm = new int[num_db_images];
-
     FILE *f_match = fopen(matches_out, "w");
     if (f_match == NULL) {
         printf("[VocabMatch] Error opening file %s for writing\n",
@@ -277,54 +410,58 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    for (int i = 0; i < num_query_images; i++) {
-        start = clock();
-
-        /* Clear scores */
-        for (int j = 0; j < num_db_images; j++) 
-            scores[j] = 0.0;
-
-        unsigned char *keys;
-        int num_keys;
-
-        keys = ReadKeys(query_files[i].c_str(), dim, num_keys);
-
-        clock_t start_score = clock();
-        double mag = tree.ScoreQueryKeys(num_keys, normalize, keys, scores);
-        clock_t end_score = end = clock();
-
-        printf("[VocabMatch] Scored image %s in %0.3fs "
-               "( %0.3fs total, num_keys = %d, mag = %0.3f )\n", 
-               query_files[i].c_str(), 
-               (double) (end_score - start_score) / CLOCKS_PER_SEC,
-               (double) (end - start) / CLOCKS_PER_SEC, num_keys, mag);
-
-        /* Find the top scores */
-        for (int j = 0; j < num_db_images; j++) {
-            scores_d[j] = (double) scores[j];
+    /* Each worker thread owns the scratch state (scores and top-k
+     * buffers) for the queries it scores; the tree is shared */
+    std::vector<VocabQueryContext> contexts(num_threads);
+    for (int t = 0; t < num_threads; t++)
+        contexts[t].Resize(num_db_images);
+
+    /* Queries are scored a block at a time, and the results of each
+     * block are written out in query order, so the output does not
+     * depend on the number of threads */
+    int block_size = num_threads * QUERIES_PER_THREAD;
+    std::vector<query_result_t> results(block_size);
+
+    for (int b = 0; b < num_query_images; b += block_size) {
+        int block_end = MIN(b + block_size, num_query_images);
+
+#pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+        for (int i = b; i < block_end; i++) {
+            int t = GetThreadNum();
+            if (use_cache) {
+                ScoreQueryImageCached(tree, cache_checksum, 
+                                      query_files[i].c_str(), normalize,
+                                      num_nbrs, contexts[t], results[i - b]);
+            } else {
+                ScoreQueryImage(tree, query_files[i].c_str(), dim, 
+                                normalize, num_nbrs, contexts[t], 
+                                results[i - b]);
+            }
         }
 
-        qsort_descending();
-        qsort_perm(num_db_images, scores_d, perm);        
+        for (int i = b; i < block_end; i++) {
+            const query_result_t &r = results[i - b];
+
+            printf("[VocabMatch] Scored image %s in %0.3fs "
+                   "( %0.3fs total, num_keys = %d, mag = %0.3f )\n", 
+                   query_files[i].c_str(), r.time_score, r.time_total,
+                   r.num_keys, r.mag);
 
-        int top = MIN(num_nbrs, num_db_images);
+            int top = (int) r.nbrs.size();
+            for (int j = 0; j < top; j++) {
+                // if (r.nbrs[j] == index_i)
+                //     continue;
+                fprintf(f_match, "%d %d %0.4f\n", i, r.nbrs[j], r.scores[j]);
+            }
 
-        for (int j = 0; j < top; j++) {
-            // if (perm[j] == index_i)
-            //     continue;
-            fprintf(f_match, "%d %d %0.4f\n", i, perm[j], scores_d[j]);
-            //fprintf(f_match, "%d %d %0.4f\n", i, perm[j], mag - scores_d[j]);
+#if 0
+            PrintHTMLRow(f_html, query_files[i], &(r.scores[0]), 
+                         &(r.nbrs[0]), num_nbrs, db_files);
+#endif
         }
         
         fflush(f_match);
         fflush(stdout);
-
-#if 0
-        PrintHTMLRow(f_html, query_files[i], scores_d, 
-                     perm, num_nbrs, db_files);
-#endif
-
-        delete [] keys;
     }
 
     fclose(f_match);
@@ -334,9 +471,5 @@ int main(int argc, char **argv)
     fclose(f_html);
 #endif
 
-    delete [] scores;
-    delete [] scores_d;
-    delete [] perm;
-
     return 0;
 }
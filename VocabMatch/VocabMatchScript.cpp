@@ -13,7 +13,6 @@
 #include "keys2.h"
 
 #include "defines.h"
-#include "qsort.h"
 
 #ifdef COLORED_NODES
 #include "image.h"
@@ -27,32 +26,28 @@ unsigned char *ReadAndFilterKeys(const char *keyfile, int dim,
                                  double min_feature_scale, int max_keys, 
                                  int &num_keys_out)
 {
-    short int *keys;
+    unsigned char *keys;
     keypt_t *info = NULL;
     int num_keys = ReadKeyFile(keyfile, &keys, &info);
     
     if (num_keys == 0) {
+        delete [] keys;
+        delete [] info;
         num_keys_out = 0;
         return NULL;
     }
     
-    /* Filter keys */
-    unsigned char *keys_char = new unsigned char[num_keys * dim];
-        
+    /* Filter keys, compacting them in place */
     int num_keys_filtered = 0;
     if (min_feature_scale == 0.0 && max_keys == 0) {
-        for (int j = 0; j < num_keys * dim; j++) {
-            keys_char[j] = (unsigned char) keys[j];
-        }
         num_keys_filtered = num_keys;
     } else {
         for (int j = 0; j < num_keys; j++) {
             if (info[j].scale < min_feature_scale)
                 continue;
             
-            for (int k = 0; k < dim; k++) {
-                keys_char[num_keys_filtered * dim + k] = 
-                    (unsigned char) keys[j * dim + k];
+            if (num_keys_filtered != j) {
+                memcpy(keys + num_keys_filtered * dim, keys + j * dim, dim);
             }
             
             num_keys_filtered++;
@@ -62,14 +57,12 @@ unsigned char *ReadAndFilterKeys(const char *keyfile, int dim,
         }
     }
 
-    delete [] keys;
-
     if (info != NULL) 
         delete [] info;
 
     num_keys_out = num_keys_filtered;
 
-    return keys_char;
+    return keys;
 }
 
 int BasifyFilename(const char *filename, char *base)
@@ -179,6 +172,8 @@ int main(int argc, char **argv)
         tree.SetConstantLeafWeights();
 #endif
     }
+
+    tree.FreezeDatabase(tree.IsIncremental());
     
     /* Read the database keyfiles */
     FILE *f = fopen(db_in, "r");
@@ -226,9 +221,8 @@ int main(int argc, char **argv)
     printf("[VocabMatch] Scoring query images...\n");
     fflush(stdout);
 
-    float *scores = new float[num_db_images];
-    double *scores_d = new double[num_db_images];
-    int *perm = new int[num_db_images];
+    /* Per-query scratch state (scores and top-k buffers) */
+    VocabQueryContext ctx(num_db_images);
 
     FILE *f_match = fopen(matches_out, "w");
     if (f_match == NULL) {
@@ -242,17 +236,13 @@ int main(int argc, char **argv)
 
         start = clock();
 
-        /* Clear scores */
-        for (int j = 0; j < num_db_images; j++) 
-            scores[j] = 0.0;
-
         unsigned char *keys;
         int num_keys;
 
         keys = ReadAndFilterKeys(query_files[i].c_str(), dim, 
                                  min_feature_scale, max_keys, num_keys);
 
-        tree.ScoreQueryKeys(num_keys, /*i,*/ true, keys, scores);
+        tree.ScoreQueryKeys(num_keys, /*i,*/ true, keys, ctx);
 
         end = clock();
         printf("[VocabMatch] Scored image %s (%d keys) in %0.3fs\n", 
@@ -270,15 +260,9 @@ int main(int argc, char **argv)
 #endif
 
         /* Find the top scores */
-        for (int j = 0; j < num_db_images; j++) {
-            scores_d[j] = (double) scores[j];
-        }
-
-        qsort_descending();
-        qsort_perm(num_db_images, scores_d, perm);        
-        // assert(is_sorted(num_db_images, scores_d));
-
-        int top = MIN(num_nbrs+1, num_db_images);
+        int top = ctx.SelectTopK(num_nbrs+1);
+        double *scores_d = &(ctx.m_scores_d[0]);
+        int *perm = &(ctx.m_perm[0]);
 
         for (int j = 0; j < top; j++) {
             if (perm[j] == index_i)
@@ -294,9 +278,6 @@ int main(int argc, char **argv)
 
     fclose(f_match);
 
-    delete [] scores;
-    delete [] scores_d;
-    delete [] perm;
 
     return 0;
 }
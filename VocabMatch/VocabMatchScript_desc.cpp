@@ -13,7 +13,6 @@
 #include "keys2.h"
 
 #include "defines.h"
-#include "qsort.h"
 
 #ifdef COLORED_NODES
 #include "image.h"
@@ -33,6 +32,15 @@ unsigned char *ReadDescriptorFile(const char *desc_file, unsigned int dim,
         return NULL;
     }
 
+    if (IsBinaryKeyFile(f)) {
+        /* A binary key file; its keypoints are not needed */
+        unsigned char *desc;
+        num_keys_out = ReadKeysBinary(f, &desc);
+        fclose(f);
+
+        return desc;
+    }
+
     unsigned int num_points = 0;
     int nRead = fread(&num_points, sizeof(unsigned int), 1, f);
     assert(nRead == 1);
@@ -159,6 +167,8 @@ int main(int argc, char **argv)
         tree.SetConstantLeafWeights();
 #endif
     }
+
+    tree.FreezeDatabase(tree.IsIncremental());
     
     /* Read the database keyfiles */
     FILE *f = fopen(db_in, "r");
@@ -210,9 +220,8 @@ int main(int argc, char **argv)
     printf("[VocabMatch] Scoring query images...\n");
     fflush(stdout);
 
-    float *scores = new float[num_db_images];
-    double *scores_d = new double[num_db_images];
-    int *perm = new int[num_db_images];
+    /* Per-query scratch state (scores and top-k buffers) */
+    VocabQueryContext ctx(num_db_images);
 
     FILE *f_match = fopen(matches_out, "w");
     if (f_match == NULL) {
@@ -226,16 +235,12 @@ int main(int argc, char **argv)
 
         start = clock();
 
-        /* Clear scores */
-        for (int j = 0; j < num_db_images; j++) 
-            scores[j] = 0.0;
-
         unsigned char *keys;
         int num_keys;
 
         keys = ReadDescriptorFile(query_files[i].c_str(), dim, num_keys);
 
-        tree.ScoreQueryKeys(num_keys, /*i,*/ true, keys, scores);
+        tree.ScoreQueryKeys(num_keys, /*i,*/ true, keys, ctx);
 
         end = clock();
         printf("[VocabMatch] Scored image %s (%d keys) in %0.3fs\n", 
@@ -253,15 +258,9 @@ int main(int argc, char **argv)
 #endif
 
         /* Find the top scores */
-        for (int j = 0; j < num_db_images; j++) {
-            scores_d[j] = (double) scores[j];
-        }
-
-        qsort_descending();
-        qsort_perm(num_db_images, scores_d, perm);        
-        // assert(is_sorted(num_db_images, scores_d));
-
-        int top = MIN(num_nbrs+1, num_db_images);
+        int top = ctx.SelectTopK(num_nbrs+1);
+        double *scores_d = &(ctx.m_scores_d[0]);
+        int *perm = &(ctx.m_perm[0]);
 
         for (int j = 0; j < top; j++) {
             if (perm[j] == index_i)
@@ -277,9 +276,6 @@ int main(int argc, char **argv)
 
     fclose(f_match);
 
-    delete [] scores;
-    delete [] scores_d;
-    delete [] perm;
 
     return 0;
 }
@@ -51,7 +51,6 @@
 #include "keys2.h"
 
 #include "defines.h"
-#include "qsort.h"
 
 /* Read in a set of keys from a file 
  *
@@ -68,24 +67,12 @@
  */
 unsigned char *ReadKeys(const char *keyfile, int dim, int &num_keys_out)
 {
-    short int *keys;
-    keypt_t *info = NULL;
-    int num_keys = ReadKeyFile(keyfile, &keys, &info);
-    
-    unsigned char *keys_char = new unsigned char[num_keys * dim];
-        
-    for (int j = 0; j < num_keys * dim; j++) {
-        keys_char[j] = (unsigned char) keys[j];
-    }
-
-    delete [] keys;
-
-    if (info != NULL) 
-        delete [] info;
+    unsigned char *keys;
+    int num_keys = ReadKeyFile(keyfile, &keys);
 
     num_keys_out = num_keys;
 
-    return keys_char;
+    return keys;
 }
 
 int BasifyFilename(const char *filename, char *base)
@@ -162,6 +149,15 @@ unsigned char *ReadDescriptorFile(const char *desc_file, unsigned int dim,
         return NULL;
     }
 
+    if (IsBinaryKeyFile(f)) {
+        /* A binary key file; its keypoints are not needed */
+        unsigned char *desc;
+        num_keys_out = ReadKeysBinary(f, &desc);
+        fclose(f);
+
+        return desc;
+    }
+
     unsigned int num_points = 0;
     int nRead = fread(&num_points, sizeof(unsigned int), 1, f);
     assert(nRead == 1);
@@ -241,7 +237,11 @@ int main(int argc, char **argv)
 #endif
 
     tree.SetDistanceType(distance_type);
-    tree.SetInteriorNodeWeight(0, 0.0);
+
+    if (!tree.IsMapped())
+        tree.SetInteriorNodeWeight(0, 0.0);
+
+    tree.FreezeDatabase(tree.IsIncremental());
     
     /* Read the database keyfiles */
     FILE *f = fopen(db_in, "r");
@@ -289,9 +289,8 @@ int main(int argc, char **argv)
     PrintHTMLHeader(f_html, num_nbrs);
 #endif
 
-    float *scores = new float[num_db_images];
-    double *scores_d = new double[num_db_images];
-    int *perm = new int[num_db_images];
+    /* Per-query scratch state (scores and top-k buffers) */
+    VocabQueryContext ctx(num_db_images);
 
     FILE *f_match = fopen(matches_out, "w");
     if (f_match == NULL) {
@@ -303,16 +302,12 @@ int main(int argc, char **argv)
     for (int i = 0; i < num_query_images; i++) {
         start = clock();
 
-        /* Clear scores */
-        for (int j = 0; j < num_db_images; j++) 
-            scores[j] = 0.0;
-
         int num_keys = 0;
         unsigned char *keys = ReadDescriptorFile(query_files[i].c_str(), 
                                                  dim, num_keys);
 
         clock_t start_score = clock();
-        double mag = tree.ScoreQueryKeys(num_keys, normalize, keys, scores);
+        double mag = tree.ScoreQueryKeys(num_keys, normalize, keys, ctx);
         clock_t end_score = end = clock();
 
         printf("[VocabMatch] Scored image %s in %0.3fs "
@@ -322,14 +317,9 @@ int main(int argc, char **argv)
                (double) (end - start) / CLOCKS_PER_SEC, num_keys, mag);
 
         /* Find the top scores */
-        for (int j = 0; j < num_db_images; j++) {
-            scores_d[j] = (double) scores[j];
-        }
-
-        qsort_descending();
-        qsort_perm(num_db_images, scores_d, perm);        
-
-        int top = MIN(num_nbrs, num_db_images);
+        int top = ctx.SelectTopK(num_nbrs);
+        double *scores_d = &(ctx.m_scores_d[0]);
+        int *perm = &(ctx.m_perm[0]);
 
         for (int j = 0; j < top; j++) {
             // if (perm[j] == index_i)
@@ -357,9 +347,5 @@ int main(int argc, char **argv)
     fclose(f_html);
 #endif
 
-    delete [] scores;
-    delete [] scores_d;
-    delete [] perm;
-
     return 0;
 }
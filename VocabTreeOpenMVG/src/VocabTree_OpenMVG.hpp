@@ -12,14 +12,12 @@
 #include "third_party/stlplus3/filesystemSimplified/file_system.hpp"
 
 #include "VocabTree.h"
-#include "qsort.h"
 
 using namespace openMVG;
 using namespace openMVG::cameras;
 using namespace openMVG::sfm;
 using namespace openMVG::features;
 
-#define MAX_ARRAY_SIZE 8388608 // 2 ** 23
 
 void ExportKeypointsLoweSIFTtoFile(const SIFT_Regions* region_i,const std::string fname){
   ofstream sift_file;
@@ -128,65 +126,28 @@ void learnVocabularyTree(VocabTree &tree, std::shared_ptr<Regions_Provider> regi
   }
   //fflush(stdout);
 
-  unsigned long long len = (unsigned long long) total_keys * dim;
-  int num_arrays =
-      len / MAX_ARRAY_SIZE + ((len % MAX_ARRAY_SIZE) == 0 ? 0 : 1);
+  DescriptorSet descs;
+  if (descs.Allocate(total_keys, dim) != 0)
+    return;
 
-
-  unsigned char **vs = new unsigned char *[num_arrays];
-//  printf("Allocating %llu bytes in total, in %d arrays\n", len, num_arrays);
-
-  unsigned long long total = 0;
-  for (int i = 0; i < num_arrays; i++) {
-      unsigned long long remainder = len - total;
-      unsigned long len_curr = std::min<unsigned long long>(remainder, MAX_ARRAY_SIZE);
-//      printf("Allocating array of size %lu\n", len_curr);
-//      fflush(stdout);
-      vs[i] = new unsigned char[len_curr];
-      remainder -= len_curr;
-  }
-
-  /* Create the array of pointers */
-//  printf("Allocating pointer array of size %lu\n", 4 * total_keys);
-//  fflush(stdout);
-  unsigned char **vp = new unsigned char *[total_keys];
-
-  unsigned long off = 0;
   unsigned long curr_key = 0;
-  int curr_array = 0;
 
   C_Progress_display my_progress_bar( nb_imgs,
       std::cout, "\n- Copying keypoints -\n");
-      
-  
-  unsigned char *keys;
-  int num_keys = 0;
-  
+
   for (unsigned int i = 0; i < nb_imgs; i++) {
     const SIFT_Regions* region_i = dynamic_cast<SIFT_Regions*>(regions_provider->regions_per_view.at(i).get());
-    num_keys = readKeys(region_i,keys);
-
-    //ExportKeypointsLoweSIFT(region_i,vec_fileNames.at(i));
+    const int num_keys = region_i->GetRegionsPositions().size();
 
     if (num_keys > 0) {
-      for (int j = 0; j < num_keys; j++) {
-          std::memcpy((void*)(vs[curr_array]+off),(void*)(keys+(j*dim)),dim*sizeof(unsigned char));
-
-          vp[curr_key] = vs[curr_array] + off;
-          curr_key++;
-          off += dim;
-          if (off == MAX_ARRAY_SIZE) {
-              off = 0;
-              curr_array++;
-          }
-      }
-      delete [] keys;
+      std::memcpy((void*)descs.GetDescriptor(curr_key),(void*)region_i->DescriptorRawData(),num_keys*dim*sizeof(unsigned char));
+      curr_key += num_keys;
     }
     ++my_progress_bar;
   }
   std::cout<<"\n";
   std::cout<<"[VocabTree::Build] Start building tree"<<std::endl;
-  tree.Build(total_keys, dim, depth, bf, restarts, vp);
+  tree.Build(descs, depth, bf, restarts);
 }
 
 
@@ -249,13 +210,10 @@ void buildVocabularyDB(VocabTree &tree, const std::shared_ptr<Regions_Provider>
 }
 
 
-bool estimateMatch(VocabTree &tree, const unsigned int num_db_images, const bool normalize, unsigned char* keys, int num_keys, float *scores){
-  // Make sure the score is clear
-  for (unsigned int j = 0; j < num_db_images; j++)
-    scores[j] = 0.0;
-    
+bool estimateMatch(const VocabTree &tree, const bool normalize, unsigned char* keys, int num_keys, VocabQueryContext &ctx){
+  // The context resets the scores of the previous query itself
   if(num_keys>0){
-   tree.ScoreQueryKeys(num_keys, normalize, keys, scores);
+   tree.ScoreQueryKeys(num_keys, normalize, keys, ctx);
    return true;
    }
    return false;
@@ -266,10 +224,8 @@ bool estimateMatch(VocabTree &tree, const unsigned int num_db_images, const bool
 void findEstimatedPairs(VocabTree &tree,const bool normalize, const float min_match, const std::shared_ptr<Regions_Provider> regions_provider,Pair_Set &expected_pairs, float* score_matrix){
   
   const unsigned int num_db_images = regions_provider->regions_per_view.size();
-  // Prepare scores
-  float *scores = new float[num_db_images];
-  double *scores_d = new double[num_db_images];
-  int *perm = new int[num_db_images];
+  // Prepare scores and top-k buffers
+  VocabQueryContext ctx(num_db_images);
   unsigned char *keys;   
   // Loop through images and find matches  
   C_Progress_display my_progress_bar( num_db_images,
@@ -279,21 +235,16 @@ void findEstimatedPairs(VocabTree &tree,const bool normalize, const float min_ma
     int num_keys = readKeys(region_i,keys);
     
     if (num_keys>0){
-      if(estimateMatch(tree, num_db_images, normalize, keys, num_keys, scores)){
-        /* Sort and find the top scores */
-        for (unsigned int j = 0; j < num_db_images; j++) {
-          scores_d[j] = (double) scores[j];
-        }
-        
-        qsort_descending();
-        qsort_perm(num_db_images, scores_d, perm);
+      if(estimateMatch(tree, normalize, keys, num_keys, ctx)){
+        // Only images touched by the query can pass a positive threshold
+        int top = ctx.SelectTopK(min_match > 0.0 ? (int) ctx.m_touched.size() : (int) num_db_images);
 
         // Image i has similarity to image perm[j] in score_d[j]    
-        for(unsigned int j=0; j<num_db_images;j++){
-          if(scores_d[j]<min_match)
+        for(int j=0; j<top;j++){
+          if(ctx.m_scores_d[j]<min_match)
             break;
-          if((int)i<perm[j]){
-            expected_pairs.insert(std::make_pair(i,perm[j]));
+          if((int)i<ctx.m_perm[j]){
+            expected_pairs.insert(std::make_pair(i,ctx.m_perm[j]));
 //            expected_pairs.emplace_back(std::pair<IndexT,IndexT>(i,perm[j]));
           }
         }
@@ -301,7 +252,7 @@ void findEstimatedPairs(VocabTree &tree,const bool normalize, const float min_ma
         // Save results to score matrix        
         if(score_matrix!=NULL){
           for(unsigned int j=0; j<num_db_images;j++){
-            score_matrix[i*num_db_images + j] = scores[j]; 
+            score_matrix[i*num_db_images + j] = ctx.m_scores[j]; 
           }
         }
         
@@ -311,16 +262,13 @@ void findEstimatedPairs(VocabTree &tree,const bool normalize, const float min_ma
     ++my_progress_bar;    
   }
   std::cout<<"\n";
-  
-  delete [] scores;
-  delete [] scores_d;
-  delete [] perm;   
 }
 
 void prepareDBForQuery(VocabTree &tree, DistanceType &query_distance_type){
   tree.Flatten();
   tree.SetDistanceType(query_distance_type);
   tree.SetInteriorNodeWeight(0, 0.0);
+  tree.FreezeDatabase();
 }
 
 
@@ -780,6 +780,9 @@ public:
 								
 	virtual void getStats(				// compute tree statistics
 		ANNkdStats&		st);			// the statistics (modified)
+
+										// refit tree to moved points
+	ANNbool Refit();					// (ANNfalse: tree must be rebuilt)
 };								
 
 //----------------------------------------------------------------------
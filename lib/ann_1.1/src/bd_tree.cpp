@@ -94,6 +94,29 @@ void ANNbd_shrink::getStats(					// get subtree statistics
 	st.n_shr++;									// increment number of shrinks
 }
 
+//----------------------------------------------------------------------
+//	extent and refit
+//		The shrinking boxes are not refitted, so a bd-tree must be
+//		rebuilt when its points move (see kd_tree.cpp).
+//----------------------------------------------------------------------
+
+void ANNbd_shrink::extent(						// extent of subtree points
+	ANNpointArray		pa,						// point array
+	int					d,						// dimension
+	ANNcoord			&lo,					// low value (modified)
+	ANNcoord			&hi)					// high value (modified)
+{
+	child[ANN_IN]->extent(pa, d, lo, hi);
+	child[ANN_OUT]->extent(pa, d, lo, hi);
+}
+
+ANNbool ANNbd_shrink::refit(					// cannot refit
+	ANNpointArray		pa,						// point array
+	ANNorthRect			&bnd_box)				// bounding box
+{
+	return ANNfalse;
+}
+
 //----------------------------------------------------------------------
 // bd-tree constructor
 //		This is the main constructor for bd-trees given a set of points.
@@ -91,6 +91,8 @@ public:
 				ANNorthRect &bnd_box);			// bounding box
 	virtual void print(int level, ostream &out);// print node
 	virtual void dump(ostream &out);			// dump node
+	virtual void extent(ANNpointArray pa, int d, ANNcoord &lo, ANNcoord &hi);
+	virtual ANNbool refit(ANNpointArray pa, ANNorthRect &bnd_box);
 
 	virtual void ann_search(ANNdist);			// standard search
     virtual void ann_pri_search(ANNdist, ANNprTempStore&);		// priority search
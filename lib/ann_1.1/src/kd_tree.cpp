@@ -182,6 +182,104 @@ void ANNkd_split::getStats(						// get subtree statistics
 	st.n_spl++;									// increment number of splits
 }
 
+//----------------------------------------------------------------------
+//	extent and refit
+//		When the points of a tree have moved a little (as the means
+//		do between rounds of k-means), refit keeps the structure of
+//		the tree (the cutting dimensions and the buckets) and only
+//		moves the cutting planes.  A cut remains valid as long as
+//		no point on its low side lies above a point on its high
+//		side; the cut is then clamped into that gap, and the cell
+//		bounds are recomputed from the new cuts.  If some cut is no
+//		longer valid, refit returns ANNfalse and the tree must be
+//		rebuilt.
+//----------------------------------------------------------------------
+
+void ANNkd_leaf::extent(						// extent of bucket points
+	ANNpointArray		pa,						// point array
+	int					d,						// dimension
+	ANNcoord			&lo,					// low value (modified)
+	ANNcoord			&hi)					// high value (modified)
+{
+	for (int i = 0; i < n_pts; i++) {
+		ANNcoord c = pa[bkt[i]][d];
+		if (c < lo) lo = c;
+		if (c > hi) hi = c;
+	}
+}
+
+ANNbool ANNkd_leaf::refit(						// nothing to refit
+	ANNpointArray		pa,						// point array
+	ANNorthRect			&bnd_box)				// bounding box
+{
+	return ANNtrue;
+}
+
+void ANNkd_split::extent(						// extent of subtree points
+	ANNpointArray		pa,						// point array
+	int					d,						// dimension
+	ANNcoord			&lo,					// low value (modified)
+	ANNcoord			&hi)					// high value (modified)
+{
+	child[ANN_LO]->extent(pa, d, lo, hi);
+	child[ANN_HI]->extent(pa, d, lo, hi);
+}
+
+ANNbool ANNkd_split::refit(						// refit cut to moved points
+	ANNpointArray		pa,						// point array
+	ANNorthRect			&bnd_box)				// bounding box
+{
+	ANNcoord lv = bnd_box.lo[cut_dim];			// bounds of the cell
+	ANNcoord hv = bnd_box.hi[cut_dim];
+												// highest point on low side
+	ANNcoord lo_min = hv, lo_max = lv;
+	child[ANN_LO]->extent(pa, cut_dim, lo_min, lo_max);
+												// lowest point on high side
+	ANNcoord hi_min = hv, hi_max = lv;
+	child[ANN_HI]->extent(pa, cut_dim, hi_min, hi_max);
+
+	if (lo_max > hi_min) return ANNfalse;		// sides overlap
+
+	if (cut_val < lo_max) cut_val = lo_max;		// clamp cut into the gap
+	if (cut_val > hi_min) cut_val = hi_min;
+
+	cd_bnds[ANN_LO] = lv;						// save bounds for cutting dim
+	cd_bnds[ANN_HI] = hv;
+
+	bnd_box.hi[cut_dim] = cut_val;				// refit low child
+	ANNbool ok = child[ANN_LO]->refit(pa, bnd_box);
+	bnd_box.hi[cut_dim] = hv;
+
+	if (ok) {
+		bnd_box.lo[cut_dim] = cut_val;			// refit high child
+		ok = child[ANN_HI]->refit(pa, bnd_box);
+		bnd_box.lo[cut_dim] = lv;
+	}
+
+	return ok;
+}
+
+//----------------------------------------------------------------------
+//	Refit
+//		Refit the tree after the points in the point array have
+//		moved.  Returns ANNfalse (and leaves the tree unusable) if
+//		the structure no longer fits the points.
+//----------------------------------------------------------------------
+
+ANNbool ANNkd_tree::Refit()
+{
+	if (root == NULL || n_pts == 0) return ANNtrue;
+
+	ANNorthRect bnd_box(dim);					// new bounding box
+	annEnclRect(pts, pidx, n_pts, dim, bnd_box);
+	for (int d = 0; d < dim; d++) {
+		bnd_box_lo[d] = bnd_box.lo[d];
+		bnd_box_hi[d] = bnd_box.hi[d];
+	}
+
+	return root->refit(pts, bnd_box);
+}
+
 //----------------------------------------------------------------------
 //	getStats
 //		Collects a number of statistics related to kd_tree or
@@ -309,8 +407,15 @@ ANNkd_tree::ANNkd_tree(					// basic constructor
 //		This procedure selects a cutting dimension and cutting value,
 //		partitions pa about these values, and returns the number of
 //		points on the low side of the cut.
+//
+//		Subtrees of at least ANN_TASK_PTS points are split off as
+//		OpenMP tasks, so large trees are built in parallel.  Each
+//		task works on its own part of pidx, and the resulting tree
+//		does not depend on the number of threads.
 //----------------------------------------------------------------------
 
+const int ANN_TASK_PTS = 4096;			// min points for a build task
+
 ANNkd_ptr rkd_tree(				// recursive construction of kd-tree
 	ANNpointArray		pa,				// point array
 	ANNidxArray			pidx,			// point indices to store in subtree
@@ -338,6 +443,19 @@ ANNkd_ptr rkd_tree(				// recursive construction of kd-tree
 		ANNcoord lv = bnd_box.lo[cd];	// save bounds for cutting dimension
 		ANNcoord hv = bnd_box.hi[cd];
 
+		if (n >= ANN_TASK_PTS) {		// large: build left subtree as a task
+			ANNorthRect lo_box(dim, bnd_box);
+			lo_box.hi[cd] = cv;
+#pragma omp task shared(lo, lo_box)
+			lo = rkd_tree(pa, pidx, n_lo, dim, bsp, lo_box, splitter);
+
+			bnd_box.lo[cd] = cv;		// build right subtree meanwhile
+			hi = rkd_tree(pa, pidx + n_lo, n-n_lo, dim, bsp, bnd_box, splitter);
+			bnd_box.lo[cd] = lv;
+#pragma omp taskwait
+			return new ANNkd_split(cd, cv, lv, hv, lo, hi);
+		}
+
 		bnd_box.hi[cd] = cv;			// modify bounds for left subtree
 		lo = rkd_tree(					// build left subtree
 				pa, pidx, n_lo,			// ...from pidx[0..n_lo-1]
@@ -382,24 +500,30 @@ ANNkd_tree::ANNkd_tree(					// construct from point array
 	bnd_box_lo = annCopyPt(dd, bnd_box.lo);
 	bnd_box_hi = annCopyPt(dd, bnd_box.hi);
 
+	ANNkd_splitter splitter = NULL;
 	switch (split) {					// build by rule
 	case ANN_KD_STD:					// standard kd-splitting rule
-		root = rkd_tree(pa, pidx, n, dd, bs, bnd_box, kd_split);
+		splitter = kd_split;
 		break;
 	case ANN_KD_MIDPT:					// midpoint split
-		root = rkd_tree(pa, pidx, n, dd, bs, bnd_box, midpt_split);
+		splitter = midpt_split;
 		break;
 	case ANN_KD_FAIR:					// fair split
-		root = rkd_tree(pa, pidx, n, dd, bs, bnd_box, fair_split);
+		splitter = fair_split;
 		break;
 	case ANN_KD_SUGGEST:				// best (in our opinion)
 	case ANN_KD_SL_MIDPT:				// sliding midpoint split
-		root = rkd_tree(pa, pidx, n, dd, bs, bnd_box, sl_midpt_split);
+		splitter = sl_midpt_split;
 		break;
 	case ANN_KD_SL_FAIR:				// sliding fair split
-		root = rkd_tree(pa, pidx, n, dd, bs, bnd_box, sl_fair_split);
+		splitter = sl_fair_split;
 		break;
 	default:
 		annError("Illegal splitting method", ANNabort);
 	}
+										// large subtrees are built
+										// as parallel tasks
+#pragma omp parallel if (n >= ANN_TASK_PTS)
+#pragma omp single
+	root = rkd_tree(pa, pidx, n, dd, bs, bnd_box, splitter);
 }
@@ -61,6 +61,15 @@ public:
 	virtual void print(int level, ostream &out) = 0;
 	virtual void dump(ostream &out) = 0;		// dump node
 
+	virtual void extent(						// extend [lo,hi] to cover
+				ANNpointArray pa,				// the points in the subtree
+				int d,							// along dimension d
+				ANNcoord &lo,					// low value (modified)
+				ANNcoord &hi) = 0;				// high value (modified)
+	virtual ANNbool refit(						// refit to moved points
+				ANNpointArray pa,				// point array
+				ANNorthRect &bnd_box) = 0;		// bounding box of cell
+
 	friend class ANNkd_tree;					// allow kd-tree to access us
 };
 
@@ -111,6 +120,8 @@ public:
 				ANNorthRect &bnd_box);			// bounding box
 	virtual void print(int level, ostream &out);// print node
 	virtual void dump(ostream &out);			// dump node
+	virtual void extent(ANNpointArray pa, int d, ANNcoord &lo, ANNcoord &hi);
+	virtual ANNbool refit(ANNpointArray pa, ANNorthRect &bnd_box);
 
 	virtual void ann_search(ANNdist);			// standard search
 	virtual void ann_pri_search(ANNdist, ANNprTempStore&);		// priority search
@@ -177,6 +188,8 @@ public:
 				ANNorthRect &bnd_box);			// bounding box
 	virtual void print(int level, ostream &out);// print node
 	virtual void dump(ostream &out);			// dump node
+	virtual void extent(ANNpointArray pa, int d, ANNcoord &lo, ANNcoord &hi);
+	virtual ANNbool refit(ANNpointArray pa, ANNorthRect &bnd_box);
 
 	virtual void ann_search(ANNdist);			// standard search
 	virtual void ann_pri_search(ANNdist, ANNprTempStore&);		// priority search
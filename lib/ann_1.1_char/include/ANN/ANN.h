@@ -836,6 +836,41 @@ DLL_API void annMaxPtsVisit(	// max. pts to visit in search
 	int				maxPts);	// the limit
 
 DLL_API void annClose();		// called to end use of ANN
+
+//----------------------------------------------------------------------
+//	Squared distance kernels
+//	annDistSq			Squared distance between two points.
+//	annDistSqMany		Squared distances from q to n points stored
+//						one after another (dim coordinates each).
+//	annNearestPt		Index of the first of n contiguous points that
+//						is nearest to q, and its squared distance.
+//	annDistKernelName	Name of the kernel selected for this CPU
+//						("scalar", "sse2", "avx2" or "avx512").
+//
+//	SIMD versions of these are selected at run time; all of them
+//	compute exact distances.
+//----------------------------------------------------------------------
+
+DLL_API ANNdist annDistSq(		// squared distance between points
+	int				dim,		// dimension of space
+	const ANNcoord*	a,			// points
+	const ANNcoord*	b);
+
+DLL_API void annDistSqMany(		// squared distances from q to n points
+	int				dim,		// dimension of space
+	const ANNcoord*	q,			// query point
+	const ANNcoord*	pts,		// n points, stored contiguously
+	int				n,			// number of points
+	ANNdist*		dists);		// distances (returned)
+
+DLL_API int annNearestPt(		// nearest of n points to q
+	int				dim,		// dimension of space
+	const ANNcoord*	q,			// query point
+	const ANNcoord*	pts,		// n points, stored contiguously
+	int				n,			// number of points
+	ANNdist&		dist_out);	// distance to nearest (returned)
+
+DLL_API const char* annDistKernelName();
     
 }
 
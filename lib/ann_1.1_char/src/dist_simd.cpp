@@ -0,0 +1,253 @@
+//----------------------------------------------------------------------
+// File:			dist_simd.cpp
+// Description:		Squared distance kernels for unsigned char points
+//----------------------------------------------------------------------
+// Added for the unsigned char version of ANN.  The squared Euclidean
+// distance between points is computed with SSE2, AVX2 or AVX-512BW
+// instructions when the CPU supports them; the kernel is chosen once,
+// at startup.  All kernels compute the exact integer distance, so the
+// results do not depend on the kernel used.
+//----------------------------------------------------------------------
+
+#include <ANN/ANN.h>					// all ANN includes
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ANN_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace ann_1_1_char;
+
+typedef ANNdist (*ANNdistFn)(int, const ANNcoord *, const ANNcoord *);
+typedef void (*ANNdistManyFn)(int, const ANNcoord *, const ANNcoord *, 
+							  int, ANNdist *);
+
+//----------------------------------------------------------------------
+//	Portable version
+//----------------------------------------------------------------------
+
+static inline ANNdist distSqScalar(
+	int					dim,			// dimension
+	const ANNcoord*		a,				// points
+	const ANNcoord*		b)
+{
+	ANNdist dist = 0;
+	for (int d = 0; d < dim; d++) {
+		ANNdist t = (ANNdist) a[d] - (ANNdist) b[d];
+		dist = ANN_SUM(dist, ANN_POW(t));
+	}
+	return dist;
+}
+
+static void distSqManyScalar(int dim, const ANNcoord* q, const ANNcoord* pts,
+							 int n, ANNdist* dists)
+{
+	for (int i = 0; i < n; i++)
+		dists[i] = distSqScalar(dim, q, pts + (long) i * dim);
+}
+
+#ifdef ANN_X86_SIMD
+//----------------------------------------------------------------------
+//	SIMD versions.  Each computes |a - b| on bytes with two saturating
+//	subtractions, widens to 16 bits, and squares and sums adjacent
+//	pairs into 32-bit lanes with madd.
+//----------------------------------------------------------------------
+
+__attribute__((target("sse2")))
+static inline ANNdist distSqSSE2(int dim, const ANNcoord* a, 
+								 const ANNcoord* b)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	int d = 0;
+
+	for (; d + 16 <= dim; d += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *) (a + d));
+		__m128i vb = _mm_loadu_si128((const __m128i *) (b + d));
+		__m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), 
+									_mm_subs_epu8(vb, va));
+		__m128i lo = _mm_unpacklo_epi8(diff, zero);
+		__m128i hi = _mm_unpackhi_epi8(diff, zero);
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+	}
+
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1,0,3,2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2,3,0,1)));
+	ANNdist dist = _mm_cvtsi128_si32(acc);
+
+	return dist + distSqScalar(dim - d, a + d, b + d);
+}
+
+__attribute__((target("sse2")))
+static void distSqManySSE2(int dim, const ANNcoord* q, const ANNcoord* pts,
+						   int n, ANNdist* dists)
+{
+	for (int i = 0; i < n; i++)
+		dists[i] = distSqSSE2(dim, q, pts + (long) i * dim);
+}
+
+__attribute__((target("avx2")))
+static inline ANNdist distSqAVX2(int dim, const ANNcoord* a, 
+								 const ANNcoord* b)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = zero;
+	int d = 0;
+
+	for (; d + 32 <= dim; d += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i *) (a + d));
+		__m256i vb = _mm256_loadu_si256((const __m256i *) (b + d));
+		__m256i diff = _mm256_or_si256(_mm256_subs_epu8(va, vb), 
+									   _mm256_subs_epu8(vb, va));
+		__m256i lo = _mm256_unpacklo_epi8(diff, zero);
+		__m256i hi = _mm256_unpackhi_epi8(diff, zero);
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, lo));
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(hi, hi));
+	}
+
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), 
+								_mm256_extracti128_si256(acc, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1,0,3,2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2,3,0,1)));
+	ANNdist dist = _mm_cvtsi128_si32(sum);
+
+	return dist + distSqScalar(dim - d, a + d, b + d);
+}
+
+__attribute__((target("avx2")))
+static void distSqManyAVX2(int dim, const ANNcoord* q, const ANNcoord* pts,
+						   int n, ANNdist* dists)
+{
+	for (int i = 0; i < n; i++)
+		dists[i] = distSqAVX2(dim, q, pts + (long) i * dim);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline ANNdist distSqAVX512(int dim, const ANNcoord* a, 
+								   const ANNcoord* b)
+{
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i acc = zero;
+	int d = 0;
+
+	for (; d + 64 <= dim; d += 64) {
+		__m512i va = _mm512_loadu_si512((const void *) (a + d));
+		__m512i vb = _mm512_loadu_si512((const void *) (b + d));
+		__m512i diff = _mm512_or_si512(_mm512_subs_epu8(va, vb), 
+									   _mm512_subs_epu8(vb, va));
+		__m512i lo = _mm512_unpacklo_epi8(diff, zero);
+		__m512i hi = _mm512_unpackhi_epi8(diff, zero);
+		acc = _mm512_add_epi32(acc, _mm512_madd_epi16(lo, lo));
+		acc = _mm512_add_epi32(acc, _mm512_madd_epi16(hi, hi));
+	}
+
+	ANNdist dist = _mm512_reduce_add_epi32(acc);
+
+	return dist + distSqScalar(dim - d, a + d, b + d);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void distSqManyAVX512(int dim, const ANNcoord* q, 
+							 const ANNcoord* pts, int n, ANNdist* dists)
+{
+	for (int i = 0; i < n; i++)
+		dists[i] = distSqAVX512(dim, q, pts + (long) i * dim);
+}
+#endif // ANN_X86_SIMD
+
+//----------------------------------------------------------------------
+//	Run-time dispatch
+//----------------------------------------------------------------------
+
+static ANNdist distSqScalarFn(int dim, const ANNcoord* a, const ANNcoord* b)
+{
+	return distSqScalar(dim, a, b);
+}
+
+typedef struct {
+	const char*		name;
+	ANNdistFn		dist;
+	ANNdistManyFn	distMany;
+} ANNdistKernel;
+
+static ANNdistKernel annSelectDistKernel()
+{
+	ANNdistKernel k = { "scalar", distSqScalarFn, distSqManyScalar };
+
+#ifdef ANN_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw")) {
+		ANNdistKernel k512 = { "avx512", distSqAVX512, distSqManyAVX512 };
+		k = k512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		ANNdistKernel k256 = { "avx2", distSqAVX2, distSqManyAVX2 };
+		k = k256;
+	} else if (__builtin_cpu_supports("sse2")) {
+		ANNdistKernel k128 = { "sse2", distSqSSE2, distSqManySSE2 };
+		k = k128;
+	}
+#endif
+
+	return k;
+}
+
+//	The kernel is chosen on first use rather than by a static
+//	initializer, so that callers in other translation units' static
+//	initializers never see an empty table.
+static const ANNdistKernel& annDistKernel()
+{
+	static const ANNdistKernel k = annSelectDistKernel();
+	return k;
+}
+
+ANNdist ann_1_1_char::annDistSq(
+	int					dim,			// dimension of space
+	const ANNcoord*		a,				// points
+	const ANNcoord*		b)
+{
+	return annDistKernel().dist(dim, a, b);
+}
+
+void ann_1_1_char::annDistSqMany(
+	int					dim,			// dimension of space
+	const ANNcoord*		q,				// query point
+	const ANNcoord*		pts,			// n points, stored contiguously
+	int					n,				// number of points
+	ANNdist*			dists)			// distances (returned)
+{
+	annDistKernel().distMany(dim, q, pts, n, dists);
+}
+
+int ann_1_1_char::annNearestPt(
+	int					dim,			// dimension of space
+	const ANNcoord*		q,				// query point
+	const ANNcoord*		pts,			// n points, stored contiguously
+	int					n,				// number of points
+	ANNdist&			dist_out)		// distance to nearest (returned)
+{
+	const int block = 64;				// points per call to the kernel
+	ANNdist dists[block];
+	ANNdist min_dist = ANN_DIST_INF;
+	int best = 0;
+
+	for (int i = 0; i < n; i += block) {
+		int m = (n - i < block) ? n - i : block;
+		annDistKernel().distMany(dim, q, pts + (long) i * dim, m, dists);
+
+		for (int j = 0; j < m; j++) {
+			if (dists[j] < min_dist) {	// first of any ties wins
+				min_dist = dists[j];
+				best = i + j;
+			}
+		}
+	}
+
+	dist_out = min_dist;
+	return best;
+}
+
+const char* ann_1_1_char::annDistKernelName()
+{
+	return annDistKernel().name;
+}
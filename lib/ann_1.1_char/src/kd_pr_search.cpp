@@ -190,33 +190,17 @@ void ANNkd_split::ann_pri_search(ANNdist box_dist, ANNprTempStore &store)
 
 void ANNkd_leaf::ann_pri_search(ANNdist box_dist, ANNprTempStore &store)
 {
-	register ANNdist dist;				// distance to data point
-	register ANNcoord* pp;				// data coordinate pointer
-	register ANNcoord* qq;				// query coordinate pointer
-	register ANNdist min_dist;			// distance to k-th closest point
-	register ANNdist t;
-	register int d;
+	ANNdist dist;						// distance to data point
+	ANNdist min_dist;					// distance to k-th closest point
 
 	min_dist = store.ANNprPointMK->max_key(); // k-th smallest distance so far
 
 	for (int i = 0; i < n_pts; i++) {	// check points in bucket
+										// full distance (SIMD kernel)
+		dist = annDistSq(store.ANNprDim, store.ANNprQ, store.ANNprPts[bkt[i]]);
+		ANN_COORD(store.ANNprDim)					// coordinates hit
 
-		pp = store.ANNprPts[bkt[i]];			// first coord of next data point
-		qq = store.ANNprQ;					// first coord of query point
-		dist = 0;
-
-		for(d = 0; d < store.ANNprDim; d++) {
-			ANN_COORD(1)				// one more coordinate hit
-			ANN_FLOP(4)					// increment floating ops
-
-                            t = (ANNdist) *(qq++) - (ANNdist) *(pp++);		// compute length and adv coordinate
-										// exceeds dist to k-th smallest?
-			if( (dist = ANN_SUM(dist, ANN_POW(t))) > min_dist) {
-				break;
-			}
-		}
-
-		if (d >= store.ANNprDim &&					// among the k best?
+		if (dist <= min_dist &&			// among the k best?
 		   (ANN_ALLOW_SELF_MATCH || dist!=0)) { // and no self-match problem
 												// add it to the list
 			store.ANNprPointMK->insert(dist, bkt[i]);
@@ -0,0 +1,136 @@
+/* VocabBenchBuild.cpp */
+/* Benchmark for vocabulary tree construction on synthetic features */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <omp.h>
+
+#include "VocabTree.h"
+
+/* Fill descs with points scattered around num_centers random centers */
+static void make_features(DescriptorSet &descs, int num_centers)
+{
+    int dim = descs.m_dim;
+    unsigned char *centers = new unsigned char[num_centers * dim];
+
+    for (int i = 0; i < num_centers * dim; i++)
+        centers[i] = rand() % 128;
+
+    for (unsigned int i = 0; i < descs.m_num_descriptors; i++) {
+        const unsigned char *c = centers + (rand() % num_centers) * dim;
+        unsigned char *v = descs.GetDescriptor(i);
+
+        for (int j = 0; j < dim; j++) {
+            int x = c[j] + rand() % 33 - 16;
+            v[j] = (unsigned char) (x < 0 ? 0 : (x > 255 ? 255 : x));
+        }
+    }
+
+    delete [] centers;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4 || argc > 6) {
+        printf("Usage: %s <num_features> <depth> <branching_factor> "
+               "[restarts:1] [seed:1]\n", argv[0]);
+        return 1;
+    }
+
+    int n = atoi(argv[1]);
+    int depth = atoi(argv[2]);
+    int bf = atoi(argv[3]);
+    int restarts = 1;
+    unsigned int seed = 1;
+
+    if (argc >= 5)
+        restarts = atoi(argv[4]);
+
+    if (argc >= 6)
+        seed = (unsigned int) atoi(argv[5]);
+
+    if (n <= bf || bf < 2) {
+        printf("Error: need at least 2 clusters and more features "
+               "than clusters\n");
+        return 1;
+    }
+
+    srand(seed);
+
+    const int dim = 128;
+    DescriptorSet descs;
+    if (descs.Allocate(n, dim) != 0)
+        return 1;
+
+    printf("[VocabBenchBuild] Generating %d features\n", n);
+    fflush(stdout);
+
+    make_features(descs, 4 * bf);
+
+    /* Partitioning one node's points into bf children */
+    unsigned int *idx = new unsigned int[n];
+    unsigned int *clustering = new unsigned int[n];
+    unsigned int *labels = new unsigned int[n];
+
+    for (int i = 0; i < n; i++)
+        labels[i] = rand() % bf;
+
+    for (int i = 0; i < n; i++) {
+        idx[i] = i;
+        clustering[i] = labels[i];
+    }
+
+    double start = omp_get_wtime();
+    partition_by_cluster_passes(n, bf, idx, clustering);
+    double legacy_time = omp_get_wtime() - start;
+
+    for (int i = 0; i < n; i++) {
+        idx[i] = i;
+        clustering[i] = labels[i];
+    }
+
+    start = omp_get_wtime();
+    partition_by_cluster(n, bf, idx, clustering);
+    double partition_time = omp_get_wtime() - start;
+
+    printf("[VocabBenchBuild] Partitioning %d points into %d clusters:\n",
+           n, bf);
+    printf("[VocabBenchBuild]   per-cluster passes:  %0.3fs\n", legacy_time);
+    printf("[VocabBenchBuild]   counting sort:       %0.3fs "
+           "(%d threads)\n", partition_time, omp_get_max_threads());
+    fflush(stdout);
+
+    delete [] idx;
+    delete [] clustering;
+    delete [] labels;
+
+    /* Full builds with each partition; Build reports the time spent
+     * on each level.  The per-cluster passes don't keep the order of
+     * the points, so the two trees (and k-means times) can differ
+     * slightly. */
+    const char *names[2] = { "per-cluster passes", "counting sort" };
+    KMeansPartition partitions[2] = 
+        { partition_by_cluster_passes, partition_by_cluster };
+    double build_time[2];
+
+    for (int i = 0; i < 2; i++) {
+        printf("[VocabBenchBuild] Building with %s\n", names[i]);
+        fflush(stdout);
+
+        srand(seed);
+
+        VocabTree tree;
+        start = omp_get_wtime();
+        tree.Build(descs, depth, bf, restarts, KMeansInitRandom, 
+                   KMeansAssignKdTree, NULL, partitions[i]);
+        build_time[i] = omp_get_wtime() - start;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        printf("[VocabBenchBuild] Build with %s took %0.3fs\n", 
+               names[i], build_time[i]);
+    }
+
+    return 0;
+}
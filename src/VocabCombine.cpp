@@ -35,7 +35,9 @@ int main(int argc, char **argv)
 
         VocabTree tree_add;
         tree_add.Read(argv[i+1]);
-        tree.Combine(tree_add);
+        if (tree.Combine(tree_add) != 0)
+            return 1;
+
         tree_add.Clear();
     }
 
@@ -43,8 +45,14 @@ int main(int argc, char **argv)
     // if (use_tfidf)
     int total_num_db_images = tree.GetMaxDatabaseImageIndex() + 1;
     printf("Total num_db_images: %d\n", total_num_db_images);
-    tree.ComputeTFIDFWeights(total_num_db_images);
-    tree.NormalizeDatabase(0, total_num_db_images);
+    if (tree.IsIncremental()) {
+        /* Recompute the weights from the raw counts */
+        tree.UpdateWeights();
+    } else {
+        tree.ComputeTFIDFWeights(total_num_db_images);
+        tree.NormalizeDatabase(0, total_num_db_images);
+    }
+
     tree.Write(tree_out);
 
     /* Write vectors to a file */
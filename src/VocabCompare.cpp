@@ -11,6 +11,7 @@
 
 #include "keys2.h"
 #include "VocabTree.h"
+#include "VocabWordCache.h"
 
 /* Read in a set of keys from a file 
  *
@@ -27,32 +28,73 @@
  */
 unsigned char *ReadKeys(const char *keyfile, int dim, int &num_keys_out)
 {
-    short int *keys;
-    keypt_t *info = NULL;
-    int num_keys = ReadKeyFile(keyfile, &keys, &info);
-    
-    unsigned char *keys_char = new unsigned char[num_keys * dim];
-        
-    for (int j = 0; j < num_keys * dim; j++) {
-        keys_char[j] = (unsigned char) keys[j];
+    unsigned char *keys;
+    int num_keys = ReadKeyFile(keyfile, &keys);
+
+    num_keys_out = num_keys;
+
+    return keys;
+}
+
+/* Take the --bow-cache flag out of argv, leaving the positional
+ * arguments */
+static bool parse_cache_option(int &argc, char **argv)
+{
+    bool use_cache = false;
+    int argc_out = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bow-cache") == 0)
+            use_cache = true;
+        else
+            argv[argc_out++] = argv[i];
+    }
+
+    argc = argc_out;
+    return use_cache;
+}
+
+/* Add a key file to the database, storing the word of each key in
+ * ids, and return the number of keys */
+static int AddKeyFile(VocabTree &tree, int index, const char *keyfile,
+                      bool use_cache, unsigned int cache_checksum,
+                      std::vector<unsigned long> &ids)
+{
+    if (use_cache) {
+        ImageWords cached;
+        cached.ReadOrQuantize(tree, cache_checksum, keyfile);
+        int num_keys = cached.Select(0.0, 0, ids);
+
+        tree.AddWordsToDatabase(index, ids);
+        return num_keys;
     }
 
-    delete [] keys;
+    int num_keys = 0;
+    unsigned char *keys = ReadKeys(keyfile, 128, num_keys);
 
-    if (info != NULL) 
-        delete [] info;
+    ids.resize(num_keys);
+    tree.AddImageToDatabase(index, num_keys, keys, 
+                            num_keys > 0 ? &(ids[0]) : NULL);
 
-    num_keys_out = num_keys;
+    if (num_keys > 0)
+        delete [] keys;
 
-    return keys_char;
+    return num_keys;
 }
 
 int main(int argc, char **argv) 
 {
+    bool use_cache = parse_cache_option(argc, argv);
+
     if (argc != 5 && argc != 6) {
         printf("Usage: %s <tree.in> <image1.key> <image2.key> <matches.out> "
-               "[distance_type]\n", 
+               "[distance_type] [--bow-cache]\n", 
                argv[0]);
+        printf("  --bow-cache: take the words of each image from its "
+               "word cache\n"
+               "               (<file>.<checksum>.bow) if one was written "
+               "for this tree,\n"
+               "               and write it otherwise\n");
 
         return 1;
     }
@@ -93,28 +135,18 @@ int main(int argc, char **argv)
     /* Initialize leaf weights to 1.0 */
     tree.SetConstantLeafWeights();
 
-    const int dim = 128;
-
     tree.ClearDatabase();
 
-    int num_keys_1 = 0, num_keys_2 = 0;
-    unsigned char *keys1 = ReadKeys(image1_in, dim, num_keys_1);
-    unsigned char *keys2 = ReadKeys(image2_in, dim, num_keys_2);
-
-    unsigned long *ids1 = new unsigned long[num_keys_1];
-    unsigned long *ids2 = new unsigned long[num_keys_2];
-
-    printf("[VocabCompare] Adding image 0 (%d keys)\n", num_keys_1);
-    tree.AddImageToDatabase(0, num_keys_1, keys1, ids1);
-
-    printf("[VocabCompare] Adding image 1 (%d keys)\n", num_keys_2);
-    tree.AddImageToDatabase(1, num_keys_2, keys2, ids2);
+    unsigned int cache_checksum = use_cache ? tree.Checksum() : 0;
 
-    if (num_keys_1 > 0) 
-        delete [] keys1;
+    std::vector<unsigned long> ids1, ids2;
+    int num_keys_1 = AddKeyFile(tree, 0, image1_in, use_cache, 
+                                cache_checksum, ids1);
+    printf("[VocabCompare] Added image 0 (%d keys)\n", num_keys_1);
 
-    if (num_keys_2 > 0)
-        delete [] keys2;
+    int num_keys_2 = AddKeyFile(tree, 1, image2_in, use_cache, 
+                                cache_checksum, ids2);
+    printf("[VocabCompare] Added image 1 (%d keys)\n", num_keys_2);
 
     // tree.ComputeTFIDFWeights();
     tree.NormalizeDatabase(0, 2);
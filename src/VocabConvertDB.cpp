@@ -0,0 +1,42 @@
+/* VocabConvertDB.cpp */
+/* Driver for converting a database to the mapped (VTDB) format */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "VocabTree.h"
+
+int main(int argc, char **argv) 
+{
+    if (argc != 3) {
+        printf("Usage: %s <db.in> <db.out>\n", argv[0]);
+        return 1;
+    }
+
+    char *db_in = argv[1];
+    char *db_out = argv[2];
+
+    printf("[VocabConvertDB] Reading database %s...\n", db_in);
+    fflush(stdout);
+
+    VocabTree tree;
+    if (tree.Read(db_in) != 0)
+        return 1;
+
+    if (tree.IsMapped()) {
+        printf("[VocabConvertDB] %s is already in the mapped format\n", 
+               db_in);
+        return 1;
+    }
+
+    /* An incremental database becomes a raw mapped database */
+    tree.FreezeDatabase(tree.IsIncremental());
+
+    printf("[VocabConvertDB] Writing mapped database %s...\n", db_out);
+    fflush(stdout);
+
+    if (tree.WriteMapped(db_out) != 0)
+        return 1;
+
+    return 0;
+}
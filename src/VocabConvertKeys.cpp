@@ -0,0 +1,106 @@
+/* VocabConvertKeys.cpp */
+/* Driver for converting key files to the binary key format */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "keys2.h"
+
+int main(int argc, char **argv) 
+{
+    if (argc != 3 && argc != 4) {
+        printf("Usage: %s <list.in> <list.out> [compress:0]\n", argv[0]);
+        printf("  Each key file (.key, or .key.gz) in list.in is written "
+               "in the binary\n"
+               "  format to the same name with .bin appended, and the "
+               "new names are\n"
+               "  written to list.out, in the same order\n");
+        return 1;
+    }
+
+    char *list_in = argv[1];
+    char *list_out = argv[2];
+    bool compress = false;
+
+    if (argc >= 4)
+        compress = (atoi(argv[3]) != 0);
+
+    FILE *f = fopen(list_in, "r");
+    if (f == NULL) {
+        printf("Could not open file: %s\n", list_in);
+        return 1;
+    }
+
+    std::vector<std::string> key_files;
+    char buf[256];
+    while (fgets(buf, 256, f)) {
+        /* Remove trailing newline */
+        if (buf[strlen(buf) - 1] == '\n')
+            buf[strlen(buf) - 1] = 0;
+
+        key_files.push_back(std::string(buf));
+    }
+
+    fclose(f);
+
+    int num_files = (int) key_files.size();
+    std::vector<std::string> bin_files(num_files);
+    long long total_keys = 0;
+    int num_empty = 0, num_failed = 0;
+
+    printf("[VocabConvertKeys] Converting %d key files%s...\n", 
+           num_files, compress ? " (compressed)" : "");
+    fflush(stdout);
+
+    /* Files are independent, so they are converted in parallel */
+#pragma omp parallel for schedule(dynamic, 1) \
+    reduction(+:total_keys, num_empty, num_failed)
+    for (int i = 0; i < num_files; i++) {
+        bin_files[i] = key_files[i] + ".bin";
+
+        unsigned char *keys;
+        keypt_t *info;
+        int num_keys = ReadKeyFile(key_files[i].c_str(), &keys, &info);
+
+        /* An unreadable file is written as an empty one, so the
+         * images keep their indices */
+        if (num_keys == 0)
+            num_empty++;
+
+        if (WriteBinaryKeyFile(bin_files[i].c_str(), num_keys, 
+                               keys, info, compress) != num_keys) {
+            num_failed++;
+        }
+
+        total_keys += num_keys;
+
+        delete [] keys;
+        delete [] info;
+    }
+
+    f = fopen(list_out, "w");
+    if (f == NULL) {
+        printf("Could not open file: %s\n", list_out);
+        return 1;
+    }
+
+    for (int i = 0; i < num_files; i++)
+        fprintf(f, "%s\n", bin_files[i].c_str());
+
+    fclose(f);
+
+    printf("[VocabConvertKeys] Converted %lld keys (%d files with no "
+           "keys)\n", total_keys, num_empty);
+
+    if (num_failed > 0) {
+        printf("[VocabConvertKeys] Error: %d files could not be "
+               "written\n", num_failed);
+        return 1;
+    }
+
+    return 0;
+}
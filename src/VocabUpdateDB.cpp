@@ -0,0 +1,173 @@
+/* VocabUpdateDB.cpp */
+/* Driver for adding images to and removing images from an incremental
+ * database */
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keys2.h"
+#include "VocabTree.h"
+#include "VocabWordCache.h"
+
+/* Read a list of lines (key files, or image indices) */
+static int read_list(const char *filename, std::vector<std::string> &lines)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        printf("Error opening file %s for reading\n", filename);
+        return -1;
+    }
+
+    char buf[256];
+    while (fgets(buf, 256, f)) {
+        /* Remove trailing newline */
+        if (buf[strlen(buf) - 1] == '\n')
+            buf[strlen(buf) - 1] = 0;
+
+        lines.push_back(std::string(buf));
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *list_in = NULL;
+    const char *remove_in = NULL;
+    int start_id = 0;
+    bool use_cache = false;
+    bool usage = false;
+
+    /* Take the options out of argv, leaving the positional arguments */
+    int argc_out = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--add") == 0 && i + 2 < argc) {
+            list_in = argv[++i];
+            start_id = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--remove") == 0 && i + 1 < argc) {
+            remove_in = argv[++i];
+        } else if (strcmp(argv[i], "--bow-cache") == 0) {
+            use_cache = true;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            usage = true;
+        } else {
+            argv[argc_out++] = argv[i];
+        }
+    }
+
+    argc = argc_out;
+
+    if (usage || argc != 3) {
+        printf("Usage: %s <db.in> <db.out> [--add <list.in> <start_id>] "
+               "[--remove <ids.in>] [--bow-cache]\n", argv[0]);
+        printf("  db.in must be an incremental database "
+               "(VocabBuildDB --incremental)\n");
+        printf("  --add: add the key files in list.in as images start_id, "
+               "start_id + 1, ...\n");
+        printf("  --remove: remove the images whose indices are listed "
+               "in ids.in\n");
+        printf("  --bow-cache: take the words of each key file from its "
+               "word cache\n"
+               "               (<file>.<checksum>.bow) if one was written "
+               "for this tree,\n"
+               "               and write it otherwise\n");
+        return 1;
+    }
+
+    char *db_in = argv[1];
+    char *db_out = argv[2];
+
+    double min_feature_scale = 1.4;
+
+    printf("[VocabUpdateDB] Reading database %s...\n", db_in);
+    fflush(stdout);
+
+    VocabTree tree;
+    if (tree.Read(db_in) != 0)
+        return 1;
+
+    if (!tree.IsIncremental()) {
+        printf("[VocabUpdateDB] Error: %s is not an incremental database\n",
+               db_in);
+        return 1;
+    }
+
+    /* Quantize as VocabMatch does, so the word caches are shared */
+    tree.Flatten();
+
+    unsigned int cache_checksum = 0;
+    if (use_cache) {
+        cache_checksum = tree.Checksum();
+        printf("[VocabUpdateDB] Using word caches for tree checksum "
+               "%08x\n", cache_checksum);
+    }
+
+    if (remove_in != NULL) {
+        std::vector<std::string> ids;
+        if (read_list(remove_in, ids) != 0)
+            return 1;
+
+        int num_removed = 0;
+        for (int i = 0; i < (int) ids.size(); i++) {
+            if (ids[i].empty())
+                continue;
+
+            if (tree.RemoveImage(atoi(ids[i].c_str())) == 0)
+                num_removed++;
+        }
+
+        printf("[VocabUpdateDB] Removed %d images\n", num_removed);
+    }
+
+    if (list_in != NULL) {
+        std::vector<std::string> key_files;
+        if (read_list(list_in, key_files) != 0)
+            return 1;
+
+        int num_images = (int) key_files.size();
+        for (int i = 0; i < num_images; i++) {
+            const char *keyfile = key_files[i].c_str();
+            ImageWords image;
+
+            if (use_cache) {
+                image.ReadOrQuantize(tree, cache_checksum, keyfile);
+            } else {
+                unsigned char *keys;
+                keypt_t *info;
+                int n = ReadKeyFile(keyfile, &keys, &info);
+
+                image.Quantize(tree, n, keys, info, false);
+
+                delete [] keys;
+                delete [] info;
+            }
+
+            std::vector<unsigned long> words;
+            image.Select(min_feature_scale, 0, words);
+
+            printf("[VocabUpdateDB] Adding vector %d (%d keys)\n",
+                   start_id + i, (int) words.size());
+
+            if (tree.AddWordsToDatabase(start_id + i, words) != 0)
+                return 1;
+        }
+    }
+
+    tree.CompactDatabase();
+    tree.UpdateWeights();
+
+    printf("[VocabUpdateDB] Writing database with %d images...\n",
+           tree.m_database_images);
+    fflush(stdout);
+
+    if (tree.Write(db_out) != 0)
+        return 1;
+
+    return 0;
+}